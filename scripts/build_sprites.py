@@ -192,6 +192,16 @@ def escape_c_byte(c):
 def escape_c_string(s):
 	return b''.join(escape_c_byte(c) for c in s.encode()).decode()
 
+FNV1A_OFFSET = 0xCBF29CE484222325
+FNV1A_PRIME  = 0x00000100000001B3
+
+# same hash as gm_fnv1a() in game_maker.c, used to skip already patched entries
+def fnv1a(data):
+	h = FNV1A_OFFSET
+	for byte in data:
+		h = ((h ^ byte) * FNV1A_PRIME) & 0xFFFFFFFFFFFFFFFF
+	return h
+
 def build_sprites(fp, spritedir, builddir, autofix, debug):
 	font = ImageFont.truetype(find_font('OpenSans_Bold.ttf', 'OpenSans_Regular.ttf', 'Arial.ttf'), 22)
 	kernel = [
@@ -505,7 +515,8 @@ static struct gm_patch_sprt_entry csh3_sprt_%s[] = {
 			((width, height), data) = replacement_txtrs[txtr_index]
 
 			patch_data_externs.append('extern const uint8_t csh3_%05d_data[];' % txtr_index)
-			patch_def.append("GM_PATCH_TXTR(%d, csh3_%05d_data, %d, %d, %d)" % (txtr_index, txtr_index, len(data), width, height))
+			patch_def.append("GM_PATCH_TXTR(%d, csh3_%05d_data, %d, UINT64_C(0x%016x), %d, %d)" % (
+				txtr_index, txtr_index, len(data), fnv1a(data), width, height))
 			data_filename = 'csh3_%05d_data.c' % txtr_index
 
 			hex_data = ',\n\t'.join(', '.join('0x%02x' % byte for byte in data[i:i + 8]) for i in range(0, len(data), 8))
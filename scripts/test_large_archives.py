@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+
+# Runs gminfo, gmdump and gmupdate on sparse archives bigger than 2 GiB.
+#
+# The archives only hold a small AUDO section whose entries lie behind a big
+# hole, so creating them is cheap. gmupdate without --append writes the whole
+# archive again though, which needs about 3 GiB of free space in the temporary
+# directory.
+
+import os
+import sys
+import errno
+import struct
+import shutil
+import tempfile
+import subprocess
+from os.path import join as pjoin
+
+GiB = 1024 ** 3
+MAX_FORM_SIZE = 0xFFFFFFFF
+
+WAVS = [b'RIFF' + struct.pack('<I', 4 + 100 + i) + b'WAVE' + bytes([i]) * (100 + i) for i in range(3)]
+MOD_WAV = b'RIFF' + struct.pack('<I', 4 + 500) + b'WAVE' + b'\x55' * 500
+
+class TestError(Exception):
+	pass
+
+def write_archive(path, gap, file_size=None):
+	"""
+	Write an archive with empty STRG and TXTR sections and an AUDO section
+	whose entries start after a hole of gap bytes. If file_size is given the
+	file is extended to this size behind the FORM chunk.
+	"""
+	strg = struct.pack('<I', 0)
+	txtr = struct.pack('<I', 0)
+	audo_offset = 8 + 8 + len(strg) + 8 + len(txtr)
+	table_size = 4 + 4 * len(WAVS)
+	pos = audo_offset + 8 + table_size + gap
+
+	offsets = []
+	body = bytearray()
+	for wav in WAVS:
+		offsets.append(pos + len(body))
+		body += struct.pack('<I', len(wav)) + wav
+		body += b'\0' * (-len(body) % 4)
+
+	audo_size = table_size + gap + len(body)
+	form_size = 8 + len(strg) + 8 + len(txtr) + 8 + audo_size
+	if form_size > MAX_FORM_SIZE:
+		raise ValueError("gap too big for the archive format: %d" % gap)
+
+	with open(path, 'wb') as fp:
+		fp.write(b'FORM' + struct.pack('<I', form_size))
+		fp.write(b'STRG' + struct.pack('<I', len(strg)) + strg)
+		fp.write(b'TXTR' + struct.pack('<I', len(txtr)) + txtr)
+		fp.write(b'AUDO' + struct.pack('<II', audo_size, len(WAVS)))
+		fp.write(b''.join(struct.pack('<I', offset) for offset in offsets))
+		fp.seek(gap, 1)
+		fp.write(body)
+
+		if file_size is not None:
+			fp.truncate(file_size)
+
+	return offsets
+
+def write_mod(moddir):
+	os.makedirs(pjoin(moddir, 'audo'))
+	with open(pjoin(moddir, 'audo', '0001.wav'), 'wb') as fp:
+		fp.write(MOD_WAV)
+
+def run(args, expect_success=True):
+	proc = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+	output = proc.stdout.decode('utf-8', 'replace')
+	if (proc.returncode == 0) != expect_success:
+		raise TestError("%s exited with %d:\n%s" % (' '.join(args), proc.returncode, output))
+	return output
+
+def read_file(path):
+	with open(path, 'rb') as fp:
+		return fp.read()
+
+def snapshot(path):
+	"""
+	Cheap fingerprint of a sparse archive: its size, the headers at the start
+	and the entries at the end.
+	"""
+	size = os.path.getsize(path)
+	with open(path, 'rb') as fp:
+		head = fp.read(4096)
+		fp.seek(max(size - 4096, 0))
+		tail = fp.read()
+	return size, head, tail
+
+class Tester:
+	def __init__(self, bindir, binext, tmpdir):
+		self.bindir = bindir
+		self.binext = binext
+		self.tmpdir = tmpdir
+		self.moddir = pjoin(tmpdir, 'mod')
+		write_mod(self.moddir)
+
+	def tool(self, name):
+		return pjoin(self.bindir, name + self.binext)
+
+	def check_info(self, archive, offsets):
+		output = run([self.tool('gminfo'), archive])
+		for offset in offsets:
+			# gminfo prints the offset of the data, after the size prefix
+			if ('0x%010X' % (offset + 4)) not in output:
+				raise TestError("%s: gminfo doesn't list the entry at 0x%X:\n%s" % (archive, offset, output))
+
+	def check_dump(self, archive, expected):
+		outdir = tempfile.mkdtemp(dir=self.tmpdir)
+		try:
+			run([self.tool('gmdump'), archive, outdir])
+			for index, data in enumerate(expected):
+				path = pjoin(outdir, 'audo', '%04d.wav' % index)
+				if read_file(path) != data:
+					raise TestError("%s: gmdump wrote a wrong %s" % (archive, path))
+		finally:
+			shutil.rmtree(outdir)
+
+	def check_patch(self, archive, append):
+		args = [self.tool('gmupdate')]
+		if append:
+			args.append('--append')
+		run(args + [archive, self.moddir])
+		self.check_dump(archive, [WAVS[0], MOD_WAV, WAVS[2]])
+
+	def check_too_big(self, archive, append):
+		before = snapshot(archive)
+		files = sorted(os.listdir(self.tmpdir))
+
+		args = [self.tool('gmupdate')]
+		if append:
+			args.append('--append')
+		output = run(args + [archive, self.moddir], expect_success=False)
+
+		if os.strerror(errno.EFBIG) not in output:
+			raise TestError("%s: expected EFBIG, got:\n%s" % (archive, output))
+
+		if snapshot(archive) != before:
+			raise TestError("%s: archive was changed by a failed patch" % archive)
+
+		if sorted(os.listdir(self.tmpdir)) != files:
+			raise TestError("%s: failed patch left files behind" % archive)
+
+	def test(self, name, func, *args):
+		print("%s..." % name, end="")
+		sys.stdout.flush()
+		func(*args)
+		print(" OK")
+
+	def run_all(self):
+		archive = pjoin(self.tmpdir, 'game.unx')
+
+		def large(append):
+			offsets = write_archive(archive, 3 * GiB)
+			self.check_info(archive, offsets)
+			self.check_dump(archive, WAVS)
+			self.check_patch(archive, append)
+			os.remove(archive)
+
+		# the FORM chunk can't describe more than 4 GiB, so this is a 3 GiB
+		# archive followed by 2 GiB of padding, which the tools must skip
+		def padded(append):
+			offsets = write_archive(archive, 3 * GiB, 5 * GiB)
+			self.check_info(archive, offsets)
+			self.check_dump(archive, WAVS)
+			self.check_patch(archive, append)
+			os.remove(archive)
+
+		# leaves less than 100 bytes until the FORM size overflows, the
+		# replacement entry is about 400 bytes bigger than the original
+		def too_big(append):
+			write_archive(archive, MAX_FORM_SIZE - 500)
+			self.check_too_big(archive, append)
+			os.remove(archive)
+
+		self.test("3 GiB archive", large, False)
+		self.test("3 GiB archive, --append", large, True)
+		self.test("5 GiB file", padded, False)
+		self.test("5 GiB file, --append", padded, True)
+		self.test("archive growing past 4 GiB", too_big, False)
+		self.test("archive growing past 4 GiB, --append", too_big, True)
+
+if __name__ == '__main__':
+	import argparse
+
+	parser = argparse.ArgumentParser(description="Test gminfo, gmdump and gmupdate with archives bigger than 2 GiB.")
+
+	parser.add_argument('--bindir', default='build/linux64')
+	parser.add_argument('--binext', default='')
+	parser.add_argument('--tmpdir', default=None,
+		help="directory for the temporary archives, needs about 3 GiB of free space")
+
+	args = parser.parse_args()
+
+	tmpdir = tempfile.mkdtemp(prefix='gm_large_', dir=args.tmpdir)
+	try:
+		Tester(args.bindir, args.binext, tmpdir).run_all()
+	except TestError as exc:
+		print(" FAILED")
+		print(exc, file=sys.stderr)
+		sys.exit(1)
+	finally:
+		shutil.rmtree(tmpdir)
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+# Patches small synthetic archives with gmupdate and checks the result with
+# gminfo and gmdump: entries that change size without changing the size of
+# their section and entries that share their data (aliases).
+
+import os
+import sys
+import struct
+import shutil
+import tempfile
+from os.path import join as pjoin
+from test_large_archives import TestError, run, read_file
+
+def wav(fill, size):
+	return b'RIFF' + struct.pack('<I', size - 8) + b'WAVE' + bytes([fill]) * (size - 12)
+
+WAVS = [wav(0, 0x70), wav(1, 0x71), wav(2, 0x72)]
+
+def write_archive(path, wavs, table):
+	"""
+	Write an archive with empty STRG and TXTR sections and an AUDO section
+	holding wavs. table lists the index into wavs for each entry, so entries
+	can share their data.
+	"""
+	strg = struct.pack('<I', 0)
+	txtr = struct.pack('<I', 0)
+	audo_offset = 8 + 8 + len(strg) + 8 + len(txtr)
+	pos = audo_offset + 8 + 4 + 4 * len(table)
+
+	offsets = []
+	body = bytearray()
+	for data in wavs:
+		offsets.append(pos + len(body))
+		body += struct.pack('<I', len(data)) + data
+		body += b'\0' * (-len(body) % 4)
+
+	audo = struct.pack('<I', len(table)) + b''.join(struct.pack('<I', offsets[index]) for index in table) + body
+	form = b'STRG' + struct.pack('<I', len(strg)) + strg + \
+	       b'TXTR' + struct.pack('<I', len(txtr)) + txtr + \
+	       b'AUDO' + struct.pack('<I', len(audo)) + audo
+
+	with open(path, 'wb') as fp:
+		fp.write(b'FORM' + struct.pack('<I', len(form)) + form)
+
+	return [offsets[index] for index in table]
+
+def read_audo_table(path):
+	data = read_file(path)
+	offset = 8
+	while offset < len(data):
+		magic, size = struct.unpack_from('<4sI', data, offset)
+		if magic == b'AUDO':
+			count, = struct.unpack_from('<I', data, offset + 8)
+			return list(struct.unpack_from('<%dI' % count, data, offset + 12))
+		offset += 8 + size
+	raise TestError("%s: no AUDO section" % path)
+
+class Tester:
+	def __init__(self, bindir, binext, tmpdir):
+		self.bindir = bindir
+		self.binext = binext
+		self.tmpdir = tmpdir
+		self.archive = pjoin(tmpdir, 'game.unx')
+
+	def tool(self, name):
+		return pjoin(self.bindir, name + self.binext)
+
+	def patch(self, mods, append=False):
+		moddir = tempfile.mkdtemp(dir=self.tmpdir)
+		os.makedirs(pjoin(moddir, 'audo'))
+		for index, data in mods.items():
+			with open(pjoin(moddir, 'audo', '%04d.wav' % index), 'wb') as fp:
+				fp.write(data)
+
+		args = [self.tool('gmupdate')]
+		if append:
+			args.append('--append')
+		run(args + [self.archive, moddir])
+		shutil.rmtree(moddir)
+
+	def check(self, expected):
+		run([self.tool('gminfo'), self.archive])
+
+		outdir = tempfile.mkdtemp(dir=self.tmpdir)
+		try:
+			run([self.tool('gmdump'), self.archive, outdir])
+			for index, data in enumerate(expected):
+				path = pjoin(outdir, 'audo', '%04d.wav' % index)
+				if read_file(path) != data:
+					raise TestError("%s: gmdump wrote a wrong %s" % (self.archive, path))
+		finally:
+			shutil.rmtree(outdir)
+
+	def test(self, name, func):
+		print("%s..." % name, end="")
+		sys.stdout.flush()
+		func()
+		print(" OK")
+
+	def run_all(self):
+		def resized_same_section_size():
+			write_archive(self.archive, WAVS, [0, 1, 2])
+			size = os.path.getsize(self.archive)
+			mods = {0: wav(3, 0x70 + 100), 1: wav(4, 0x71 - 100)}
+			self.patch(mods)
+			if os.path.getsize(self.archive) != size:
+				raise TestError("%s: archive size changed" % self.archive)
+			self.check([mods[0], mods[1], WAVS[2]])
+
+		def alias_kept():
+			write_archive(self.archive, WAVS, [0, 0, 1, 2])
+			mods = {2: wav(5, 0x71 + 200)}
+			self.patch(mods)
+			table = read_audo_table(self.archive)
+			if table[0] != table[1]:
+				raise TestError("%s: alias was split: %r" % (self.archive, table))
+			self.check([WAVS[0], WAVS[0], mods[2], WAVS[2]])
+
+		def alias_patched():
+			write_archive(self.archive, WAVS, [0, 1, 1, 2])
+			mods = {2: wav(6, 0x71 + 50)}
+			self.patch(mods)
+			table = read_audo_table(self.archive)
+			if table[1] != table[2]:
+				raise TestError("%s: alias was split: %r" % (self.archive, table))
+			self.check([WAVS[0], mods[2], mods[2], WAVS[2]])
+
+		def alias_appended():
+			write_archive(self.archive, WAVS, [0, 1, 1, 2])
+			mods = {1: wav(7, 0x71 + 50)}
+			self.patch(mods, append=True)
+			self.check([WAVS[0], mods[1], WAVS[1], WAVS[2]])
+
+		self.test("entries resized, section size unchanged", resized_same_section_size)
+		self.test("aliased entries", alias_kept)
+		self.test("patched aliased entry", alias_patched)
+		self.test("patched aliased entry, --append", alias_appended)
+
+if __name__ == '__main__':
+	import argparse
+
+	parser = argparse.ArgumentParser(description="Test how gmupdate lays out patched entries.")
+
+	parser.add_argument('--bindir', default='build/linux64')
+	parser.add_argument('--binext', default='')
+
+	args = parser.parse_args()
+
+	tmpdir = tempfile.mkdtemp(prefix='gm_layout_')
+	try:
+		Tester(args.bindir, args.binext, tmpdir).run_all()
+	except TestError as exc:
+		print(" FAILED")
+		print(exc, file=sys.stderr)
+		sys.exit(1)
+	finally:
+		shutil.rmtree(tmpdir)
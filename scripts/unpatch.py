@@ -36,6 +36,10 @@ if __name__ == '__main__':
 		elif exists(backup):
 			sys.stderr.write('*** Error: Backup exists but is not a file: %s\n' % backup)
 			sys.exit(1)
+		elif isfile(archive + '.gmdelta'):
+			# newer versions only store what is needed to restore the archive
+			sys.stderr.write('*** Error: Archive was patched with a delta, restore it with gmunpatch: %s\n' % archive)
+			sys.exit(1)
 		else:
 			sys.stderr.write('*** Error: Backup does not exist: %s\n' % backup)
 			sys.exit(1)
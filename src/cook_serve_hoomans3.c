@@ -18,73 +18,7 @@
 #include <limits.h>
 #include <assert.h>
 
-#ifdef __linux__
-
-// use sendfile() under Linux for zero-context switch file copy
-#include <fcntl.h>
-#include <sys/sendfile.h>
-
-static int copyfile(const char *src, const char *dst) {
-	int status =  0;
-	int infd   = -1;
-	int outfd  = -1;
-	struct stat info;
-
-	infd = open(src, O_RDONLY);
-	if (infd < 0) {
-		goto error;
-	}
-
-	if (fstat(infd, &info) < 0) {
-		goto error;
-	}
-
-	outfd = open(dst, O_CREAT | O_WRONLY, info.st_mode);
-	if (outfd < 0) {
-		goto error;
-	}
-
-	if (sendfile(outfd, infd, NULL, (size_t)info.st_size) < (ssize_t)info.st_size) {
-		goto error;
-	}
-
-	goto end;
-
-error:
-	status = -1;
-
-end:
-	if (infd >= 0) {
-		close(infd);
-		infd = -1;
-	}
-
-	if (outfd >= 0) {
-		close(outfd);
-		outfd = -1;
-	}
-
-	return status;
-}
-
-#elif defined(GM_WINDOWS)
-
-#include <windows.h>
-#include <errno.h>
-
-static int copyfile(const char *src, const char *dst) {
-	if (CopyFile(src, dst, FALSE)) {
-		return 0;
-	}
-
-	switch (GetLastError()) {
-		case ERROR_FILE_NOT_FOUND: errno = ENOENT; break;
-		case ERROR_ACCESS_DENIED:  errno = EACCES; break;
-		default:                   errno = EINVAL; break;
-	}
-
-	return -1;
-}
+#if defined(GM_WINDOWS)
 
 const char *basename(const char *name) {
 	if (name == NULL) {
@@ -105,59 +39,6 @@ const char *basename(const char *name) {
 	return name;
 }
 
-#else
-
-static int copyfile(const char *src, const char *dst) {
-	char buf[BUFSIZ];
-	FILE *fsrc = NULL;
-	FILE *fdst = NULL;
-	int status = 0;
-
-	fsrc = fopen(src, "rb");
-	if (!fsrc) {
-		goto error;
-	}
-
-	fdst = fopen(dst, "wb");
-	if (!fdst) {
-		goto error;
-	}
-
-	for (;;) {
-		size_t count = fread(buf, 1, BUFSIZ, fsrc);
-
-		if (count < BUFSIZ && ferror(fsrc)) {
-			goto error;
-		}
-
-		if (count > 0 && fwrite(buf, 1, count, fdst) != count) {
-			goto error;
-		}
-
-		if (count < BUFSIZ) {
-			break;
-		}
-	}
-
-	goto end;
-
-error:
-	status = -1;
-
-end:
-
-	if (fsrc) {
-		fclose(fsrc);
-		fsrc = NULL;
-	}
-
-	if (fdst) {
-		fclose(fdst);
-		fdst = NULL;
-	}
-
-	return status;
-}
 #endif
 
 int main(int argc, char *argv[]) {
@@ -167,15 +48,51 @@ int main(int argc, char *argv[]) {
 	const char *game_name = NULL;
 	const char *game_leaf = NULL;
 	struct stat st;
-
-	if (argc > 2) {
-		fprintf(stderr, "*** ERROR: Please pass the %s file to this program.\n", CSH3_GAME_ARCHIVE);
+	bool unpatch = false;
+	// reused when the original archive is restored, e.g. by a game update
+	int flags = GM_PATCH_PLAN_CACHE;
+	const struct gm_patch **layers = NULL;
+	size_t layer_count = 0;
+
+	if (argc > 1 && strcmp(argv[1], "--unpatch") == 0) {
+		unpatch = true;
+		-- argc;
+		++ argv;
+	}
+
+	// The built-in patches come first, so mod directories (in the same layout
+	// as gmdump creates) can override them.
+	layers = calloc(argc + 1, sizeof(struct gm_patch*));
+	if (layers == NULL) {
+		perror("*** ERROR");
 		goto error;
 	}
-	else if (argc == 2) {
-		game_name = argv[1];
+	layers[layer_count ++] = csh3_patches;
+
+	for (int i = 1; i < argc; ++ i) {
+		if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+			if (unpatch) {
+				fprintf(stderr, "*** ERROR: --unpatch doesn't take mod directories.\n");
+				goto error;
+			}
+
+			struct gm_patch *mod = gm_read_patch_dir(argv[i]);
+			if (mod == NULL) {
+				fprintf(stderr, "*** ERROR: Error reading mod directory %s: %s\n", argv[i], strerror(errno));
+				goto error;
+			}
+			layers[layer_count ++] = mod;
+		}
+		else if (game_name == NULL) {
+			game_name = argv[i];
+		}
+		else {
+			fprintf(stderr, "*** ERROR: Please pass the %s file to this program.\n", CSH3_GAME_ARCHIVE);
+			goto error;
+		}
 	}
-	else {
+
+	if (game_name == NULL) {
 		game_name_buf = csd3_find_archive();
 		if (game_name_buf == NULL) {
 			fprintf(stderr, "*** ERROR: Couldn't find %s file.\n", CSH3_GAME_ARCHIVE);
@@ -187,7 +104,20 @@ int main(int argc, char *argv[]) {
 
 	printf("Found game archive: %s\n", game_name);
 
-	// create backup if there isn't one
+	if (unpatch) {
+		printf("Restoring the original game archive...\n");
+
+		if (gm_unpatch_archive(game_name) != 0) {
+			fprintf(stderr, "*** ERROR: Error restoring archive: %s\n", strerror(errno));
+			goto error;
+		}
+
+		printf("Successfully removed the mod.\n");
+		goto end;
+	}
+
+	// Full backups of older versions are kept. Otherwise only the data needed
+	// to restore the original archive is saved.
 	backup_name = GM_CONCAT(game_name, ".backup");
 	if (backup_name == NULL) {
 		perror("*** ERROR: creatig backup file name");
@@ -200,26 +130,23 @@ int main(int argc, char *argv[]) {
 			goto error;
 		}
 		printf("Keeping existing backup of game archive.\n");
+		printf("If you want to remove the mod again delete %s and rename %s.backup to %s (both files are in the same folder).\n",
+			game_leaf, game_leaf, game_leaf);
 	}
 	else if (errno == ENOENT) {
-		printf("Creating backup of game archive...\n");
-		if (copyfile(game_name, backup_name) != 0) {
-			perror("*** ERROR: Creatig backup");
-			goto error;
-		}
+		flags |= GM_PATCH_DELTA;
+		printf("The data needed to remove the mod again is saved to %s%s.\n", game_leaf, GM_DELTA_EXT);
+		printf("If you want to remove the mod run this program with --unpatch (or use gmunpatch).\n");
 	}
 	else {
 		perror("*** ERROR: Error accessing backup file");
 		goto error;
 	}
 
-	printf("If you want to remove the mod again delete %s and rename %s.backup to %s (both files are in the same folder).\n",
-		game_leaf, game_leaf, game_leaf);
-
 	printf("Patching the game...\n");
 
-	// patch the archive
-	if (gm_patch_archive(game_name, csh3_patches) != 0) {
+	// patch the archive, with all mods in one pass
+	if (gm_patch_archive_layers(game_name, layers, layer_count, flags) != 0) {
 		fprintf(stderr, "*** ERROR: Error patching archive: %s\n", strerror(errno));
 		goto error;
 	}
@@ -232,6 +159,15 @@ error:
 	status = EXIT_FAILURE;
 
 end:
+	if (layers != NULL) {
+		// the first layer are the built-in patches
+		for (size_t i = 1; i < layer_count; ++ i) {
+			gm_free_patch_dir((struct gm_patch*)layers[i]);
+		}
+		free(layers);
+		layers = NULL;
+	}
+
 	if (game_name_buf != NULL) {
 		free(game_name_buf);
 		game_name_buf = NULL;
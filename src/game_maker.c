@@ -1,3 +1,8 @@
+#if defined(__linux__)
+// loff_t
+#	define _GNU_SOURCE
+#endif
+
 #include "game_maker.h"
 #include "png_info.h"
 
@@ -10,6 +15,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <ctype.h>
 #include <stdbool.h>
@@ -25,6 +31,10 @@
 	 (uint32_t)((BUF)[0]) | \
 	((uint32_t)((BUF)[1]) << 8))
 
+#define U64LE_FROM_BUF(BUF) ( \
+	 (uint64_t)U32LE_FROM_BUF(BUF) | \
+	((uint64_t)U32LE_FROM_BUF((BUF) + 4) << 32))
+
 #define WRITE_U32LE(BUF,N) { \
 	(BUF)[0] =  (uint32_t)(N)        & 0xFF; \
 	(BUF)[1] = ((uint32_t)(N) >>  8) & 0xFF; \
@@ -32,6 +42,11 @@
 	(BUF)[3] = ((uint32_t)(N) >> 24) & 0xFF; \
 }
 
+#define WRITE_U64LE(BUF,N) { \
+	WRITE_U32LE((BUF),     (uint64_t)(N) & 0xFFFFFFFF); \
+	WRITE_U32LE((BUF) + 4, (uint64_t)(N) >> 32); \
+}
+
 #define WRITE_U16LE(BUF,N) { \
 	(BUF)[0] =  (uint32_t)(N)       & 0xFF; \
 	(BUF)[1] = ((uint32_t)(N) >> 8) & 0xFF; \
@@ -39,1498 +54,7163 @@
 
 #define LOG_ERR(FMT, ...) fprintf(stderr, "*** ERROR: " FMT "\n", ## __VA_ARGS__)
 #define LOG_ERR_MSG(MSG)  fprintf(stderr, "*** ERROR: " MSG "\n")
+#define LOG_WARN(FMT, ...) fprintf(stderr, "*** WARNING: " FMT "\n", ## __VA_ARGS__)
 
 #if defined(GM_WINDOWS)
 #	include <direct.h>
 #	define mkdir(PATH,MODE) _mkdir(PATH)
+#	include <io.h>
+#	define fsync(FD) _commit(FD)
+#	if !defined(ESTALE)
+#		define ESTALE EAGAIN
+#	endif
+#	define GM_MTIME_NSEC(ST) 0
+#else
+#	include <sys/mman.h>
+#	include <pthread.h>
+#	define GM_HAVE_MMAP
+#	define GM_HAVE_THREADS
+#	if defined(__APPLE__)
+#		define GM_MTIME_NSEC(ST) ((ST).st_mtimespec.tv_nsec)
+#	else
+#		define GM_MTIME_NSEC(ST) ((ST).st_mtim.tv_nsec)
+#	endif
 #endif
 
-static int gm_copydata(FILE *src, off_t srcoff, FILE *dst, off_t dstoff, size_t size) {
-	uint8_t buf[BUFSIZ];
+#if defined(__linux__)
+#	include <sys/syscall.h>
+#	include <sys/sendfile.h>
+#	define GM_HAVE_SENDFILE
+#	if defined(__NR_copy_file_range)
+#		define GM_HAVE_COPY_FILE_RANGE
+#	endif
+#	include <fcntl.h>
+#	define GM_HAVE_FALLOCATE
+#	define GM_HAVE_FADVISE
+#	define GM_HAVE_SYNC_FILE_RANGE
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#	if defined(FICLONE) && defined(FICLONERANGE)
+#		define GM_HAVE_FICLONERANGE
+#	endif
+#	if defined(GM_USE_IO_URING) && defined(__NR_io_uring_setup)
+#		include <linux/io_uring.h>
+#		include <sys/uio.h>
+#		define GM_HAVE_IO_URING
+#	endif
+#endif
 
-	if (src == dst) {
-		errno = EINVAL;
-		return -1;
+#define GM_COPY_BUFFER_SIZE (1024 * 1024)
+
+// Page cache hints for passes over the whole archive. Without them such a
+// pass pushes everything else out of the page cache and the dirty pages of
+// the new archive pile up until it is closed. These are only hints, so
+// errors are ignored.
+#define GM_STREAM_CHUNK_SIZE (8 * 1024 * 1024)
+
+enum gm_advice {
+	GM_ADVICE_SEQUENTIAL,
+	GM_ADVICE_WILLNEED,
+	GM_ADVICE_DONTNEED,
+};
+
+static void gm_advise_file(int fd, off_t offset, size_t size, enum gm_advice advice) {
+#if defined(GM_HAVE_FADVISE)
+	static const int advices[] = {
+		[GM_ADVICE_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+		[GM_ADVICE_WILLNEED]   = POSIX_FADV_WILLNEED,
+		[GM_ADVICE_DONTNEED]   = POSIX_FADV_DONTNEED,
+	};
+
+	posix_fadvise(fd, offset, (off_t)size, advices[advice]);
+#else
+	(void)fd;
+	(void)offset;
+	(void)size;
+	(void)advice;
+#endif
+}
+
+// Same for the mapping of an archive. Pages that are done with are only
+// marked as cold, because dropping them from the page cache isn't possible
+// while they are mapped.
+static void gm_advise_archive(const struct gm_archive *archive, size_t offset, size_t size, enum gm_advice advice) {
+#if defined(GM_HAVE_MMAP)
+	if (!archive->mapped || offset >= archive->size) {
+		return;
 	}
 
-	if (fseeko(src, srcoff, SEEK_SET) != 0) {
-		return -1;
+	if (size > archive->size - offset) {
+		size = archive->size - offset;
 	}
 
-	if (fseeko(dst, dstoff, SEEK_SET) != 0) {
-		return -1;
+	const long pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize <= 0) {
+		return;
 	}
 
-	while (size > 0) {
-		size_t chunk_size = size >= BUFSIZ ? BUFSIZ : size;
-		if (fread(buf, chunk_size, 1, src) != 1) {
-			if (!ferror(src)) {
-				LOG_ERR_MSG("unexpected end of file while copying file data");
-				errno = EINVAL;
-			}
-			return -1;
-		}
-		if (fwrite(buf, chunk_size, 1, dst) != 1) {
-			return -1;
-		}
-		size -= chunk_size;
+	// madvise() needs a page aligned address
+	const size_t head = offset % (size_t)pagesize;
+	void *addr = (void*)(archive->data + offset - head);
+	size += head;
+
+	switch (advice) {
+	case GM_ADVICE_SEQUENTIAL:
+		madvise(addr, size, MADV_SEQUENTIAL);
+		break;
+
+	case GM_ADVICE_WILLNEED:
+		madvise(addr, size, MADV_WILLNEED);
+		break;
+
+	case GM_ADVICE_DONTNEED:
+#if defined(MADV_COLD)
+		madvise(addr, size, MADV_COLD);
+#endif
+		break;
 	}
+#else
+	(void)archive;
+	(void)offset;
+	(void)size;
+	(void)advice;
+#endif
+}
 
-	return 0;
+// Incremental write back of a file that is written from start to end. Each
+// finished chunk is sent to the disk right away, and the chunk before it is
+// waited for and dropped from the page cache, so only about two chunks are
+// dirty at any time.
+struct gm_writeback {
+	int   fd;
+	off_t flushed; // end of the chunk that was last sent to the disk
+	off_t synced;  // everything before this is on the disk
+};
+
+static void gm_writeback_init(struct gm_writeback *writeback, FILE *fp) {
+	writeback->fd      = fileno(fp);
+	writeback->flushed = 0;
+	writeback->synced  = 0;
 }
 
-#if defined(GM_WINDOWS)
-#define WIN_PATH_UNC  "\\\\?\\UNC\\"
-#define WIN_PATH_QM   "\\\\?\\"
-#define WIN_PATH_DOT  "\\\\.\\"
-#define WIN_PATH_BKSL "\\\\"
+static void gm_writeback(struct gm_writeback *writeback, FILE *fp) {
+#if defined(GM_HAVE_SYNC_FILE_RANGE)
+	if (fflush(fp) != 0) {
+		return;
+	}
 
-static bool gm_starts_with_ignore_case(const char *string, const char *prefix) {
-	size_t index = 0;
-	char ch = 0;
-	while ((ch = prefix[index])) {
-		if (tolower(ch) != tolower(string[index])) {
-			return false;
-		}
-		++ index;
+	const off_t end = ftello(fp);
+	if (end < 0 || end - writeback->flushed < GM_STREAM_CHUNK_SIZE) {
+		return;
 	}
-	return true;
+
+	sync_file_range(writeback->fd, writeback->flushed, end - writeback->flushed, SYNC_FILE_RANGE_WRITE);
+
+	if (writeback->flushed > writeback->synced) {
+		sync_file_range(writeback->fd, writeback->synced, writeback->flushed - writeback->synced,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		gm_advise_file(writeback->fd, writeback->synced, (size_t)(writeback->flushed - writeback->synced), GM_ADVICE_DONTNEED);
+		writeback->synced = writeback->flushed;
+	}
+
+	writeback->flushed = end;
+#else
+	(void)writeback;
+	(void)fp;
+#endif
 }
 
-// TODO: actually only sometimes '/' is equal to '\\'
-static const char *gm_skip_path_components(const char *path, size_t count) {
-	while (*path && count > 0) {
-		while (*path && *path != '\\' && *path != '/') {
-			++ path;
+// Starts writing a small file to the disk without waiting for it.
+static void gm_start_writeback(FILE *fp) {
+#if defined(GM_HAVE_SYNC_FILE_RANGE)
+	if (fflush(fp) == 0) {
+		sync_file_range(fileno(fp), 0, 0, SYNC_FILE_RANGE_WRITE);
+	}
+#else
+	(void)fp;
+#endif
+}
+
+#if defined(GM_HAVE_SENDFILE)
+// Errors that only mean that the kernel can't copy between these files.
+#define GM_COPY_UNSUPPORTED(ERRNUM) \
+	((ERRNUM) == ENOSYS || (ERRNUM) == EXDEV  || (ERRNUM) == EINVAL || \
+	 (ERRNUM) == EBADF  || (ERRNUM) == EPERM  || (ERRNUM) == ETXTBSY || \
+	 (ERRNUM) == EOPNOTSUPP)
+
+// Copies without moving the data through user space, first trying
+// copy_file_range() and then sendfile(). *copied is the number of bytes
+// that were copied, the rest has to be copied by the caller.
+static int gm_copy_range_syscall(int infd, off_t srcoff, int outfd, off_t dstoff, size_t size, size_t *copied) {
+	*copied = 0;
+
+#if defined(GM_HAVE_COPY_FILE_RANGE)
+	while (*copied < size) {
+		loff_t inoff  = (loff_t)srcoff + (loff_t)*copied;
+		loff_t outoff = (loff_t)dstoff + (loff_t)*copied;
+
+		// called directly, older C libraries don't have a wrapper
+		const ssize_t count = syscall(__NR_copy_file_range, infd, &inoff, outfd, &outoff, size - *copied, 0u);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (GM_COPY_UNSUPPORTED(errno)) {
+				break;
+			}
+			return -1;
 		}
 
-		while (*path == '\\' || *path == '/') {
-			++ path;
+		if (count == 0) {
+			// end of file, reported by the caller
+			return 0;
 		}
 
-		-- count;
+		*copied += (size_t)count;
 	}
+#endif
 
-	return path;
-}
-
-static const char *gm_skip_win_root(const char *path) {
-	if (isalpha(path[0]) && path[1] == ':' && (!path[2] || path[2] == '\\' || path[2] == '/')) {
-		if (!path[2]) {
-			return path + 2;
+	if (*copied < size) {
+		// sendfile() writes at the current position of outfd
+		if (lseek(outfd, dstoff + (off_t)*copied, SEEK_SET) < 0) {
+			return -1;
 		}
-		return path + 3;
-	}
 
-	if (gm_starts_with_ignore_case(path, WIN_PATH_UNC)) {
-		return gm_skip_path_components(path + sizeof(WIN_PATH_UNC) - 1, 2);
-	}
+		while (*copied < size) {
+			off_t inoff = srcoff + (off_t)*copied;
 
-	if (gm_starts_with_ignore_case(path, WIN_PATH_QM)) {
-		path += sizeof(WIN_PATH_QM) - 1;
+			const ssize_t count = sendfile(outfd, infd, &inoff, size - *copied);
+			if (count < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (GM_COPY_UNSUPPORTED(errno)) {
+					break;
+				}
+				return -1;
+			}
 
-		if (isalpha(path[0]) && path[1] == ':' && (!path[2] || path[2] == '\\' || path[2] == '/')) {
-			if (!path[2]) {
-				return path + 2;
+			if (count == 0) {
+				break;
 			}
-			return path + 3;
+
+			*copied += (size_t)count;
 		}
+	}
 
-		return gm_skip_path_components(path, 2);
+	return 0;
+}
+
+#if defined(GM_HAVE_FICLONERANGE)
+// Finds the part of the range that can be shared with the source file on
+// a reflink capable file system. Cloning works on whole file system blocks,
+// so both offsets have to be at the same position within a block.
+static bool gm_clone_span(int infd, off_t srcoff, int outfd, off_t dstoff, size_t size, size_t *head, size_t *length) {
+	struct stat inst, outst;
+
+	if (fstat(infd, &inst) != 0 || fstat(outfd, &outst) != 0) {
+		return false;
 	}
 
-	if (gm_starts_with_ignore_case(path, WIN_PATH_DOT)) {
-		return gm_skip_path_components(path + sizeof(WIN_PATH_DOT) - 1, 1);
+	if (inst.st_dev != outst.st_dev || outst.st_blksize <= 0) {
+		return false;
 	}
 
-	if (gm_starts_with_ignore_case(path, WIN_PATH_BKSL)) {
-		return gm_skip_path_components(path + sizeof(WIN_PATH_BKSL) - 1, 2);
+	const off_t blksize = outst.st_blksize;
+	if (srcoff % blksize != dstoff % blksize) {
+		return false;
 	}
 
-	return path;
+	*head = (size_t)((blksize - srcoff % blksize) % blksize);
+	if (*head >= size) {
+		return false;
+	}
+
+	*length = (size - *head) - (size - *head) % (size_t)blksize;
+
+	return *length > 0;
 }
 #endif
 
-static int gm_mkpath(const char *pathname) {
-	char *buf = NULL;
-	struct stat st;
-	int status = 0;
+// Copies size bytes from infd to outfd in the kernel. Block aligned parts
+// are cloned when the file system supports it, so they don't take up any
+// additional space.
+static int gm_copy_range_kernel(int infd, off_t srcoff, int outfd, off_t dstoff, size_t size, size_t *copied) {
+	*copied = 0;
 
-	if (!pathname) {
-		LOG_ERR_MSG("pathname cannot be NULL");
+#if defined(GM_HAVE_FICLONERANGE)
+	size_t head = 0, length = 0;
+	if (gm_clone_span(infd, srcoff, outfd, dstoff, size, &head, &length)) {
+		if (gm_copy_range_syscall(infd, srcoff, outfd, dstoff, head, copied) != 0) {
+			return -1;
+		}
 
-		errno = EINVAL;
-		goto error;
-	}
+		if (*copied < head) {
+			return 0;
+		}
 
-	if (!*pathname) {
-		LOG_ERR_MSG("pathname cannot be empty");
+		struct file_clone_range range = {
+			.src_fd      = infd,
+			.src_offset  = (uint64_t)(srcoff + (off_t)head),
+			.src_length  = (uint64_t)length,
+			.dest_offset = (uint64_t)(dstoff + (off_t)head),
+		};
 
-		errno = EINVAL;
-		goto error;
+		// any error just means this range has to be copied instead
+		if (ioctl(outfd, FICLONERANGE, &range) == 0) {
+			*copied += length;
+		}
 	}
+#endif
 
-	buf = strdup(pathname);
-	if (buf == NULL) {
-		goto error;
+	size_t rest = 0;
+	if (gm_copy_range_syscall(infd, srcoff + (off_t)*copied, outfd, dstoff + (off_t)*copied, size - *copied, &rest) != 0) {
+		return -1;
 	}
 
-	char *ptr = buf;
+	*copied += rest;
 
-#if defined(GM_WINDOWS)
-	// skip UNC prefix or drive letter
-	ptr = (char*)gm_skip_win_root(ptr);
+	return 0;
+}
 #endif
 
-	for (;; ++ ptr) {
-		// skip redundant path seperators
-#if defined(GM_WINDOWS)
-		while (*ptr == '\\' || *ptr == '/') ++ ptr;
-#else
-		while (*ptr == '/') ++ ptr;
-#endif
+#if defined(GM_HAVE_IO_URING)
+// Without liburing: only the bits of the ring that a copy needs, set up
+// with the raw system calls.
+#define GM_URING_DEPTH      8
+#define GM_URING_CHUNK_SIZE (256 * 1024)
 
-		// find end of current path component
-		for (; *ptr; ++ ptr) {
-#if defined(GM_WINDOWS)
-			if (*ptr == '\\' || *ptr == '/') break;
-#else
-			if (*ptr == '/') break;
-#endif
-		}
+struct gm_uring {
+	int fd;
 
-		char ch = *ptr;
-		*ptr = '\0';
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
 
-		if (stat(buf, &st) == 0) {
-			if (!S_ISDIR(st.st_mode)) {
-				LOG_ERR("exists but is not a directory: %s", buf);
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
 
-				errno = ENOTDIR;
-				goto error;
-			}
-		}
-		else if (errno != ENOENT) {
-			goto error;
-		}
-		else if (mkdir(buf, S_IRWXU) != 0) {
-			goto error;
-		}
+	void  *sq_ring;
+	size_t sq_ring_size;
+	void  *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
 
-		*ptr = ch;
-		if (!ch) break;
+	unsigned to_submit;
+};
+
+// A buffer that is read into and then written out again. Each slot has at
+// most one request in flight.
+struct gm_uring_slot {
+	struct iovec iov;
+	uint8_t *buf;
+	size_t offset; // relative to the start of the copied range
+	size_t size;
+	size_t done;
+	bool   writing;
+	bool   busy;
+};
+
+static void gm_uring_close(struct gm_uring *ring) {
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
 	}
 
-	goto end;
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
 
-error:
-	status = -1;
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
 
-end:
-	if (buf != NULL) {
-		free(buf);
+	if (ring->fd >= 0) {
+		close(ring->fd);
 	}
 
-	return status;
+	memset(ring, 0, sizeof(struct gm_uring));
+	ring->fd = -1;
 }
 
-static int gm_write_patch_data(FILE *fp, const struct gm_patch *patch) {
-	int status = 0;
+static int gm_uring_setup(struct gm_uring *ring, unsigned entries) {
+	struct io_uring_params params;
 
-	switch (patch->patch_src) {
-	case GM_SRC_MEM:
-		if (fwrite(patch->src.data, patch->size, 1, fp) != 1) {
-			status = -1;
-		}
-		break;
+	memset(ring, 0, sizeof(struct gm_uring));
+	memset(&params, 0, sizeof(params));
 
-	case GM_SRC_FILE:
-		{
-			FILE *infile = fopen(patch->src.filename, "rb");
-			if (infile) {
-				status = gm_copydata(infile, 0, fp, ftello(fp), patch->size);
-				fclose(infile);
-			}
-			else {
-				status = -1;
-			}
-		}
-		break;
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		return -1;
+	}
 
-	default:
-		errno = EINVAL;
-		status = -1;
-		break;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+		ring->sq_ring_size = ring->cq_ring_size;
 	}
 
-	return status;
-}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		goto error;
+	}
 
-void gm_free_index(struct gm_index *index) {
-	if (index) {
-		for (struct gm_index *ptr = index; ptr->section != GM_END; ++ ptr) {
-			if (ptr->entries) {
-				switch (ptr->section) {
-				case GM_STRG:
-					for (size_t index = 0; index < ptr->entry_count; ++ index) {
-						free(ptr->entries[index].meta.strg);
-						ptr->entries[index].meta.strg = NULL;
-					}
-					break;
+	ring->cq_ring = single_mmap ? ring->sq_ring :
+		mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED) {
+		goto error;
+	}
 
-				case GM_SPRT:
-					for (size_t index = 0; index < ptr->entry_count; ++ index) {
-						free(ptr->entries[index].meta.sprt.name);
-						ptr->entries[index].meta.sprt.name = NULL;
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		goto error;
+	}
 
-						free(ptr->entries[index].meta.sprt.tpag);
-						ptr->entries[index].meta.sprt.tpag = NULL;
-					}
-					break;
+	uint8_t *sq_ring = ring->sq_ring;
+	uint8_t *cq_ring = ring->cq_ring;
 
-				default:
-					break;
-				}
-				free(ptr->entries);
-				ptr->entries = NULL;
-			}
-		}
-		free(index);
+	ring->sq_tail  = (unsigned*)(sq_ring + params.sq_off.tail);
+	ring->sq_mask  = (unsigned*)(sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq_ring + params.sq_off.array);
+	ring->cq_head  = (unsigned*)(cq_ring + params.cq_off.head);
+	ring->cq_tail  = (unsigned*)(cq_ring + params.cq_off.tail);
+	ring->cq_mask  = (unsigned*)(cq_ring + params.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+
+	return 0;
+
+error:
+	{
+		int errnum = errno;
+		gm_uring_close(ring);
+		errno = errnum;
 	}
+
+	return -1;
 }
 
-struct gm_patched_index *gm_get_section(struct gm_patched_index *patched, enum gm_section section) {
-	for (; patched->section != GM_END; ++ patched) {
+// Queues the next read or write of slot. Submitted by gm_uring_wait().
+static void gm_uring_queue(struct gm_uring *ring, struct gm_uring_slot *slot, size_t slot_index, int fd, off_t offset) {
+	const unsigned tail  = *ring->sq_tail;
+	const unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	slot->iov.iov_base = slot->buf + slot->done;
+	slot->iov.iov_len  = slot->size - slot->done;
+	slot->busy = true;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode    = slot->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd        = fd;
+	sqe->off       = (uint64_t)(offset + (off_t)slot->offset + (off_t)slot->done);
+	sqe->addr      = (uint64_t)(uintptr_t)&slot->iov;
+	sqe->len       = 1;
+	sqe->user_data = slot_index;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ ring->to_submit;
+}
+
+// Submits the queued requests and waits for at least one completion.
+static int gm_uring_wait(struct gm_uring *ring) {
+	for (;;) {
+		const int count = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1u, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (count >= 0) {
+			ring->to_submit -= (unsigned)count;
+			return 0;
+		}
+
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+// Copies with several reads and writes in flight, so the latencies of both
+// files overlap. Returns 0 with *copied = 0 if io_uring isn't available.
+static int gm_copy_range_uring(int infd, off_t srcoff, int outfd, off_t dstoff, size_t size, size_t *copied) {
+	struct gm_uring ring = { .fd = -1 };
+	struct gm_uring_slot slots[GM_URING_DEPTH];
+	uint8_t *bufs = NULL;
+	size_t inflight = 0;
+	size_t next = 0;
+	size_t done = 0;
+	int status = 0;
+
+	*copied = 0;
+
+	// not worth setting up a ring for
+	if (size < 2 * GM_URING_CHUNK_SIZE) {
+		return 0;
+	}
+
+	if (gm_uring_setup(&ring, GM_URING_DEPTH) != 0) {
+		// kernel too old or io_uring disabled
+		return 0;
+	}
+
+	size_t slot_count = (size + GM_URING_CHUNK_SIZE - 1) / GM_URING_CHUNK_SIZE;
+	if (slot_count > GM_URING_DEPTH) {
+		slot_count = GM_URING_DEPTH;
+	}
+
+	bufs = malloc(slot_count * GM_URING_CHUNK_SIZE);
+	if (!bufs) {
+		goto error;
+	}
+
+	for (size_t index = 0; index < slot_count; ++ index) {
+		struct gm_uring_slot *slot = &slots[index];
+
+		slot->buf     = bufs + index * GM_URING_CHUNK_SIZE;
+		slot->offset  = next;
+		slot->size    = size - next < GM_URING_CHUNK_SIZE ? size - next : GM_URING_CHUNK_SIZE;
+		slot->done    = 0;
+		slot->writing = false;
+		next += slot->size;
+
+		gm_uring_queue(&ring, slot, index, infd, srcoff);
+		++ inflight;
+	}
+
+	while (done < size) {
+		if (gm_uring_wait(&ring) != 0) {
+			goto error;
+		}
+
+		unsigned head = *ring.cq_head;
+		const unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; ++ head) {
+			const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			struct gm_uring_slot *slot = &slots[cqe->user_data];
+			const int res = cqe->res;
+
+			slot->busy = false;
+			-- inflight;
+
+			if (res < 0 && res != -EINTR && res != -EAGAIN) {
+				__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+				errno = -res;
+				goto error;
+			}
+
+			if (res == 0) {
+				__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+				if (slot->writing) {
+					// no progress and no error, don't resubmit forever
+					errno = EIO;
+				}
+				else {
+					LOG_ERR_MSG("unexpected end of file while copying file data");
+					errno = EINVAL;
+				}
+				goto error;
+			}
+
+			if (res > 0) {
+				slot->done += (size_t)res;
+			}
+
+			if (slot->done < slot->size) {
+				// short read or write, continue where it stopped
+				gm_uring_queue(&ring, slot, (size_t)cqe->user_data, slot->writing ? outfd : infd, slot->writing ? dstoff : srcoff);
+				++ inflight;
+			}
+			else if (!slot->writing) {
+				slot->writing = true;
+				slot->done    = 0;
+				gm_uring_queue(&ring, slot, (size_t)cqe->user_data, outfd, dstoff);
+				++ inflight;
+			}
+			else {
+				done += slot->size;
+
+				if (next < size) {
+					slot->offset  = next;
+					slot->size    = size - next < GM_URING_CHUNK_SIZE ? size - next : GM_URING_CHUNK_SIZE;
+					slot->done    = 0;
+					slot->writing = false;
+					next += slot->size;
+
+					gm_uring_queue(&ring, slot, (size_t)cqe->user_data, infd, srcoff);
+					++ inflight;
+				}
+			}
+		}
+
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	*copied = size;
+
+	goto end;
+
+error:
+	status = -1;
+
+	{
+		int errnum = errno;
+
+		// the kernel may still use the buffers, so wait for everything
+		while (inflight > 0 && gm_uring_wait(&ring) == 0) {
+			unsigned head = *ring.cq_head;
+			const unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+			for (; head != tail; ++ head) {
+				-- inflight;
+			}
+
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		errno = errnum;
+	}
+
+end:
+	{
+		int errnum = errno;
+
+		gm_uring_close(&ring);
+		free(bufs);
+
+		errno = errnum;
+	}
+
+	return status;
+}
+#endif
+
+#if defined(GM_HAVE_THREADS)
+static size_t gm_thread_count(void) {
+#if defined(_SC_NPROCESSORS_ONLN)
+	const long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 1 ? (size_t)count : 1;
+#else
+	return 1;
+#endif
+}
+
+// Buffers of the reader/writer pipeline. One thread reads ahead while the
+// other one writes, so the latencies of both files overlap.
+#define GM_PIPELINE_DEPTH 4
+#define GM_PIPELINE_MIN_SIZE (GM_PIPELINE_DEPTH * GM_COPY_BUFFER_SIZE)
+
+struct gm_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+
+	int    infd;
+	off_t  srcoff;
+	size_t size;
+	size_t chunk_count;
+	uint8_t *bufs;
+
+	// chunks read and written so far, only changed while holding the lock
+	size_t filled;
+	size_t drained;
+
+	bool failed;
+	int  errnum;
+};
+
+static size_t gm_pipeline_chunk_size(const struct gm_pipeline *pipeline, size_t chunk) {
+	const size_t offset = chunk * GM_COPY_BUFFER_SIZE;
+	return pipeline->size - offset < GM_COPY_BUFFER_SIZE ? pipeline->size - offset : GM_COPY_BUFFER_SIZE;
+}
+
+static void gm_pipeline_fail(struct gm_pipeline *pipeline, int errnum) {
+	pthread_mutex_lock(&pipeline->lock);
+	if (!pipeline->failed) {
+		pipeline->failed = true;
+		pipeline->errnum = errnum;
+	}
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void *gm_pipeline_reader(void *arg) {
+	struct gm_pipeline *pipeline = arg;
+
+	for (size_t chunk = 0; chunk < pipeline->chunk_count; ++ chunk) {
+		pthread_mutex_lock(&pipeline->lock);
+		while (!pipeline->failed && chunk - pipeline->drained >= GM_PIPELINE_DEPTH) {
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+		}
+		const bool failed = pipeline->failed;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		if (failed) {
+			break;
+		}
+
+		uint8_t *buf = pipeline->bufs + (chunk % GM_PIPELINE_DEPTH) * GM_COPY_BUFFER_SIZE;
+		const size_t chunk_size = gm_pipeline_chunk_size(pipeline, chunk);
+		const off_t offset = pipeline->srcoff + (off_t)(chunk * GM_COPY_BUFFER_SIZE);
+
+		for (size_t done = 0; done < chunk_size;) {
+			const ssize_t count = pread(pipeline->infd, buf + done, chunk_size - done, offset + (off_t)done);
+			if (count < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				gm_pipeline_fail(pipeline, errno);
+				return NULL;
+			}
+
+			if (count == 0) {
+				LOG_ERR_MSG("unexpected end of file while copying file data");
+				gm_pipeline_fail(pipeline, EINVAL);
+				return NULL;
+			}
+
+			done += (size_t)count;
+		}
+
+		pthread_mutex_lock(&pipeline->lock);
+		pipeline->filled = chunk + 1;
+		pthread_cond_broadcast(&pipeline->cond);
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+
+	return NULL;
+}
+
+// Copies with a reader thread that fills a ring of buffers while this
+// thread writes them out. Returns 0 with *copied = 0 if no thread could be
+// started.
+static int gm_copy_range_pipelined(int infd, off_t srcoff, int outfd, off_t dstoff, size_t size, size_t *copied) {
+	struct gm_pipeline pipeline = {
+		.infd        = infd,
+		.srcoff      = srcoff,
+		.size        = size,
+		.chunk_count = (size + GM_COPY_BUFFER_SIZE - 1) / GM_COPY_BUFFER_SIZE,
+	};
+	pthread_t reader;
+	int status = 0;
+
+	*copied = 0;
+
+	// like the failures below this isn't fatal, the caller just copies in
+	// this thread with its own buffer
+	pipeline.bufs = malloc(GM_PIPELINE_DEPTH * GM_COPY_BUFFER_SIZE);
+	if (!pipeline.bufs) {
+		return 0;
+	}
+
+	if (pthread_mutex_init(&pipeline.lock, NULL) != 0) {
+		free(pipeline.bufs);
+		return 0;
+	}
+
+	if (pthread_cond_init(&pipeline.cond, NULL) != 0) {
+		pthread_mutex_destroy(&pipeline.lock);
+		free(pipeline.bufs);
+		return 0;
+	}
+
+	if (pthread_create(&reader, NULL, gm_pipeline_reader, &pipeline) != 0) {
+		// just copy in this thread
+		goto end;
+	}
+
+	for (size_t chunk = 0; chunk < pipeline.chunk_count; ++ chunk) {
+		pthread_mutex_lock(&pipeline.lock);
+		while (!pipeline.failed && pipeline.filled <= chunk) {
+			pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+		}
+		const bool failed = pipeline.failed;
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (failed) {
+			break;
+		}
+
+		const uint8_t *buf = pipeline.bufs + (chunk % GM_PIPELINE_DEPTH) * GM_COPY_BUFFER_SIZE;
+		const size_t chunk_size = gm_pipeline_chunk_size(&pipeline, chunk);
+		const off_t offset = dstoff + (off_t)(chunk * GM_COPY_BUFFER_SIZE);
+
+		for (size_t done = 0; done < chunk_size;) {
+			const ssize_t count = pwrite(outfd, buf + done, chunk_size - done, offset + (off_t)done);
+			if (count < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				gm_pipeline_fail(&pipeline, errno);
+				break;
+			}
+
+			if (count == 0) {
+				// no progress and no error, don't retry forever
+				gm_pipeline_fail(&pipeline, EIO);
+				break;
+			}
+
+			done += (size_t)count;
+		}
+
+		pthread_mutex_lock(&pipeline.lock);
+		pipeline.drained = chunk + 1;
+		pthread_cond_broadcast(&pipeline.cond);
+		pthread_mutex_unlock(&pipeline.lock);
+	}
+
+	pthread_join(reader, NULL);
+
+	if (pipeline.failed) {
+		errno  = pipeline.errnum;
+		status = -1;
+	}
+	else {
+		*copied = size;
+	}
+
+end:
+	{
+		int errnum = errno;
+
+		pthread_cond_destroy(&pipeline.cond);
+		pthread_mutex_destroy(&pipeline.lock);
+		free(pipeline.bufs);
+
+		errno = errnum;
+	}
+
+	return status;
+}
+#endif
+
+// Copies size bytes at srcoff of src to the current position of dst. Reads
+// of the buffer size are passed by stdio straight through to the OS.
+static int gm_copy_range(FILE *src, off_t srcoff, FILE *dst, size_t size, uint8_t *buf, size_t bufsize) {
+	if (src == dst) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#if defined(GM_HAVE_SENDFILE)
+	if (size > 0) {
+		// the kernel writes to the file descriptor directly
+		if (fflush(dst) != 0) {
+			return -1;
+		}
+
+		const off_t dstoff = ftello(dst);
+		if (dstoff < 0) {
+			return -1;
+		}
+
+		size_t copied = 0;
+		if (gm_copy_range_kernel(fileno(src), srcoff, fileno(dst), dstoff, size, &copied) != 0) {
+			return -1;
+		}
+
+#if defined(GM_HAVE_IO_URING)
+		// the kernel can't copy between these files, overlap reads and writes instead
+		size_t queued = 0;
+		if (copied < size && gm_copy_range_uring(fileno(src), srcoff + (off_t)copied, fileno(dst), dstoff + (off_t)copied, size - copied, &queued) != 0) {
+			return -1;
+		}
+		copied += queued;
+#endif
+
+		if (fseeko(dst, dstoff + (off_t)copied, SEEK_SET) != 0) {
+			return -1;
+		}
+
+		srcoff += (off_t)copied;
+		size   -= copied;
+	}
+#endif
+
+#if defined(GM_HAVE_THREADS)
+	// Long ranges the kernel didn't copy, e.g. between different file systems.
+	// With only one CPU the threads would just take turns.
+	if (size >= GM_PIPELINE_MIN_SIZE && gm_thread_count() > 1) {
+		if (fflush(dst) != 0) {
+			return -1;
+		}
+
+		const off_t dstoff = ftello(dst);
+		if (dstoff < 0) {
+			return -1;
+		}
+
+		size_t copied = 0;
+		if (gm_copy_range_pipelined(fileno(src), srcoff, fileno(dst), dstoff, size, &copied) != 0) {
+			return -1;
+		}
+
+		if (fseeko(dst, dstoff + (off_t)copied, SEEK_SET) != 0) {
+			return -1;
+		}
+
+		srcoff += (off_t)copied;
+		size   -= copied;
+	}
+#endif
+
+	if (fseeko(src, srcoff, SEEK_SET) != 0) {
+		return -1;
+	}
+
+	while (size > 0) {
+		size_t chunk_size = size >= bufsize ? bufsize : size;
+		if (fread(buf, chunk_size, 1, src) != 1) {
+			if (!ferror(src)) {
+				LOG_ERR_MSG("unexpected end of file while copying file data");
+				errno = EINVAL;
+			}
+			return -1;
+		}
+		if (fwrite(buf, chunk_size, 1, dst) != 1) {
+			return -1;
+		}
+		size -= chunk_size;
+	}
+
+	return 0;
+}
+
+// gm_copy_range() in chunks that are read ahead and dropped from the page
+// cache once they are written, while the written chunks go to the disk.
+static int gm_copy_range_streamed(FILE *src, off_t srcoff, FILE *dst, size_t size, uint8_t *buf, size_t bufsize, struct gm_writeback *writeback) {
+	const int srcfd = fileno(src);
+
+	while (size > 0) {
+		const size_t chunk_size = size >= GM_STREAM_CHUNK_SIZE ? GM_STREAM_CHUNK_SIZE : size;
+		const size_t rest = size - chunk_size;
+
+		if (rest > 0) {
+			gm_advise_file(srcfd, srcoff + (off_t)chunk_size, rest >= GM_STREAM_CHUNK_SIZE ? GM_STREAM_CHUNK_SIZE : rest, GM_ADVICE_WILLNEED);
+		}
+
+		if (gm_copy_range(src, srcoff, dst, chunk_size, buf, bufsize) != 0) {
+			return -1;
+		}
+
+		gm_advise_file(srcfd, srcoff, chunk_size, GM_ADVICE_DONTNEED);
+		gm_writeback(writeback, dst);
+
+		srcoff += (off_t)chunk_size;
+		size   -= chunk_size;
+	}
+
+	return 0;
+}
+
+static uint8_t *gm_copy_buffer_new(size_t size, size_t *bufsize) {
+	*bufsize = size < GM_COPY_BUFFER_SIZE ? (size > 0 ? size : 1) : GM_COPY_BUFFER_SIZE;
+
+	return malloc(*bufsize);
+}
+
+int gm_copy_file(const char *srcname, const char *dstname) {
+	FILE *src = NULL;
+	FILE *dst = NULL;
+	uint8_t *buf = NULL;
+	int status = 0;
+	struct stat st;
+
+	src = fopen(srcname, "rb");
+	if (!src) {
+		goto error;
+	}
+
+	if (fstat(fileno(src), &st) != 0) {
+		goto error;
+	}
+
+	dst = fopen(dstname, "wb");
+	if (!dst) {
+		goto error;
+	}
+
+#if defined(GM_HAVE_FICLONERANGE)
+	// whole files can be cloned even if their size isn't block aligned
+	if (ioctl(fileno(dst), FICLONE, fileno(src)) == 0) {
+		goto end;
+	}
+#endif
+
+	size_t bufsize = 0;
+	buf = gm_copy_buffer_new((size_t)st.st_size, &bufsize);
+	if (!buf) {
+		goto error;
+	}
+
+	struct gm_writeback writeback;
+	gm_writeback_init(&writeback, dst);
+	gm_advise_file(fileno(src), 0, 0, GM_ADVICE_SEQUENTIAL);
+
+	if (gm_copy_range_streamed(src, 0, dst, (size_t)st.st_size, buf, bufsize, &writeback) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	free(buf);
+
+	if (src) {
+		fclose(src);
+		src = NULL;
+	}
+
+	if (dst) {
+		if (fclose(dst) != 0) {
+			status = -1;
+		}
+		dst = NULL;
+	}
+
+	return status;
+}
+
+#if defined(GM_WINDOWS)
+#define WIN_PATH_UNC  "\\\\?\\UNC\\"
+#define WIN_PATH_QM   "\\\\?\\"
+#define WIN_PATH_DOT  "\\\\.\\"
+#define WIN_PATH_BKSL "\\\\"
+
+static bool gm_starts_with_ignore_case(const char *string, const char *prefix) {
+	size_t index = 0;
+	char ch = 0;
+	while ((ch = prefix[index])) {
+		if (tolower(ch) != tolower(string[index])) {
+			return false;
+		}
+		++ index;
+	}
+	return true;
+}
+
+// TODO: actually only sometimes '/' is equal to '\\'
+static const char *gm_skip_path_components(const char *path, size_t count) {
+	while (*path && count > 0) {
+		while (*path && *path != '\\' && *path != '/') {
+			++ path;
+		}
+
+		while (*path == '\\' || *path == '/') {
+			++ path;
+		}
+
+		-- count;
+	}
+
+	return path;
+}
+
+static const char *gm_skip_win_root(const char *path) {
+	if (isalpha(path[0]) && path[1] == ':' && (!path[2] || path[2] == '\\' || path[2] == '/')) {
+		if (!path[2]) {
+			return path + 2;
+		}
+		return path + 3;
+	}
+
+	if (gm_starts_with_ignore_case(path, WIN_PATH_UNC)) {
+		return gm_skip_path_components(path + sizeof(WIN_PATH_UNC) - 1, 2);
+	}
+
+	if (gm_starts_with_ignore_case(path, WIN_PATH_QM)) {
+		path += sizeof(WIN_PATH_QM) - 1;
+
+		if (isalpha(path[0]) && path[1] == ':' && (!path[2] || path[2] == '\\' || path[2] == '/')) {
+			if (!path[2]) {
+				return path + 2;
+			}
+			return path + 3;
+		}
+
+		return gm_skip_path_components(path, 2);
+	}
+
+	if (gm_starts_with_ignore_case(path, WIN_PATH_DOT)) {
+		return gm_skip_path_components(path + sizeof(WIN_PATH_DOT) - 1, 1);
+	}
+
+	if (gm_starts_with_ignore_case(path, WIN_PATH_BKSL)) {
+		return gm_skip_path_components(path + sizeof(WIN_PATH_BKSL) - 1, 2);
+	}
+
+	return path;
+}
+#endif
+
+static int gm_mkpath(const char *pathname) {
+	char *buf = NULL;
+	struct stat st;
+	int status = 0;
+
+	if (!pathname) {
+		LOG_ERR_MSG("pathname cannot be NULL");
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	if (!*pathname) {
+		LOG_ERR_MSG("pathname cannot be empty");
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	buf = strdup(pathname);
+	if (buf == NULL) {
+		goto error;
+	}
+
+	char *ptr = buf;
+
+#if defined(GM_WINDOWS)
+	// skip UNC prefix or drive letter
+	ptr = (char*)gm_skip_win_root(ptr);
+#endif
+
+	for (;; ++ ptr) {
+		// skip redundant path seperators
+#if defined(GM_WINDOWS)
+		while (*ptr == '\\' || *ptr == '/') ++ ptr;
+#else
+		while (*ptr == '/') ++ ptr;
+#endif
+
+		// find end of current path component
+		for (; *ptr; ++ ptr) {
+#if defined(GM_WINDOWS)
+			if (*ptr == '\\' || *ptr == '/') break;
+#else
+			if (*ptr == '/') break;
+#endif
+		}
+
+		char ch = *ptr;
+		*ptr = '\0';
+
+		if (stat(buf, &st) == 0) {
+			if (!S_ISDIR(st.st_mode)) {
+				LOG_ERR("exists but is not a directory: %s", buf);
+
+				errno = ENOTDIR;
+				goto error;
+			}
+		}
+		else if (errno != ENOENT) {
+			goto error;
+		}
+		else if (mkdir(buf, S_IRWXU) != 0) {
+			goto error;
+		}
+
+		*ptr = ch;
+		if (!ch) break;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	if (buf != NULL) {
+		free(buf);
+	}
+
+	return status;
+}
+
+// Writes the patch payload at the current position of fp.
+static int gm_write_patch_data(FILE *fp, const struct gm_patch *patch, uint8_t *buf, size_t bufsize) {
+	int status = 0;
+
+	switch (patch->patch_src) {
+	case GM_SRC_MEM:
+		if (fwrite(patch->src.data, patch->size, 1, fp) != 1) {
+			status = -1;
+		}
+		break;
+
+	case GM_SRC_FILE:
+		{
+			FILE *infile = fopen(patch->src.filename, "rb");
+			if (infile) {
+				status = gm_copy_range(infile, 0, fp, patch->size, buf, bufsize);
+				fclose(infile);
+			}
+			else {
+				status = -1;
+			}
+		}
+		break;
+
+	default:
+		errno = EINVAL;
+		status = -1;
+		break;
+	}
+
+	return status;
+}
+
+// Simple bump allocator. All memory of an index is allocated from one arena,
+// so building an index only needs a few big allocations and freeing it
+// doesn't need to walk all the entries again.
+#define GM_ARENA_MIN_CHUNK_SIZE (64 * 1024)
+#define GM_ARENA_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+#define GM_ARENA_ALIGN(SIZE) (((SIZE) + (_Alignof(max_align_t) - 1)) & ~(size_t)(_Alignof(max_align_t) - 1))
+
+struct gm_arena_chunk {
+	struct gm_arena_chunk *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+struct gm_arena {
+	struct gm_arena_chunk *chunks;
+	size_t next_chunk_size;
+};
+
+static void gm_arena_init(struct gm_arena *arena) {
+	arena->chunks          = NULL;
+	arena->next_chunk_size = GM_ARENA_MIN_CHUNK_SIZE;
+}
+
+static void gm_arena_free(struct gm_arena *arena) {
+	struct gm_arena_chunk *chunk = arena->chunks;
+	arena->chunks = NULL;
+
+	while (chunk) {
+		struct gm_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+static void *gm_arena_alloc(struct gm_arena *arena, size_t size) {
+	struct gm_arena_chunk *chunk = arena->chunks;
+
+	if (size > SIZE_MAX - _Alignof(max_align_t) - sizeof(struct gm_arena_chunk)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = GM_ARENA_ALIGN(size);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = arena->next_chunk_size;
+		if (chunk_size < size) {
+			chunk_size = size;
+		}
+		else if (arena->next_chunk_size < GM_ARENA_MAX_CHUNK_SIZE) {
+			arena->next_chunk_size *= 2;
+		}
+
+		struct gm_arena_chunk *new_chunk = malloc(sizeof(struct gm_arena_chunk) + chunk_size);
+		if (!new_chunk) {
+			return NULL;
+		}
+
+		new_chunk->size = chunk_size;
+		new_chunk->used = 0;
+
+		// Keep the chunk with the most free space at the front. An oversized
+		// allocation shouldn't throw away the rest of the current chunk.
+		if (chunk && chunk->size - chunk->used > chunk_size - size) {
+			new_chunk->next = chunk->next;
+			chunk->next = new_chunk;
+		}
+		else {
+			new_chunk->next = chunk;
+			arena->chunks = new_chunk;
+		}
+		chunk = new_chunk;
+	}
+
+	void *ptr = (uint8_t*)chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+// Moves all chunks of src into dst. The first chunk of dst stays in front.
+static void gm_arena_merge(struct gm_arena *dst, struct gm_arena *src) {
+	struct gm_arena_chunk *chunks = src->chunks;
+	src->chunks = NULL;
+
+	if (!chunks) {
+		return;
+	}
+
+	if (!dst->chunks) {
+		dst->chunks = chunks;
+		return;
+	}
+
+	struct gm_arena_chunk *tail = chunks;
+	while (tail->next) {
+		tail = tail->next;
+	}
+
+	tail->next = dst->chunks->next;
+	dst->chunks->next = chunks;
+}
+
+static void *gm_arena_calloc(struct gm_arena *arena, size_t count, size_t size) {
+	if (size != 0 && count > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void *ptr = gm_arena_alloc(arena, count * size);
+	if (ptr) {
+		memset(ptr, 0, count * size);
+	}
+
+	return ptr;
+}
+
+// An index is handed out as a pointer to its first section, but it is
+// actually allocated as this struct at the start of its own arena.
+struct gm_index_head {
+	struct gm_arena arena;
+
+	// only set for indices that load their sections on demand
+	const struct gm_archive *archive;
+
+	// first section of each type
+	struct gm_index *slots[GM_SECTION_COUNT];
+
+	struct gm_index sections[];
+};
+
+#define GM_INDEX_HEAD(INDEX) \
+	((struct gm_index_head*)((uint8_t*)(INDEX) - offsetof(struct gm_index_head, sections)))
+
+void gm_free_index(struct gm_index *index) {
+	if (index) {
+		// the head itself lives in the arena
+		struct gm_arena arena = GM_INDEX_HEAD(index)->arena;
+		gm_arena_free(&arena);
+	}
+}
+
+struct gm_index *gm_find_section(const struct gm_index *index, enum gm_section section) {
+	if (section <= GM_END || section >= GM_SECTION_COUNT) {
+		return NULL;
+	}
+
+	return GM_INDEX_HEAD(index)->slots[section];
+}
+
+struct gm_patched_index *gm_get_section(struct gm_patched_index *patched, enum gm_section section) {
+	for (; patched->section != GM_END; ++ patched) {
 		if (patched->section == section) {
 			return patched;
 		}
 	}
-	return NULL;
+	return NULL;
+}
+
+int gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch) {
+	switch (index->section) {
+	// only know how to patch these sections so far:
+	case GM_TXTR:
+	case GM_AUDO:
+		break;
+
+	case GM_STRG:
+	{
+		if (patch->index >= index->entry_count) {
+			LOG_ERR("section %s, patch index out of range: %" PRIuPTR " >= %" PRIuPTR,
+			        gm_section_name(index->section), patch->index, index->entry_count);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		struct gm_patched_entry *entry = &index->entries[patch->index];
+		if (entry->patch) {
+			LOG_ERR("section %s, entry %" PRIuPTR " is already patched",
+			        gm_section_name(index->section), patch->index);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		const size_t new_len = strlen(patch->meta.strg.new);
+		if (entry->entry->size < new_len) {
+			LOG_ERR("section %s, cannot increase string length of entry %" PRIuPTR ": \"%s\" (%" PRIuPTR ") -> \"%s\" (%" PRIuPTR ")",
+			        gm_section_name(index->section), patch->index,
+			        entry->entry->meta.strg, entry->entry->size,
+			        patch->meta.strg.new, new_len);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (strcmp(entry->entry->meta.strg, patch->meta.strg.old) != 0 &&
+		    strcmp(entry->entry->meta.strg, patch->meta.strg.new) != 0) {
+			LOG_ERR("section %s, entry %" PRIuPTR " doesn't contain the expected string \"%s\" (or \"%s\" if already patched), but instead contains \"%s\"",
+			        gm_section_name(index->section), patch->index, patch->meta.strg.old, patch->meta.strg.new, entry->entry->meta.strg);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		entry->patch = patch;
+		return 0;
+	}
+
+	case GM_SPRT:
+	{
+		const struct gm_entry *entry = gm_find_sprite(index->index, patch->meta.sprt.name);
+		if (!entry) {
+			LOG_ERR("can't find sprite %s in game archive", patch->meta.sprt.name);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		const size_t entry_count = patch->meta.sprt.entry_count;
+		const struct gm_patch_sprt_entry *entries = patch->meta.sprt.entries;
+
+		for (size_t j = 0; j < entry_count; ++ j) {
+			const struct gm_patch_sprt_entry *path_sprt = &entries[j];
+
+			const size_t tpag_index = path_sprt->tpag_index;
+			if (tpag_index >= entry->meta.sprt.tpag_count) {
+				LOG_ERR("Sprite %s index outof range: %" PRIuPTR " >= %" PRIuPTR,
+				        patch->meta.sprt.name, tpag_index,
+				        entry->meta.sprt.tpag_count);
+
+				errno = EINVAL;
+				return -1;
+			}
+
+			if (entry->meta.sprt.tpag[tpag_index].x != path_sprt->x ||
+			    entry->meta.sprt.tpag[tpag_index].y != path_sprt->y ||
+			    entry->meta.sprt.tpag[tpag_index].width  != path_sprt->width ||
+			    entry->meta.sprt.tpag[tpag_index].height != path_sprt->height ||
+			    entry->meta.sprt.tpag[tpag_index].txtr_index != path_sprt->txtr_index) {
+
+				LOG_ERR("Sprite %s %" PRIuPTR " has incompatible coordinates. patch: x=%" PRIuPTR
+				        " y=%" PRIuPTR " width=%" PRIuPTR " height=%" PRIuPTR
+				        " txtr_index=%" PRIuPTR ", game archive: x=%"  PRIuPTR
+				        " y=%" PRIuPTR " width=%" PRIuPTR " height=%" PRIuPTR
+				        " txtr_index=%" PRIuPTR,
+				        patch->meta.sprt.name,
+				        tpag_index,
+				        path_sprt->x,
+				        path_sprt->y,
+				        path_sprt->width,
+				        path_sprt->height,
+				        path_sprt->txtr_index,
+				        entry->meta.sprt.tpag[tpag_index].x,
+				        entry->meta.sprt.tpag[tpag_index].y,
+				        entry->meta.sprt.tpag[tpag_index].width,
+				        entry->meta.sprt.tpag[tpag_index].height,
+				        entry->meta.sprt.tpag[tpag_index].txtr_index);
+
+				errno = EINVAL;
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+
+	default:
+		LOG_ERR("can't patch %s section (not implemented)", gm_section_name(index->section));
+
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if (patch->index >= index->entry_count) {
+		LOG_ERR("patch index out of range: section = %s, patch index = %" PRIuPTR ", entry count = %" PRIuPTR,
+		        gm_section_name(index->section), patch->index, index->entry_count);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct gm_patched_entry *entry = &index->entries[patch->index];
+	if (entry->patch) {
+		LOG_ERR("section %s, entry %" PRIuPTR " is already patched", gm_section_name(index->section), patch->index);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (entry->entry->type != patch->type) {
+		LOG_ERR("section %s, entry %" PRIuPTR " type missmatch: entry type = %s, patch type = %s",
+			gm_section_name(index->section), patch->index, gm_typename(entry->entry->type), gm_typename(patch->type));
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (index->section == GM_TXTR) {
+		// validate replacement sprite dimensions
+		if (entry->entry->meta.txtr.width  != patch->meta.txtr.width ||
+		    entry->entry->meta.txtr.height != patch->meta.txtr.height) {
+			LOG_ERR("section %s, entry %" PRIuPTR " sprite dimensions missmatch: entry dimensions = %" PRIuPTR "x%" PRIuPTR
+			        ", patch dimensions = %" PRIuPTR "x%" PRIuPTR,
+				gm_section_name(index->section), patch->index, entry->entry->meta.txtr.width, entry->entry->meta.txtr.height,
+				patch->meta.txtr.width, patch->meta.txtr.height);
+
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	// new offsets are computed for all patches at once by gm_layout_patched_index()
+	index->size += patch->size - entry->entry->size;
+	entry->size  = patch->size;
+	entry->patch = patch;
+
+	return 0;
+}
+
+void gm_free_patched_index(struct gm_patched_index *index) {
+	if (index) {
+		for (struct gm_patched_index *ptr = index; ptr->section != GM_END; ++ ptr) {
+			if (ptr->entries) {
+				free(ptr->entries);
+				ptr->entries = NULL;
+			}
+		}
+		free(index);
+	}
+}
+
+const char *gm_section_name(enum gm_section section) {
+	switch (section) {
+	case GM_GEN8: return "GEN8";
+	case GM_OPTN: return "OPTN";
+	case GM_EXTN: return "EXTN";
+	case GM_SOND: return "SOND";
+	case GM_SPRT: return "SPRT";
+	case GM_BGND: return "BGND";
+	case GM_PATH: return "PATH";
+	case GM_SCPT: return "SCPT";
+	case GM_SHDR: return "SHDR";
+	case GM_FONT: return "FONT";
+	case GM_TMLN: return "TMLN";
+	case GM_OBJT: return "OBJT";
+	case GM_ROOM: return "ROOM";
+	case GM_DAFL: return "DAFL";
+	case GM_TPAG: return "TPAG";
+	case GM_CODE: return "CODE";
+	case GM_VARI: return "VARI";
+	case GM_FUNC: return "FUNC";
+	case GM_STRG: return "STRG";
+	case GM_TXTR: return "TXTR";
+	case GM_AUDO: return "AUDO";
+	case GM_AGRP: return "AGRP";
+	case GM_LANG: return "LANG";
+	case GM_GLOB: return "GLOB";
+	case GM_EMBI: return "EMBI";
+	case GM_TGIN: return "TGIN";
+	default: return NULL;
+	}
+}
+
+// section magic as read by U32LE_FROM_BUF()
+#define GM_FOURCC(A, B, C, D) \
+	((uint32_t)(A) | ((uint32_t)(B) << 8) | ((uint32_t)(C) << 16) | ((uint32_t)(D) << 24))
+
+enum gm_section gm_parse_section(const uint8_t *name) {
+	switch (U32LE_FROM_BUF(name)) {
+	case GM_FOURCC('G', 'E', 'N', '8'): return GM_GEN8;
+	case GM_FOURCC('O', 'P', 'T', 'N'): return GM_OPTN;
+	case GM_FOURCC('E', 'X', 'T', 'N'): return GM_EXTN;
+	case GM_FOURCC('S', 'O', 'N', 'D'): return GM_SOND;
+	case GM_FOURCC('S', 'P', 'R', 'T'): return GM_SPRT;
+	case GM_FOURCC('B', 'G', 'N', 'D'): return GM_BGND;
+	case GM_FOURCC('P', 'A', 'T', 'H'): return GM_PATH;
+	case GM_FOURCC('S', 'C', 'P', 'T'): return GM_SCPT;
+	case GM_FOURCC('S', 'H', 'D', 'R'): return GM_SHDR;
+	case GM_FOURCC('F', 'O', 'N', 'T'): return GM_FONT;
+	case GM_FOURCC('T', 'M', 'L', 'N'): return GM_TMLN;
+	case GM_FOURCC('O', 'B', 'J', 'T'): return GM_OBJT;
+	case GM_FOURCC('R', 'O', 'O', 'M'): return GM_ROOM;
+	case GM_FOURCC('D', 'A', 'F', 'L'): return GM_DAFL;
+	case GM_FOURCC('T', 'P', 'A', 'G'): return GM_TPAG;
+	case GM_FOURCC('C', 'O', 'D', 'E'): return GM_CODE;
+	case GM_FOURCC('V', 'A', 'R', 'I'): return GM_VARI;
+	case GM_FOURCC('F', 'U', 'N', 'C'): return GM_FUNC;
+	case GM_FOURCC('S', 'T', 'R', 'G'): return GM_STRG;
+	case GM_FOURCC('T', 'X', 'T', 'R'): return GM_TXTR;
+	case GM_FOURCC('A', 'U', 'D', 'O'): return GM_AUDO;
+	case GM_FOURCC('A', 'G', 'R', 'P'): return GM_AGRP;
+	case GM_FOURCC('L', 'A', 'N', 'G'): return GM_LANG;
+	case GM_FOURCC('G', 'L', 'O', 'B'): return GM_GLOB;
+	case GM_FOURCC('E', 'M', 'B', 'I'): return GM_EMBI;
+	case GM_FOURCC('T', 'G', 'I', 'N'): return GM_TGIN;
+	default: return GM_END;
+	}
+}
+
+struct gm_archive *gm_archive_from_file(FILE *game) {
+	struct stat st;
+	struct gm_archive *archive = NULL;
+	uint8_t *data = NULL;
+
+	archive = calloc(1, sizeof(struct gm_archive));
+	if (!archive) {
+		goto error;
+	}
+
+	if (fstat(fileno(game), &st) != 0) {
+		goto error;
+	}
+
+	if (st.st_size < 0 || (uintmax_t)st.st_size > SIZE_MAX) {
+		LOG_ERR("archive too big: size = %" PRIi64 ", max. allowed = %" PRIuPTR, (int64_t)st.st_size, (size_t)SIZE_MAX);
+
+		errno = EFBIG;
+		goto error;
+	}
+
+	archive->size       = (size_t)st.st_size;
+	archive->mtime      = (int64_t)st.st_mtime;
+	archive->mtime_nsec = (int64_t)GM_MTIME_NSEC(st);
+	archive->inode      = (uint64_t)st.st_ino;
+
+#if defined(GM_HAVE_MMAP)
+	if (archive->size > 0) {
+		void *mapped = mmap(NULL, archive->size, PROT_READ, MAP_PRIVATE, fileno(game), 0);
+		if (mapped != MAP_FAILED) {
+			archive->data   = (const uint8_t*)mapped;
+			archive->mapped = 1;
+			goto end;
+		}
+	}
+#endif
+
+	// mmap() not available or failed: read the whole file into memory instead
+	data = malloc(archive->size > 0 ? archive->size : 1);
+	if (!data) {
+		goto error;
+	}
+
+	if (fseeko(game, 0, SEEK_SET) != 0) {
+		goto error;
+	}
+
+	if (archive->size > 0 && fread(data, archive->size, 1, game) != 1) {
+		if (!ferror(game)) {
+			LOG_ERR_MSG("unexpected end of file while reading archive");
+			errno = EINVAL;
+		}
+		goto error;
+	}
+
+	archive->data   = data;
+	archive->mapped = 0;
+
+	goto end;
+
+error:
+	if (data) {
+		free(data);
+		data = NULL;
+	}
+
+	if (archive) {
+		free(archive);
+		archive = NULL;
+	}
+
+end:
+	return archive;
+}
+
+struct gm_archive *gm_open_archive(const char *filename) {
+	FILE *game = fopen(filename, "rb");
+	if (!game) {
+		return NULL;
+	}
+
+	struct gm_archive *archive = gm_archive_from_file(game);
+	int errnum = errno;
+
+	fclose(game);
+
+	if (archive) {
+		archive->filename = GM_CONCAT(filename);
+		if (!archive->filename) {
+			errnum = errno;
+			gm_close_archive(archive);
+			archive = NULL;
+		}
+	}
+
+	errno = errnum;
+	return archive;
+}
+
+void gm_close_archive(struct gm_archive *archive) {
+	if (archive) {
+#if defined(GM_HAVE_MMAP)
+		if (archive->mapped) {
+			munmap((void*)archive->data, archive->size);
+		}
+		else
+#endif
+		{
+			free((void*)archive->data);
+		}
+		free(archive->filename);
+		archive->data     = NULL;
+		archive->size     = 0;
+		archive->filename = NULL;
+		free(archive);
+	}
+}
+
+// Bounds checked reading of archive data that is held in memory. All
+// offsets used by the cursor are absolute offsets into the archive.
+struct gm_cursor {
+	const uint8_t *data;
+	size_t size;
+	size_t offset;
+};
+
+static void gm_cursor_init(struct gm_cursor *cursor, const struct gm_archive *archive, size_t offset) {
+	cursor->data   = archive->data;
+	cursor->size   = archive->size;
+	cursor->offset = offset;
+}
+
+static void gm_cursor_seek(struct gm_cursor *cursor, size_t offset) {
+	cursor->offset = offset;
+}
+
+static const uint8_t *gm_cursor_read(struct gm_cursor *cursor, size_t size) {
+	if (cursor->offset > cursor->size || size > cursor->size - cursor->offset) {
+		LOG_ERR("unexpected end of file: offset = %" PRIuPTR ", read size = %" PRIuPTR ", file size = %" PRIuPTR,
+		        cursor->offset, size, cursor->size);
+
+		errno = EINVAL;
+		return NULL;
+	}
+
+	const uint8_t *ptr = cursor->data + cursor->offset;
+	cursor->offset += size;
+
+	return ptr;
+}
+
+static int gm_cursor_read_u32(struct gm_cursor *cursor, uint32_t *value) {
+	const uint8_t *ptr = gm_cursor_read(cursor, 4);
+	if (!ptr) {
+		return -1;
+	}
+
+	*value = U32LE_FROM_BUF(ptr);
+
+	return 0;
+}
+
+// Open addressing hash table mapping keys to entry indices. For STRG the
+// key is the absolute offset of the characters of a string (which is what
+// other sections point to) and it also references the copy of the section
+// that all the strings point into. For SPRT the key is the sprite name.
+struct gm_lookup {
+	const uint8_t *blob;
+	off_t  blob_offset;
+	size_t blob_size;
+
+	size_t mask;
+	size_t slots[]; // entry index + 1, 0 means empty
+};
+
+static size_t gm_hash_offset(off_t offset) {
+	return (size_t)(((uint64_t)offset * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+}
+
+#define GM_FNV1A_OFFSET UINT64_C(0xCBF29CE484222325)
+#define GM_FNV1A_PRIME  UINT64_C(0x00000100000001B3)
+
+static uint64_t gm_fnv1a(uint64_t hash, const uint8_t *data, size_t size) {
+	for (size_t index = 0; index < size; ++ index) {
+		hash ^= data[index];
+		hash *= GM_FNV1A_PRIME;
+	}
+	return hash;
+}
+
+// gm_fnv1a() over a range of an archive, read ahead and marked as done in
+// chunks so that hashing a whole archive doesn't evict everything else.
+static uint64_t gm_fnv1a_archive(uint64_t hash, const struct gm_archive *archive, size_t offset, size_t size) {
+	while (size > 0) {
+		const size_t chunk_size = size >= GM_STREAM_CHUNK_SIZE ? GM_STREAM_CHUNK_SIZE : size;
+		const size_t rest = size - chunk_size;
+
+		if (rest > 0) {
+			gm_advise_archive(archive, offset + chunk_size, rest >= GM_STREAM_CHUNK_SIZE ? GM_STREAM_CHUNK_SIZE : rest, GM_ADVICE_WILLNEED);
+		}
+
+		hash = gm_fnv1a(hash, archive->data + offset, chunk_size);
+		gm_advise_archive(archive, offset, chunk_size, GM_ADVICE_DONTNEED);
+
+		offset += chunk_size;
+		size   -= chunk_size;
+	}
+	return hash;
+}
+
+static size_t gm_hash_name(const char *name) {
+	return (size_t)gm_fnv1a(GM_FNV1A_OFFSET, (const uint8_t*)name, strlen(name));
+}
+
+static struct gm_lookup *gm_lookup_new(struct gm_arena *arena, size_t count) {
+	size_t capacity = 16;
+
+	while (capacity < count * 2) {
+		if (capacity > SIZE_MAX / (2 * sizeof(size_t))) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		capacity *= 2;
+	}
+
+	struct gm_lookup *lookup = gm_arena_calloc(arena, 1, sizeof(struct gm_lookup) + capacity * sizeof(size_t));
+	if (!lookup) {
+		return NULL;
+	}
+
+	lookup->mask = capacity - 1;
+
+	return lookup;
+}
+
+static int gm_read_index_strg(struct gm_arena *arena, const struct gm_archive *game, struct gm_index *section) {
+	struct gm_cursor cursor;
+	uint32_t count = 0;
+	struct gm_entry *entries = NULL;
+	struct gm_lookup *lookup = NULL;
+	uint8_t *blob = NULL;
+	const off_t blob_offset = section->offset + 8;
+	const size_t blob_size = section->size;
+	int status = 0;
+
+	// Copy the whole section at once. All strings are views into this copy.
+	gm_cursor_init(&cursor, game, blob_offset);
+
+	const uint8_t *data = gm_cursor_read(&cursor, blob_size);
+	if (!data) {
+		goto error;
+	}
+
+	blob = gm_arena_alloc(arena, blob_size);
+	if (!blob) {
+		goto error;
+	}
+	memcpy(blob, data, blob_size);
+
+	gm_cursor_seek(&cursor, blob_offset);
+
+	if (gm_cursor_read_u32(&cursor, &count) != 0) {
+		goto error;
+	}
+
+	entries = gm_arena_calloc(arena, count, sizeof(struct gm_entry));
+	if (!entries) {
+		goto error;
+	}
+
+	lookup = gm_lookup_new(arena, count);
+	if (!lookup) {
+		goto error;
+	}
+
+	lookup->blob        = blob;
+	lookup->blob_offset = blob_offset;
+	lookup->blob_size   = blob_size;
+
+	for (size_t index = 0; index < count; ++ index) {
+		struct gm_entry *entry = &entries[index];
+		uint32_t offset = 0;
+
+		if (gm_cursor_read_u32(&cursor, &offset) != 0) {
+			goto error;
+		}
+
+		if ((off_t)offset < blob_offset || (size_t)((off_t)offset - blob_offset) > blob_size - 4) {
+			LOG_ERR("string at offset %" PRIu32 " (index %" PRIuPTR ") is outside of the %s section",
+			        offset, index, gm_section_name(section->section));
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		const size_t str_offset = (size_t)((off_t)offset - blob_offset) + 4;
+		const uint32_t size = U32LE_FROM_BUF(blob + str_offset - 4);
+
+		// null byte is not included in size
+		if (size >= blob_size - str_offset) {
+			LOG_ERR("string at offset %" PRIu32 " (index %" PRIuPTR ") overflows the %s section: size = %" PRIu32,
+			        offset, index, gm_section_name(section->section), size);
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		if (blob[str_offset + size] != '\0') {
+			LOG_ERR("string at offset %" PRIu32 " (index %" PRIuPTR ") is not null terminated",
+			        offset, index);
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		entry->offset    = (off_t)offset;
+		entry->size      = (size_t)size + 1;
+		entry->meta.strg = (const char*)blob + str_offset;
+
+		// strings are referenced by the offset of their characters
+		const off_t key = (off_t)offset + 4;
+		for (size_t slot = gm_hash_offset(key) & lookup->mask;; slot = (slot + 1) & lookup->mask) {
+			const size_t value = lookup->slots[slot];
+			if (value == 0) {
+				lookup->slots[slot] = index + 1;
+				break;
+			}
+			else if (entries[value - 1].offset + 4 == key) {
+				// same string listed twice, keep the first
+				break;
+			}
+		}
+	}
+
+	section->entry_count = count;
+	section->entries     = entries;
+	section->lookup      = lookup;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+
+	return status;
+}
+
+const char *gm_get_string(const struct gm_index *strg, off_t offset) {
+	const struct gm_lookup *lookup = strg->lookup;
+
+	if (strg->section != GM_STRG || !lookup) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (size_t slot = gm_hash_offset(offset) & lookup->mask;; slot = (slot + 1) & lookup->mask) {
+		const size_t value = lookup->slots[slot];
+		if (value == 0) {
+			break;
+		}
+
+		const struct gm_entry *entry = &strg->entries[value - 1];
+		if (entry->offset + 4 == offset) {
+			return entry->meta.strg;
+		}
+	}
+
+	// Not listed in the string table, but it still might point to a
+	// string inside of the STRG section.
+	if (offset >= lookup->blob_offset + 4 && (size_t)(offset - lookup->blob_offset) < lookup->blob_size) {
+		const size_t str_offset = (size_t)(offset - lookup->blob_offset);
+		const uint32_t size = U32LE_FROM_BUF(lookup->blob + str_offset - 4);
+
+		if (size < lookup->blob_size - str_offset && lookup->blob[str_offset + size] == '\0') {
+			return (const char*)lookup->blob + str_offset;
+		}
+	}
+
+	errno = ENOENT;
+	return NULL;
+}
+
+static int gm_index_sprite_names(struct gm_arena *arena, struct gm_index *section) {
+	struct gm_lookup *lookup = gm_lookup_new(arena, section->entry_count);
+	if (!lookup) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < section->entry_count; ++ index) {
+		const char *name = section->entries[index].meta.sprt.name;
+
+		for (size_t slot = gm_hash_name(name) & lookup->mask;; slot = (slot + 1) & lookup->mask) {
+			const size_t value = lookup->slots[slot];
+			if (value == 0) {
+				lookup->slots[slot] = index + 1;
+				break;
+			}
+			else if (strcmp(section->entries[value - 1].meta.sprt.name, name) == 0) {
+				// same name listed twice, keep the first
+				break;
+			}
+		}
+	}
+
+	section->lookup = lookup;
+
+	return 0;
+}
+
+const struct gm_entry *gm_find_sprite(const struct gm_index *sprt, const char *name) {
+	const struct gm_lookup *lookup = sprt->lookup;
+
+	if (sprt->section != GM_SPRT || !lookup) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (size_t slot = gm_hash_name(name) & lookup->mask;; slot = (slot + 1) & lookup->mask) {
+		const size_t value = lookup->slots[slot];
+		if (value == 0) {
+			break;
+		}
+
+		const struct gm_entry *entry = &sprt->entries[value - 1];
+		if (strcmp(entry->meta.sprt.name, name) == 0) {
+			return entry;
+		}
+	}
+
+	errno = ENOENT;
+	return NULL;
+}
+
+static int gm_read_index_sprt(struct gm_arena *arena, const struct gm_archive *game, const struct gm_index *strg, struct gm_index *section) {
+	struct gm_cursor cursor;
+	struct gm_cursor sprt_cursor;
+	uint32_t count = 0;
+	struct gm_entry *entries = NULL;
+	int status = 0;
+
+	gm_cursor_init(&cursor, game, section->offset + 8);
+	gm_cursor_init(&sprt_cursor, game, 0);
+
+	if (gm_cursor_read_u32(&cursor, &count) != 0) {
+		goto error;
+	}
+
+	entries = gm_arena_calloc(arena, count, sizeof(struct gm_entry));
+	if (!entries) {
+		goto error;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		struct gm_entry *entry = &entries[index];
+
+		uint32_t offset = 0;
+		if (gm_cursor_read_u32(&cursor, &offset) != 0) {
+			goto error;
+		}
+
+		gm_cursor_seek(&sprt_cursor, offset);
+
+		const uint8_t *buffer = gm_cursor_read(&sprt_cursor, 20 * 4);
+		if (!buffer) {
+			goto error;
+		}
+
+		const uint32_t str_offset = U32LE_FROM_BUF(buffer);
+		if (str_offset < 4) {
+			LOG_ERR("offset not in range: offset = %" PRIu32 ", min. allowed = 4", str_offset);
+
+			errno = ERANGE;
+			goto error;
+		}
+
+		const uint32_t tpag_count = U32LE_FROM_BUF(buffer + (19 * 4));
+		if (tpag_count > INT32_MAX) {
+			LOG_ERR("count too big: count = %" PRIu32 ", max. allowed = %" PRIu32, tpag_count, INT32_MAX);
+
+			errno = ERANGE;
+			goto error;
+		}
+
+		const uint8_t *tpag_offsets = gm_cursor_read(&sprt_cursor, (size_t)tpag_count * 4);
+		if (!tpag_offsets) {
+			goto error;
+		}
+
+		struct gm_tpag *tpag = gm_arena_calloc(arena, tpag_count, sizeof(struct gm_tpag));
+		if (!tpag) {
+			goto error;
+		}
+
+		for (size_t tpag_index = 0; tpag_index < tpag_count; ++ tpag_index) {
+			struct gm_cursor tpag_cursor;
+
+			gm_cursor_init(&tpag_cursor, game, U32LE_FROM_BUF(tpag_offsets + (tpag_index * 4)));
+
+			const uint8_t *tpag_buffer = gm_cursor_read(&tpag_cursor, 11 * 2);
+			if (!tpag_buffer) {
+				goto error;
+			}
+
+			tpag[tpag_index].x          = U16LE_FROM_BUF(tpag_buffer);
+			tpag[tpag_index].y          = U16LE_FROM_BUF(tpag_buffer +  2);
+			tpag[tpag_index].width      = U16LE_FROM_BUF(tpag_buffer +  4);
+			tpag[tpag_index].height     = U16LE_FROM_BUF(tpag_buffer +  6);
+			tpag[tpag_index].txtr_index = U16LE_FROM_BUF(tpag_buffer + 20);
+		}
+
+		const char *name = gm_get_string(strg, (off_t)str_offset);
+		if (!name) {
+			LOG_ERR("section %s, entry %" PRIuPTR ": name at offset %" PRIu32 " is not in the string table",
+			        gm_section_name(section->section), index, str_offset);
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		entry->meta.sprt.name       = name;
+		entry->meta.sprt.tpag_count = tpag_count;
+		entry->meta.sprt.tpag       = tpag;
+	}
+
+	section->entry_count = count;
+	section->entries     = entries;
+
+	if (gm_index_sprite_names(arena, section) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+
+	return status;
+}
+
+static int gm_read_index_txtr(struct gm_arena *arena, const struct gm_archive *game, struct gm_index *section) {
+	struct gm_cursor cursor;
+	struct gm_cursor info_cursor;
+	uint32_t count = 0;
+	struct gm_entry *entries = NULL;
+	int status = 0;
+
+	gm_cursor_init(&cursor, game, section->offset + 8);
+	gm_cursor_init(&info_cursor, game, 0);
+
+	if (gm_cursor_read_u32(&cursor, &count) != 0) {
+		goto error;
+	}
+
+	entries = gm_arena_calloc(arena, count, sizeof(struct gm_entry));
+	if (!entries) {
+		goto error;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		struct gm_entry *entry = &entries[index];
+
+		uint32_t info_offset = 0;
+		if (gm_cursor_read_u32(&cursor, &info_offset) != 0) {
+			goto error;
+		}
+
+		gm_cursor_seek(&info_cursor, info_offset);
+
+		const uint8_t *buffer = gm_cursor_read(&info_cursor, 12);
+		if (!buffer) {
+			goto error;
+		}
+
+		const uint32_t unknown1 = U32LE_FROM_BUF(buffer);
+		if (unknown1 > 1) {
+			LOG_ERR("at offset %" PRIu32 ", section %s, entry %" PRIuPTR ": unexpected value of non-reverse engineered field: unknown1 = %" PRIu32,
+				info_offset, gm_section_name(section->section), index, unknown1);
+
+			errno = ENOSYS;
+			goto error;
+		}
+
+		const uint32_t unknown2 = U32LE_FROM_BUF(buffer + 4);
+		if (unknown2 > 0) {
+			LOG_ERR("at offset %" PRIu32 ", section %s, entry %" PRIuPTR ": unexpected value of non-reverse engineered field: unknown2 = %" PRIu32,
+				info_offset, gm_section_name(section->section), index, unknown2);
+
+			errno = ENOSYS;
+			goto error;
+		}
+
+		const uint32_t offset = U32LE_FROM_BUF(buffer + 8);
+		entry->offset = (off_t)offset;
+
+		// don't even form a pointer past the end of the archive
+		if (offset >= game->size) {
+			LOG_ERR("section %s, entry %" PRIuPTR ": sprite file offset out of range: offset = %" PRIu32 ", file size = %" PRIuPTR,
+				gm_section_name(section->section), index, offset, game->size);
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		struct png_info meta;
+		if (parse_png_info_mem(game->data + offset, game->size - offset, &meta) != 0) {
+			LOG_ERR("section %s, entry %" PRIuPTR ": error parsing sprite file",
+				gm_section_name(section->section), index);
+
+			goto error;
+		}
+
+		entry->size = meta.filesize;
+		entry->type = GM_PNG;
+		entry->meta.txtr.unknown1 = unknown1;
+		entry->meta.txtr.unknown2 = unknown2;
+		entry->meta.txtr.width  = meta.width;
+		entry->meta.txtr.height = meta.height;
+	}
+
+	section->entry_count = count;
+	section->entries     = entries;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+
+	return status;
+}
+
+static int gm_read_index_audo(struct gm_arena *arena, const struct gm_archive *game, struct gm_index *section) {
+	struct gm_cursor cursor;
+	struct gm_cursor file_cursor;
+	uint32_t count = 0;
+	struct gm_entry *entries = NULL;
+	int status = 0;
+
+	gm_cursor_init(&cursor, game, section->offset + 8);
+	gm_cursor_init(&file_cursor, game, 0);
+
+	if (gm_cursor_read_u32(&cursor, &count) != 0) {
+		goto error;
+	}
+
+	entries = gm_arena_calloc(arena, count, sizeof(struct gm_entry));
+	if (!entries) {
+		goto error;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		struct gm_entry *entry = &entries[index];
+
+		uint32_t offset = 0;
+		if (gm_cursor_read_u32(&cursor, &offset) != 0) {
+			goto error;
+		}
+
+		gm_cursor_seek(&file_cursor, offset);
+
+		uint32_t size = 0;
+		if (gm_cursor_read_u32(&file_cursor, &size) != 0) {
+			goto error;
+		}
+
+		const uint8_t *buffer = gm_cursor_read(&file_cursor, size);
+		if (!buffer) {
+			goto error;
+		}
+
+		if (size >= 12 &&
+		    memcmp(buffer, "RIFF", 4) == 0 &&
+		    memcmp(buffer + 8, "WAVE", 4) == 0) {
+			entry->type = GM_WAVE;
+		}
+		else if (size >= 4 && memcmp(buffer, "OggS", 4) == 0) {
+			entry->type = GM_OGG;
+		}
+		else {
+			entry->type = GM_UNKNOWN;
+		}
+		entry->offset = (off_t)offset + 4;
+		entry->size   = size;
+	}
+
+	section->entry_count = count;
+	section->entries     = entries;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+
+	return status;
+}
+
+// Reads ahead the part of a section that is parsed for its entries. String
+// and sprite sections are parsed as a whole, of texture and audio sections
+// only the offset table is read (and the headers it points to).
+static void gm_advise_section(const struct gm_archive *archive, const struct gm_index *section) {
+	const size_t offset = (size_t)section->offset;
+	size_t size = section->size + 8;
+
+	if (section->section == GM_TXTR || section->section == GM_AUDO) {
+		if (offset > archive->size || archive->size - offset < 12) {
+			return;
+		}
+
+		const uint32_t count = U32LE_FROM_BUF(archive->data + offset + 8);
+		if (size >= 12 && (size_t)count < (size - 12) / 4) {
+			size = 12 + (size_t)count * 4;
+		}
+	}
+
+	gm_advise_archive(archive, offset, size, GM_ADVICE_WILLNEED);
+}
+
+static int gm_load_section_entries(struct gm_index_head *head, struct gm_arena *arena, struct gm_index *section) {
+	if (section->loaded) {
+		return 0;
+	}
+
+	if (!head->archive) {
+		LOG_ERR("entries of %s section where not loaded", gm_section_name(section->section));
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	gm_advise_section(head->archive, section);
+
+	switch (section->section) {
+	case GM_STRG:
+		if (gm_read_index_strg(arena, head->archive, section) != 0) {
+			return -1;
+		}
+		break;
+
+	case GM_SPRT:
+		// sprite names are resolved via the string table
+		if (!head->slots[GM_STRG]) {
+			LOG_ERR("archive contains a %s section, but no %s section",
+			        gm_section_name(GM_SPRT), gm_section_name(GM_STRG));
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (gm_load_section_entries(head, arena, head->slots[GM_STRG]) != 0) {
+			return -1;
+		}
+
+		if (gm_read_index_sprt(arena, head->archive, head->slots[GM_STRG], section) != 0) {
+			return -1;
+		}
+		break;
+
+	case GM_TXTR:
+		if (gm_read_index_txtr(arena, head->archive, section) != 0) {
+			return -1;
+		}
+		break;
+
+	case GM_AUDO:
+		if (gm_read_index_audo(arena, head->archive, section) != 0) {
+			return -1;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	section->loaded = 1;
+
+	return 0;
+}
+
+int gm_load_section(struct gm_index *index, struct gm_index *section) {
+	struct gm_index_head *head = GM_INDEX_HEAD(index);
+
+	return gm_load_section_entries(head, &head->arena, section);
+}
+
+// Sections are independent byte ranges of the (mapped) archive, so each
+// one is parsed by its own worker into its own arena. The only dependency
+// is SPRT on STRG, so SPRT sections are parsed by the worker of STRG.
+struct gm_parse_task {
+	struct gm_index_head *head;
+	struct gm_index *section;
+	uint32_t section_mask;
+	struct gm_arena arena;
+	int status;
+	int errnum;
+#if defined(GM_HAVE_THREADS)
+	pthread_t thread;
+	bool started;
+#endif
+};
+
+static void *gm_parse_worker(void *arg) {
+	struct gm_parse_task *task = arg;
+	struct gm_index_head *head = task->head;
+
+	task->status = gm_load_section_entries(head, &task->arena, task->section);
+
+	if (task->status == 0 && task->section == head->slots[GM_STRG] && (task->section_mask & GM_SECTION_BIT(GM_SPRT))) {
+		for (struct gm_index *section = head->sections; section->section != GM_END; ++ section) {
+			if (section->section == GM_SPRT && gm_load_section_entries(head, &task->arena, section) != 0) {
+				task->status = -1;
+				break;
+			}
+		}
+	}
+
+	task->errnum = errno;
+
+	return NULL;
+}
+
+static int gm_load_sections(struct gm_index_head *head, size_t count, uint32_t section_mask) {
+	struct gm_parse_task *tasks = NULL;
+	size_t task_count = 0;
+	int status = 0;
+
+	tasks = calloc(count + 1, sizeof(struct gm_parse_task));
+	if (!tasks) {
+		return -1;
+	}
+
+	// SPRT sections are parsed after STRG, even if STRG wasn't requested
+	const bool sprt_with_strg = head->slots[GM_STRG] && (section_mask & GM_SECTION_BIT(GM_SPRT));
+
+	for (struct gm_index *section = head->sections; section->section != GM_END; ++ section) {
+		const bool requested = section_mask & GM_SECTION_BIT(section->section);
+
+		switch (section->section) {
+		case GM_SPRT:
+			if (sprt_with_strg || !requested) {
+				continue;
+			}
+			break;
+
+		case GM_STRG:
+			if (!requested && !(sprt_with_strg && section == head->slots[GM_STRG])) {
+				continue;
+			}
+			break;
+
+		case GM_TXTR:
+		case GM_AUDO:
+			if (!requested) {
+				continue;
+			}
+			break;
+
+		default:
+			// nothing to parse
+			if (requested) {
+				section->loaded = 1;
+			}
+			continue;
+		}
+
+		struct gm_parse_task *task = &tasks[task_count ++];
+		task->head         = head;
+		task->section      = section;
+		task->section_mask = section_mask;
+		gm_arena_init(&task->arena);
+	}
+
+	size_t first_inline = 0;
+#if defined(GM_HAVE_THREADS)
+	if (task_count > 1 && gm_thread_count() > 1) {
+		// the last task is run by this thread
+		for (; first_inline < task_count - 1; ++ first_inline) {
+			struct gm_parse_task *task = &tasks[first_inline];
+
+			if (pthread_create(&task->thread, NULL, gm_parse_worker, task) != 0) {
+				// just parse the rest in this thread
+				break;
+			}
+			task->started = true;
+		}
+	}
+#endif
+
+	for (size_t task_index = first_inline; task_index < task_count; ++ task_index) {
+		gm_parse_worker(&tasks[task_index]);
+	}
+
+	int errnum = 0;
+	for (size_t task_index = 0; task_index < task_count; ++ task_index) {
+		struct gm_parse_task *task = &tasks[task_index];
+
+#if defined(GM_HAVE_THREADS)
+		if (task->started) {
+			pthread_join(task->thread, NULL);
+		}
+#endif
+
+		// memory of the parsed entries is owned by the index from now on
+		gm_arena_merge(&head->arena, &task->arena);
+
+		if (task->status != 0 && status == 0) {
+			status = -1;
+			errnum = task->errnum;
+		}
+	}
+
+	free(tasks);
+
+	if (status != 0) {
+		errno = errnum;
+	}
+
+	return status;
+}
+
+static struct gm_index *gm_parse_index(const struct gm_archive *game, uint32_t section_mask, int flags) {
+	struct gm_cursor cursor;
+	struct gm_arena arena;
+	struct gm_index_head *head = NULL;
+	size_t count = 0;
+
+	gm_arena_init(&arena);
+	gm_cursor_init(&cursor, game, 0);
+
+	const uint8_t *buffer = gm_cursor_read(&cursor, 8);
+	if (!buffer) {
+		goto error;
+	}
+
+	if (memcmp(buffer, "FORM", 4) != 0) {
+		LOG_ERR("unsupported file magic: '%c%c%c%c' (0x%0x 0x%0x 0x%0x 0x%0x)",
+			buffer[0], buffer[1], buffer[2], buffer[3],
+			buffer[0], buffer[1], buffer[2], buffer[3]);
+
+		errno = ENOSYS;
+		goto error;
+	}
+
+	const uint32_t form_size = U32LE_FROM_BUF(buffer + 4);
+	const off_t end_offset = (off_t)form_size + 8;
+	off_t offset = 8;
+
+	// also keeps all offsets below within size_t for the cursor
+	if ((uint64_t)end_offset > game->size) {
+		LOG_ERR("archive is truncated: FORM size = %" PRIu64 ", file size = %" PRIuPTR, (uint64_t)end_offset, game->size);
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	// first pass: validate the section table and count the sections
+	while (offset < end_offset) {
+		gm_cursor_seek(&cursor, offset);
+
+		buffer = gm_cursor_read(&cursor, 8);
+		if (!buffer) {
+			goto error;
+		}
+
+		enum gm_section section_type = gm_parse_section(buffer);
+		if (section_type == GM_END) {
+			LOG_ERR("at offset %" PRIi64 ": unsupported section magic: '%c%c%c%c' (0x%0x 0x%0x 0x%0x 0x%0x)",
+				(int64_t)offset,
+				buffer[0], buffer[1], buffer[2], buffer[3],
+				buffer[0], buffer[1], buffer[2], buffer[3]);
+
+			errno = ENOSYS;
+			goto error;
+		}
+
+		const uint32_t section_size = U32LE_FROM_BUF(buffer + 4);
+		if ((off_t)section_size + 8 > end_offset - offset) {
+			LOG_ERR("%s section overflows file: section offset = %" PRIi64 ", section size = %" PRIu64 ", file size = %" PRIi64,
+				gm_section_name(section_type), (int64_t)offset, (uint64_t)section_size + 8, (int64_t)end_offset);
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		offset += (off_t)section_size + 8;
+		++ count;
+	}
+
+	// plus one zeroed element as GM_END terminator
+	head = gm_arena_calloc(&arena, 1, sizeof(struct gm_index_head) + (count + 1) * sizeof(struct gm_index));
+	if (!head) {
+		goto error;
+	}
+
+	// from here on all allocations use the arena inside of the head
+	head->arena   = arena;
+	head->archive = game;
+
+	// second pass: fill in the section table
+	offset = 8;
+	for (size_t section_index = 0; section_index < count; ++ section_index) {
+		struct gm_index *section = &head->sections[section_index];
+
+		gm_cursor_seek(&cursor, offset);
+		buffer = gm_cursor_read(&cursor, 8);
+
+		section->section = gm_parse_section(buffer);
+		section->offset  = offset;
+		section->size    = U32LE_FROM_BUF(buffer + 4);
+
+		if (!head->slots[section->section]) {
+			head->slots[section->section] = section;
+		}
+
+		offset += (off_t)section->size + 8;
+	}
+
+	// parse the entries of the requested sections, the rest is parsed on demand
+	if (gm_load_sections(head, count, section_mask) != 0) {
+		goto error;
+	}
+
+	if (!(flags & GM_INDEX_LAZY)) {
+		head->archive = NULL;
+	}
+
+	return head->sections;
+
+error:
+	{
+		int errnum = errno;
+		if (head) {
+			// the head itself lives in the arena
+			arena = head->arena;
+		}
+		gm_arena_free(&arena);
+		errno = errnum;
+	}
+
+	return NULL;
+}
+
+// The index cache is a sidecar file next to the archive that holds a fully
+// parsed index, so repeated runs of the tools don't need to parse the
+// archive at all. It is keyed by the archive size, mtime (with nanoseconds,
+// so a rewrite within the same second is noticed), inode and a hash of the
+// FORM header and the section table. Everything that rewrites an archive
+// removes its cache too, see gm_remove_index_cache(). All numbers are little
+// endian:
+//
+//   header    GM_CACHE_HDR_SIZE
+//   sections  GM_CACHE_SECTION_SIZE per section
+//   entries   GM_CACHE_ENTRY_SIZE per entry, in section order
+//   tpags     GM_CACHE_TPAG_SIZE per TPAG rect, in sprite order
+//   slots     GM_CACHE_SLOT_SIZE per slot of each string lookup table
+//   blobs     copy of each STRG section that has a lookup table
+#define GM_CACHE_MAGIC        "GMIX"
+#define GM_CACHE_VERSION      2
+#define GM_CACHE_HDR_SIZE     80
+#define GM_CACHE_SECTION_SIZE 40
+#define GM_CACHE_ENTRY_SIZE   48
+#define GM_CACHE_TPAG_SIZE    40
+#define GM_CACHE_SLOT_SIZE    4
+
+// Doesn't validate anything, a broken archive is reported by the parser.
+static uint64_t gm_archive_fingerprint(const struct gm_archive *game) {
+	uint64_t hash = GM_FNV1A_OFFSET;
+
+	if (game->size < 8) {
+		return hash;
+	}
+
+	hash = gm_fnv1a(hash, game->data, 8);
+
+	size_t end_offset = (size_t)U32LE_FROM_BUF(game->data + 4) + 8;
+	if (end_offset > game->size) {
+		end_offset = game->size;
+	}
+
+	size_t offset = 8;
+	while (end_offset - offset >= 8) {
+		const uint8_t *header = game->data + offset;
+		const size_t section_size = U32LE_FROM_BUF(header + 4);
+
+		hash = gm_fnv1a(hash, header, 8);
+
+		if (section_size > end_offset - offset - 8) {
+			break;
+		}
+		offset += section_size + 8;
+	}
+
+	return hash;
+}
+
+int gm_default_index_flags(void) {
+	const char *value = getenv(GM_INDEX_CACHE_ENV);
+
+	return value && value[0] && strcmp(value, "0") != 0 ? GM_INDEX_CACHE : 0;
+}
+
+static int gm_write_index_cache(const struct gm_index *index, const struct gm_archive *game, uint64_t fingerprint, const char *cachename) {
+	uint8_t buffer[GM_CACHE_HDR_SIZE];
+	char *tmpname = NULL;
+	FILE *fp = NULL;
+	size_t section_count = 0;
+	size_t entry_count   = 0;
+	size_t tpag_count    = 0;
+	size_t slot_count    = 0;
+	int status = 0;
+
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if (!section->loaded) {
+			LOG_ERR("entries of %s section where not loaded", gm_section_name(section->section));
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		++ section_count;
+		entry_count += section->entry_count;
+
+		if (section->section == GM_SPRT) {
+			for (size_t entry_index = 0; entry_index < section->entry_count; ++ entry_index) {
+				tpag_count += section->entries[entry_index].meta.sprt.tpag_count;
+			}
+		}
+
+		if (section->section == GM_STRG && section->lookup) {
+			slot_count += section->lookup->mask + 1;
+		}
+	}
+
+	tmpname = GM_CONCAT(cachename, ".tmp");
+	if (!tmpname) {
+		goto error;
+	}
+
+	fp = fopen(tmpname, "wb");
+	if (!fp) {
+		goto error;
+	}
+
+	memset(buffer, 0, sizeof(buffer));
+	memcpy(buffer, GM_CACHE_MAGIC, 4);
+	WRITE_U32LE(buffer +  4, GM_CACHE_VERSION);
+	WRITE_U64LE(buffer +  8, game->size);
+	WRITE_U64LE(buffer + 16, game->mtime);
+	WRITE_U64LE(buffer + 24, fingerprint);
+	WRITE_U32LE(buffer + 32, section_count);
+	WRITE_U64LE(buffer + 40, entry_count);
+	WRITE_U64LE(buffer + 48, tpag_count);
+	WRITE_U64LE(buffer + 56, slot_count);
+	WRITE_U64LE(buffer + 64, game->mtime_nsec);
+	WRITE_U64LE(buffer + 72, game->inode);
+
+	if (fwrite(buffer, GM_CACHE_HDR_SIZE, 1, fp) != 1) {
+		goto error;
+	}
+
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		memset(buffer, 0, GM_CACHE_SECTION_SIZE);
+		memcpy(buffer, gm_section_name(section->section), 4);
+		WRITE_U64LE(buffer +  8, section->offset);
+		WRITE_U64LE(buffer + 16, section->size);
+		WRITE_U64LE(buffer + 24, section->entry_count);
+		WRITE_U32LE(buffer + 32, section->section == GM_STRG && section->lookup ? section->lookup->mask + 1 : 0);
+
+		if (fwrite(buffer, GM_CACHE_SECTION_SIZE, 1, fp) != 1) {
+			goto error;
+		}
+	}
+
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		for (size_t entry_index = 0; entry_index < section->entry_count; ++ entry_index) {
+			const struct gm_entry *entry = &section->entries[entry_index];
+
+			memset(buffer, 0, GM_CACHE_ENTRY_SIZE);
+			WRITE_U64LE(buffer,      entry->offset);
+			WRITE_U64LE(buffer +  8, entry->size);
+			WRITE_U32LE(buffer + 16, entry->type);
+
+			switch (section->section) {
+			case GM_TXTR:
+				WRITE_U32LE(buffer + 20, entry->meta.txtr.unknown1);
+				WRITE_U64LE(buffer + 24, entry->meta.txtr.unknown2);
+				WRITE_U64LE(buffer + 32, entry->meta.txtr.width);
+				WRITE_U64LE(buffer + 40, entry->meta.txtr.height);
+				break;
+
+			case GM_SPRT:
+			{
+				// sprite names are views into the copy of the STRG section
+				const struct gm_lookup *lookup = GM_INDEX_HEAD(index)->slots[GM_STRG]->lookup;
+				const off_t name_offset = lookup->blob_offset + ((const uint8_t*)entry->meta.sprt.name - lookup->blob);
+
+				WRITE_U64LE(buffer + 24, name_offset);
+				WRITE_U64LE(buffer + 32, entry->meta.sprt.tpag_count);
+				break;
+			}
+
+			default:
+				break;
+			}
+
+			if (fwrite(buffer, GM_CACHE_ENTRY_SIZE, 1, fp) != 1) {
+				goto error;
+			}
+		}
+	}
+
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if (section->section != GM_SPRT) {
+			continue;
+		}
+
+		for (size_t entry_index = 0; entry_index < section->entry_count; ++ entry_index) {
+			const struct gm_entry *entry = &section->entries[entry_index];
+
+			for (size_t tpag_index = 0; tpag_index < entry->meta.sprt.tpag_count; ++ tpag_index) {
+				const struct gm_tpag *tpag = &entry->meta.sprt.tpag[tpag_index];
+
+				WRITE_U64LE(buffer,      tpag->x);
+				WRITE_U64LE(buffer +  8, tpag->y);
+				WRITE_U64LE(buffer + 16, tpag->width);
+				WRITE_U64LE(buffer + 24, tpag->height);
+				WRITE_U64LE(buffer + 32, tpag->txtr_index);
+
+				if (fwrite(buffer, GM_CACHE_TPAG_SIZE, 1, fp) != 1) {
+					goto error;
+				}
+			}
+		}
+	}
+
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if (section->section != GM_STRG || !section->lookup) {
+			continue;
+		}
+
+		for (size_t slot = 0; slot <= section->lookup->mask; ++ slot) {
+			WRITE_U32LE(buffer, section->lookup->slots[slot]);
+
+			if (fwrite(buffer, GM_CACHE_SLOT_SIZE, 1, fp) != 1) {
+				goto error;
+			}
+		}
+	}
+
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if (section->section == GM_STRG && section->lookup &&
+		    fwrite(section->lookup->blob, section->lookup->blob_size, 1, fp) != 1) {
+			goto error;
+		}
+	}
+
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto error;
+	}
+	fp = NULL;
+
+	// delete target mainly to make it work on windows:
+	if (unlink(cachename) != 0 && errno != ENOENT) {
+		goto error;
+	}
+
+	if (rename(tmpname, cachename) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+	int errnum = errno;
+
+	if (fp) {
+		fclose(fp);
+		fp = NULL;
+	}
+
+	if (tmpname) {
+		unlink(tmpname);
+	}
+
+	errno = errnum;
+
+end:
+
+	free(tmpname);
+
+	return status;
+}
+
+// Returns NULL if the cache is missing, stale or broken. The caller just
+// parses the archive in that case, so nothing is logged here.
+static struct gm_index *gm_read_index_cache(const struct gm_archive *game, uint64_t fingerprint, const char *cachename) {
+	struct stat st;
+	struct gm_arena arena;
+	struct gm_index_head *head = NULL;
+	uint8_t *data = NULL;
+	FILE *fp = NULL;
+
+	gm_arena_init(&arena);
+
+	fp = fopen(cachename, "rb");
+	if (!fp) {
+		goto error;
+	}
+
+	if (fstat(fileno(fp), &st) != 0) {
+		goto error;
+	}
+
+	if (st.st_size < GM_CACHE_HDR_SIZE || (uintmax_t)st.st_size > SIZE_MAX) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	const size_t size = (size_t)st.st_size;
+
+	// the whole cache is read at once and strings stay views into it
+	data = gm_arena_alloc(&arena, size);
+	if (!data) {
+		goto error;
+	}
+
+	if (fread(data, size, 1, fp) != 1) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	fclose(fp);
+	fp = NULL;
+
+	if (memcmp(data, GM_CACHE_MAGIC, 4) != 0 ||
+	    U32LE_FROM_BUF(data +  4) != GM_CACHE_VERSION ||
+	    U64LE_FROM_BUF(data +  8) != (uint64_t)game->size ||
+	    (int64_t)U64LE_FROM_BUF(data + 16) != game->mtime ||
+	    U64LE_FROM_BUF(data + 24) != fingerprint ||
+	    (int64_t)U64LE_FROM_BUF(data + 64) != game->mtime_nsec ||
+	    U64LE_FROM_BUF(data + 72) != game->inode) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	const uint64_t section_count = U32LE_FROM_BUF(data + 32);
+	const uint64_t entry_count   = U64LE_FROM_BUF(data + 40);
+	const uint64_t tpag_count    = U64LE_FROM_BUF(data + 48);
+	const uint64_t slot_count    = U64LE_FROM_BUF(data + 56);
+
+	// Subtracting from what is left of the cache instead of adding up the
+	// sizes of all parts can't overflow.
+	size_t rest = size - GM_CACHE_HDR_SIZE;
+	if (section_count > rest / GM_CACHE_SECTION_SIZE) { errno = EINVAL; goto error; }
+	rest -= section_count * GM_CACHE_SECTION_SIZE;
+	if (entry_count > rest / GM_CACHE_ENTRY_SIZE) { errno = EINVAL; goto error; }
+	rest -= entry_count * GM_CACHE_ENTRY_SIZE;
+	if (tpag_count > rest / GM_CACHE_TPAG_SIZE) { errno = EINVAL; goto error; }
+	rest -= tpag_count * GM_CACHE_TPAG_SIZE;
+	if (slot_count > rest / GM_CACHE_SLOT_SIZE) { errno = EINVAL; goto error; }
+	rest -= slot_count * GM_CACHE_SLOT_SIZE;
+
+	const uint8_t *section_ptr = data + GM_CACHE_HDR_SIZE;
+	const uint8_t *entry_ptr   = section_ptr + section_count * GM_CACHE_SECTION_SIZE;
+	const uint8_t *tpag_ptr    = entry_ptr   + entry_count   * GM_CACHE_ENTRY_SIZE;
+	const uint8_t *slot_ptr    = tpag_ptr    + tpag_count    * GM_CACHE_TPAG_SIZE;
+	const uint8_t *blob_ptr    = slot_ptr    + slot_count    * GM_CACHE_SLOT_SIZE;
+
+	// plus one zeroed element as GM_END terminator
+	head = gm_arena_calloc(&arena, 1, sizeof(struct gm_index_head) + (section_count + 1) * sizeof(struct gm_index));
+	if (!head) {
+		goto error;
+	}
+
+	// from here on all allocations use the arena inside of the head
+	head->arena = arena;
+
+	struct gm_entry *entries = gm_arena_calloc(&head->arena, entry_count, sizeof(struct gm_entry));
+	if (!entries) {
+		goto error;
+	}
+
+	struct gm_tpag *tpags = gm_arena_calloc(&head->arena, tpag_count, sizeof(struct gm_tpag));
+	if (!tpags) {
+		goto error;
+	}
+
+	// first pass: sections and string lookup tables, which the sprites need
+	size_t entry_index = 0;
+	size_t slot_index  = 0;
+	for (size_t section_index = 0; section_index < section_count; ++ section_index) {
+		struct gm_index *section = &head->sections[section_index];
+		const uint8_t *record = section_ptr + section_index * GM_CACHE_SECTION_SIZE;
+		const uint64_t offset         = U64LE_FROM_BUF(record +  8);
+		const uint64_t section_size   = U64LE_FROM_BUF(record + 16);
+		const uint64_t section_length = U64LE_FROM_BUF(record + 24);
+		const uint64_t section_slots  = U32LE_FROM_BUF(record + 32);
+
+		section->section = gm_parse_section(record);
+		if (section->section == GM_END ||
+		    offset > game->size || section_size > game->size - offset || game->size - offset - section_size < 8 ||
+		    section_length > entry_count - entry_index) {
+			errno = EINVAL;
+			goto error;
+		}
+
+		section->offset      = (off_t)offset;
+		section->size        = (size_t)section_size;
+		section->entry_count = (size_t)section_length;
+		section->entries     = entries + entry_index;
+		section->loaded      = 1;
+
+		entry_index += section_length;
+
+		if (section_slots > 0) {
+			// power of two bigger than the number of strings, or lookups wouldn't terminate
+			if (section->section != GM_STRG ||
+			    (section_slots & (section_slots - 1)) != 0 || section_slots <= section_length ||
+			    section_slots > slot_count - slot_index || section_size > rest) {
+				errno = EINVAL;
+				goto error;
+			}
+
+			struct gm_lookup *lookup = gm_arena_alloc(&head->arena, sizeof(struct gm_lookup) + section_slots * sizeof(size_t));
+			if (!lookup) {
+				goto error;
+			}
+
+			lookup->blob        = blob_ptr;
+			lookup->blob_offset = section->offset + 8;
+			lookup->blob_size   = section->size;
+			lookup->mask        = section_slots - 1;
+
+			for (size_t slot = 0; slot < section_slots; ++ slot) {
+				const uint32_t value = U32LE_FROM_BUF(slot_ptr + (slot_index + slot) * GM_CACHE_SLOT_SIZE);
+				if (value > section_length) {
+					errno = EINVAL;
+					goto error;
+				}
+				lookup->slots[slot] = value;
+			}
+
+			blob_ptr   += section->size;
+			rest       -= section->size;
+			slot_index += section_slots;
+
+			section->lookup = lookup;
+		}
+
+		if (!head->slots[section->section]) {
+			head->slots[section->section] = section;
+		}
+	}
+
+	if (entry_index != entry_count || slot_index != slot_count || rest != 0) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	// second pass: entries
+	size_t tpag_index = 0;
+	entry_index = 0;
+	for (struct gm_index *section = head->sections; section->section != GM_END; ++ section) {
+		const struct gm_lookup *lookup = section->lookup;
+
+		for (size_t index = 0; index < section->entry_count; ++ index, ++ entry_index) {
+			struct gm_entry *entry = &section->entries[index];
+			const uint8_t *record = entry_ptr + entry_index * GM_CACHE_ENTRY_SIZE;
+			const uint64_t offset = U64LE_FROM_BUF(record);
+			const uint64_t entry_size = U64LE_FROM_BUF(record + 8);
+			const uint32_t type = U32LE_FROM_BUF(record + 16);
+
+			if (offset > game->size || entry_size > game->size - offset || type > GM_TXT) {
+				errno = EINVAL;
+				goto error;
+			}
+
+			entry->offset = (off_t)offset;
+			entry->size   = (size_t)entry_size;
+			entry->type   = (enum gm_filetype)type;
+
+			switch (section->section) {
+			case GM_TXTR:
+				entry->meta.txtr.unknown1 = U32LE_FROM_BUF(record + 20);
+				entry->meta.txtr.unknown2 = (uint32_t)U64LE_FROM_BUF(record + 24);
+				entry->meta.txtr.width    = (size_t)U64LE_FROM_BUF(record + 32);
+				entry->meta.txtr.height   = (size_t)U64LE_FROM_BUF(record + 40);
+				break;
+
+			case GM_SPRT:
+			{
+				const uint64_t name_offset = U64LE_FROM_BUF(record + 24);
+				const uint64_t sprt_tpags  = U64LE_FROM_BUF(record + 32);
+
+				if (!head->slots[GM_STRG] || name_offset > UINT32_MAX || sprt_tpags > tpag_count - tpag_index) {
+					errno = EINVAL;
+					goto error;
+				}
+
+				entry->meta.sprt.name = gm_get_string(head->slots[GM_STRG], (off_t)name_offset);
+				if (!entry->meta.sprt.name) {
+					goto error;
+				}
+
+				entry->meta.sprt.tpag_count = (size_t)sprt_tpags;
+				entry->meta.sprt.tpag       = tpags + tpag_index;
+
+				tpag_index += sprt_tpags;
+				break;
+			}
+
+			case GM_STRG:
+				// strings are views into the copy of the section
+				if (!lookup || entry->offset < lookup->blob_offset || entry->size == 0 ||
+				    (size_t)(entry->offset - lookup->blob_offset) > lookup->blob_size - 4 ||
+				    entry->size > lookup->blob_size - 4 - (size_t)(entry->offset - lookup->blob_offset)) {
+					errno = EINVAL;
+					goto error;
+				}
+
+				entry->meta.strg = (const char*)lookup->blob + (entry->offset - lookup->blob_offset) + 4;
+
+				if (entry->meta.strg[entry->size - 1] != '\0') {
+					errno = EINVAL;
+					goto error;
+				}
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		// sprite names aren't stored in the cache, they're hashed again
+		if (section->section == GM_SPRT && gm_index_sprite_names(&head->arena, section) != 0) {
+			goto error;
+		}
+	}
+
+	if (tpag_index != tpag_count) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	for (size_t index = 0; index < tpag_count; ++ index) {
+		const uint8_t *record = tpag_ptr + index * GM_CACHE_TPAG_SIZE;
+
+		tpags[index].x          = (size_t)U64LE_FROM_BUF(record);
+		tpags[index].y          = (size_t)U64LE_FROM_BUF(record +  8);
+		tpags[index].width      = (size_t)U64LE_FROM_BUF(record + 16);
+		tpags[index].height     = (size_t)U64LE_FROM_BUF(record + 24);
+		tpags[index].txtr_index = (size_t)U64LE_FROM_BUF(record + 32);
+	}
+
+	return head->sections;
+
+error:
+	{
+		int errnum = errno;
+		if (fp) {
+			fclose(fp);
+		}
+		if (head) {
+			// the head itself lives in the arena
+			arena = head->arena;
+		}
+		gm_arena_free(&arena);
+		errno = errnum;
+	}
+
+	return NULL;
+}
+
+struct gm_index *gm_read_index_ex(const struct gm_archive *game, uint32_t section_mask, int flags) {
+	if (!(flags & GM_INDEX_CACHE) || !game->filename) {
+		return gm_parse_index(game, section_mask, flags);
+	}
+
+	const uint64_t fingerprint = gm_archive_fingerprint(game);
+	char *cachename = GM_CONCAT(game->filename, GM_INDEX_CACHE_EXT);
+	if (!cachename) {
+		return NULL;
+	}
+
+	struct gm_index *index = gm_read_index_cache(game, fingerprint, cachename);
+	if (!index) {
+		// missing or stale cache: parse everything, so the new cache is complete
+		index = gm_parse_index(game, GM_ALL_SECTIONS, flags);
+
+		if (index && gm_write_index_cache(index, game, fingerprint, cachename) != 0) {
+			LOG_WARN("couldn't write index cache %s: %s", cachename, strerror(errno));
+		}
+	}
+
+	int errnum = errno;
+	free(cachename);
+	errno = errnum;
+
+	return index;
+}
+
+// The cache key can't tell every rewrite apart (e.g. on file systems with
+// coarse timestamps), so writers remove the cache of the archive.
+static void gm_remove_index_cache(const char *filename) {
+	char *cachename = GM_CONCAT(filename, GM_INDEX_CACHE_EXT);
+	if (!cachename) {
+		LOG_WARN("couldn't remove index cache of %s: %s", filename, strerror(errno));
+		return;
+	}
+
+	if (unlink(cachename) != 0 && errno != ENOENT) {
+		LOG_WARN("couldn't remove index cache %s: %s", cachename, strerror(errno));
+	}
+	free(cachename);
+}
+
+struct gm_index *gm_read_archive_index(const struct gm_archive *game) {
+	return gm_read_index_ex(game, GM_ALL_SECTIONS, 0);
+}
+
+struct gm_index *gm_read_index(FILE *game) {
+	struct gm_archive *archive = gm_archive_from_file(game);
+	if (!archive) {
+		return NULL;
+	}
+
+	struct gm_index *index = gm_read_archive_index(archive);
+	int errnum = errno;
+
+	gm_close_archive(archive);
+
+	errno = errnum;
+	return index;
+}
+
+uint64_t gm_form_size(const struct gm_patched_index *index) {
+	uint64_t size = 0;
+	while (index->section != GM_END) {
+		size += (uint64_t)index->size + 8;
+		++ index;
+	}
+	return size;
+}
+
+int gm_write_hdr(FILE *fp, const uint8_t *magic, size_t size) {
+	if (!magic) {
+		LOG_ERR_MSG("magic may not be NULL");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (size > UINT32_MAX) {
+		LOG_ERR("section size out of range: size = %" PRIuPTR ", max size = %" PRIu32, size, UINT32_MAX);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint8_t buffer[8];
+	memcpy(buffer, magic, 4);
+	WRITE_U32LE(buffer + 4, (uint32_t)size);
+
+	if (fwrite(buffer, 8, 1, fp) != 1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+size_t gm_index_length(const struct gm_index *index) {
+	size_t len = 0;
+	while (index->section != GM_END) {
+		++ len;
+		++ index;
+	}
+	return len;
+}
+
+static int gm_compare_entry_offsets(const void *lhs, const void *rhs) {
+	const struct gm_patched_entry *lhs_entry = *(const struct gm_patched_entry * const *)lhs;
+	const struct gm_patched_entry *rhs_entry = *(const struct gm_patched_entry * const *)rhs;
+
+	if (lhs_entry->entry->offset != rhs_entry->entry->offset) {
+		return lhs_entry->entry->offset < rhs_entry->entry->offset ? -1 : 1;
+	}
+
+	// entries are one array, so this keeps the sort stable
+	return lhs_entry < rhs_entry ? -1 : lhs_entry > rhs_entry ? 1 : 0;
+}
+
+// Entries of a section (or only the patched ones) ordered by their offset in
+// the original archive. Entries are usually already in order, so sorting is
+// skipped then.
+static struct gm_patched_entry **gm_sorted_entries(const struct gm_patched_index *section, bool patched_only, size_t *countptr) {
+	struct gm_patched_entry **entries = malloc((section->entry_count > 0 ? section->entry_count : 1) * sizeof(struct gm_patched_entry*));
+	size_t count = 0;
+	bool sorted = true;
+
+	if (!entries) {
+		return NULL;
+	}
+
+	for (size_t index = 0; index < section->entry_count; ++ index) {
+		struct gm_patched_entry *entry = &section->entries[index];
+
+		if (patched_only && !entry->patch) {
+			continue;
+		}
+
+		if (count > 0 && entries[count - 1]->entry->offset > entry->entry->offset) {
+			sorted = false;
+		}
+
+		entries[count ++] = entry;
+	}
+
+	if (!sorted) {
+		qsort(entries, count, sizeof(struct gm_patched_entry*), gm_compare_entry_offsets);
+	}
+
+	*countptr = count;
+
+	return entries;
+}
+
+// Offsets and sizes are 64-bit while planning, but the fields of the archive
+// format are 32-bit. A layout that doesn't fit is refused when it is written.
+static int gm_write_u32_field(uint8_t *buf, uint64_t value, const char *name, const char *field) {
+	if (value > UINT32_MAX) {
+		LOG_ERR("%s: %s too big for the archive format: %s = %" PRIu64 ", max. allowed = %" PRIu32,
+		        name, field, field, value, UINT32_MAX);
+
+		errno = EFBIG;
+		return -1;
+	}
+
+	WRITE_U32LE(buf, value);
+
+	return 0;
+}
+
+// Header, entry count and offset table (and for TXTR the file info records)
+// of a TXTR or AUDO section.
+static size_t gm_entry_table_size(enum gm_section section, size_t count) {
+	return 12 + count * (section == GM_TXTR ? 4 + 12 : 4);
+}
+
+// AUDO entries are prefixed by their size
+static size_t gm_entry_prefix(enum gm_section section) {
+	return section == GM_AUDO ? 4 : 0;
+}
+
+static bool gm_entry_in_section(const struct gm_index *section, const struct gm_entry *entry) {
+	const off_t start = entry->offset - (off_t)gm_entry_prefix(section->section);
+
+	return start >= section->offset + (off_t)gm_entry_table_size(section->section, 0) &&
+	       entry->offset + (off_t)entry->size <= section->offset + 8 + (off_t)section->size;
+}
+
+#define GM_MAX_ENTRY_ALIGNMENT 128
+
+// The alignment that all entries of the section share (up to 128 bytes).
+// Moved entries are placed at the same alignment.
+static off_t gm_entry_alignment(const struct gm_patched_index *section) {
+	const size_t prefix = gm_entry_prefix(section->section);
+	off_t alignment = GM_MAX_ENTRY_ALIGNMENT;
+
+	for (size_t index = 0; index < section->entry_count && alignment > 1; ++ index) {
+		const struct gm_entry *entry = section->entries[index].entry;
+
+		if (gm_entry_in_section(section->index, entry)) {
+			while ((entry->offset - (off_t)prefix) % alignment != 0) {
+				alignment /= 2;
+			}
+		}
+	}
+
+	return alignment;
+}
+
+static off_t gm_align(off_t offset, off_t alignment) {
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+int gm_layout_patched_index(struct gm_patched_index *index) {
+	off_t delta = 0;
+	bool resized   = false;
+	bool displaced = false;
+
+	for (const struct gm_patched_index *section = index; section->section != GM_END; ++ section) {
+		resized = resized || section->size != section->index->size;
+
+		for (size_t entry_index = 0; entry_index < section->entry_count && !displaced; ++ entry_index) {
+			if (section->section == GM_TXTR || section->section == GM_AUDO) {
+				displaced = !gm_entry_in_section(section->index, section->entries[entry_index].entry);
+			}
+		}
+	}
+
+	// appended entries aren't moved along with the sections they point into
+	if (resized && displaced) {
+		LOG_ERR_MSG("archive contains appended entries, compact it first or patch it in append mode");
+
+		errno = ENOSYS;
+		return -1;
+	}
+
+	for (struct gm_patched_index *section = index; section->section != GM_END; ++ section) {
+		const struct gm_index *orig = section->index;
+		const bool resized = section->size != orig->size;
+
+		if (delta != 0 || resized) {
+			switch (section->section) {
+			// only know how to move these sections so far:
+			case GM_TXTR:
+			case GM_AUDO:
+				break;
+
+			default:
+				LOG_ERR("can't move %s section (not implemented)", gm_section_name(section->section));
+
+				errno = ENOSYS;
+				return -1;
+			}
+		}
+
+		section->offset = orig->offset + delta;
+
+		// The net size of the section says nothing about its entries, one
+		// can grow by what another one shrinks.
+		bool moved = delta != 0;
+		for (size_t index = 0; index < section->entry_count && !moved; ++ index) {
+			moved = section->entries[index].size != section->entries[index].entry->size;
+		}
+
+		if (!moved) {
+			continue;
+		}
+
+		size_t count = 0;
+		struct gm_patched_entry **entries = gm_sorted_entries(section, false, &count);
+		if (!entries) {
+			return -1;
+		}
+
+		// Prefix sum over the size changes. Entries that start at the same
+		// offset as a resized entry (aliases) are not moved relative to it.
+		off_t running = delta;
+		off_t pending = 0;
+		for (size_t index = 0; index < count; ++ index) {
+			struct gm_patched_entry *entry = entries[index];
+
+			if (index == 0 || entries[index - 1]->entry->offset != entry->entry->offset) {
+				running += pending;
+				pending  = 0;
+			}
+
+			entry->offset = entry->entry->offset + running;
+			pending += (off_t)entry->size - (off_t)entry->entry->size;
+		}
+
+		free(entries);
+
+		delta += (off_t)section->size - (off_t)orig->size;
+	}
+
+	return 0;
+}
+
+// Layout for GM_PATCH_APPEND: nothing is moved. Replacements that fit into
+// the old slot of an entry are written over it, everything else is appended
+// to the last section, which grows.
+static int gm_layout_appended_index(struct gm_patched_index *index) {
+	struct gm_patched_index *last = NULL;
+
+	for (struct gm_patched_index *section = index; section->section != GM_END; ++ section) {
+		section->offset = section->index->offset;
+		section->size   = section->index->size;
+		last = section;
+	}
+
+	if (!last || (last->section != GM_TXTR && last->section != GM_AUDO)) {
+		LOG_ERR_MSG("append mode needs a TXTR or AUDO section at the end of the archive");
+
+		errno = ENOSYS;
+		return -1;
+	}
+
+	off_t end = last->offset + 8 + (off_t)last->size;
+
+	for (struct gm_patched_index *section = index; section->section != GM_END; ++ section) {
+		if (section->section != GM_TXTR && section->section != GM_AUDO) {
+			continue;
+		}
+
+		const size_t prefix = gm_entry_prefix(section->section);
+		const off_t alignment = gm_entry_alignment(section);
+
+		for (size_t entry_index = 0; entry_index < section->entry_count; ++ entry_index) {
+			struct gm_patched_entry *entry = &section->entries[entry_index];
+			const bool inside = gm_entry_in_section(section->index, entry->entry);
+
+			entry->offset   = entry->entry->offset;
+			entry->appended = !inside;
+
+			if (!entry->patch) {
+				continue;
+			}
+
+			if (inside && entry->patch->size <= entry->entry->size) {
+				// the rest of the old slot is dead space
+				entry->size = entry->entry->size;
+				continue;
+			}
+
+			entry->offset   = gm_align(end, alignment) + (off_t)prefix;
+			entry->size     = entry->patch->size;
+			entry->appended = true;
+
+			end = entry->offset + (off_t)entry->size;
+		}
+	}
+
+	end = gm_align(end, 4);
+
+	if ((uint64_t)(end - last->offset - 8) > UINT32_MAX) {
+		LOG_ERR("%s section: appended entries exceed the maximum section size", gm_section_name(last->section));
+
+		errno = EFBIG;
+		return -1;
+	}
+
+	last->size = (size_t)(end - last->offset - 8);
+
+	return 0;
+}
+
+// Layout for gm_compact_archive(): the entries of TXTR and AUDO sections are
+// packed in the order of their old offsets. This drops replaced and appended
+// data and all gaps that aren't needed for alignment.
+static int gm_layout_compact_index(struct gm_patched_index *index) {
+	off_t delta = 0;
+
+	for (struct gm_patched_index *section = index; section->section != GM_END; ++ section) {
+		const struct gm_index *orig = section->index;
+
+		section->offset = orig->offset + delta;
+		section->size   = orig->size;
+
+		if (section->section != GM_TXTR && section->section != GM_AUDO) {
+			if (delta != 0) {
+				LOG_ERR("can't move %s section (not implemented)", gm_section_name(section->section));
+
+				errno = ENOSYS;
+				return -1;
+			}
+			continue;
+		}
+
+		const size_t prefix = gm_entry_prefix(section->section);
+		const off_t alignment = gm_entry_alignment(section);
+		size_t count = 0;
+
+		struct gm_patched_entry **entries = gm_sorted_entries(section, false, &count);
+		if (!entries) {
+			return -1;
+		}
+
+		off_t cursor = section->offset + (off_t)gm_entry_table_size(section->section, section->entry_count);
+		for (size_t entry_index = 0; entry_index < count; ++ entry_index) {
+			struct gm_patched_entry *entry = entries[entry_index];
+
+			entry->appended = false;
+			entry->size     = entry->entry->size;
+
+			if (entry_index > 0 && entries[entry_index - 1]->entry->offset == entry->entry->offset) {
+				// aliases stay aliases
+				entry->offset = entries[entry_index - 1]->offset;
+			}
+			else {
+				entry->offset = gm_align(cursor, alignment) + (off_t)prefix;
+			}
+
+			if (entry->offset + (off_t)entry->size > cursor) {
+				cursor = entry->offset + (off_t)entry->size;
+			}
+		}
+
+		free(entries);
+
+		cursor = gm_align(cursor, 4);
+		section->size = (size_t)(cursor - section->offset - 8);
+
+		delta += (off_t)section->size - (off_t)orig->size;
+	}
+
+	return 0;
+}
+
+// The plan is built strictly front to back, so each extent starts where the
+// previous one ended.
+static struct gm_extent *gm_plan_add(struct gm_plan *plan, enum gm_extent_type type, size_t size) {
+	if (plan->extent_count == plan->extent_capacity) {
+		const size_t capacity = plan->extent_capacity ? plan->extent_capacity * 2 : 256;
+		if (capacity > SIZE_MAX / sizeof(struct gm_extent)) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		struct gm_extent *extents = realloc(plan->extents, capacity * sizeof(struct gm_extent));
+		if (!extents) {
+			return NULL;
+		}
+
+		plan->extents         = extents;
+		plan->extent_capacity = capacity;
+	}
+
+	struct gm_extent *extent = &plan->extents[plan->extent_count ++];
+	extent->type   = type;
+	extent->offset = (off_t)plan->size;
+	extent->size   = size;
+
+	plan->size += size;
+
+	return extent;
+}
+
+static int gm_plan_copy(struct gm_plan *plan, off_t src_offset, size_t size) {
+	if (size == 0) {
+		return 0;
+	}
+
+	// Unpatched neighbours are usually also neighbours in the original
+	// archive, so they end up as one big copy.
+	if (plan->extent_count > 0) {
+		struct gm_extent *prev = &plan->extents[plan->extent_count - 1];
+
+		if (prev->type == GM_EXTENT_COPY && prev->src.src_offset + (off_t)prev->size == src_offset) {
+			prev->size += size;
+			plan->size += size;
+			return 0;
+		}
+	}
+
+	struct gm_extent *extent = gm_plan_add(plan, GM_EXTENT_COPY, size);
+	if (!extent) {
+		return -1;
+	}
+
+	extent->src.src_offset = src_offset;
+
+	return 0;
+}
+
+// Returns a buffer of size bytes in the data pool of the plan that has to be
+// filled in before the next call.
+static uint8_t *gm_plan_data(struct gm_plan *plan, size_t size) {
+	if (size > SIZE_MAX - plan->data_size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (plan->data_size + size > plan->data_capacity) {
+		size_t capacity = plan->data_capacity ? plan->data_capacity : 4096;
+		while (capacity < plan->data_size + size) {
+			if (capacity > SIZE_MAX / 2) {
+				errno = ENOMEM;
+				return NULL;
+			}
+			capacity *= 2;
+		}
+
+		uint8_t *data = realloc(plan->data, capacity);
+		if (!data) {
+			return NULL;
+		}
+
+		plan->data          = data;
+		plan->data_capacity = capacity;
+	}
+
+	struct gm_extent *prev = plan->extent_count > 0 ? &plan->extents[plan->extent_count - 1] : NULL;
+
+	if (prev && prev->type == GM_EXTENT_DATA && prev->src.data_offset + prev->size == plan->data_size) {
+		prev->size += size;
+		plan->size += size;
+	}
+	else {
+		struct gm_extent *extent = gm_plan_add(plan, GM_EXTENT_DATA, size);
+		if (!extent) {
+			return NULL;
+		}
+
+		extent->src.data_offset = plan->data_size;
+	}
+
+	uint8_t *data = plan->data + plan->data_size;
+	plan->data_size += size;
+
+	memset(data, 0, size);
+
+	return data;
+}
+
+static int gm_plan_patch(struct gm_plan *plan, const struct gm_patch *patch) {
+	struct gm_extent *extent = gm_plan_add(plan, GM_EXTENT_PATCH, patch->size);
+	if (!extent) {
+		return -1;
+	}
+
+	extent->src.patch = patch;
+
+	return 0;
+}
+
+// Copies what lies between the end of the last planned entry (cursor) and
+// start in the original archive, e.g. alignment padding.
+static int gm_plan_gap(struct gm_plan *plan, const struct gm_patched_index *section, off_t *cursor, off_t start) {
+	if (start < *cursor) {
+		LOG_ERR("%s section: overlapping entries at offset %" PRIi64 " (not supported)",
+		        gm_section_name(section->section), (int64_t)start);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (gm_plan_copy(plan, *cursor, (size_t)(start - *cursor)) != 0) {
+		return -1;
+	}
+
+	*cursor = start;
+
+	return 0;
+}
+
+static int gm_plan_strg(struct gm_plan *plan, const struct gm_patched_index *section) {
+	const struct gm_index *orig = section->index;
+	const off_t end_offset = orig->offset + 8 + (off_t)orig->size;
+	off_t cursor = orig->offset;
+	size_t count = 0;
+	int status = 0;
+
+	// Strings are only replaced in place, so everything else (header, offset
+	// table, other strings, padding) is copied from the original section.
+	struct gm_patched_entry **entries = gm_sorted_entries(section, true, &count);
+	if (!entries) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		const struct gm_patched_entry *entry = entries[index];
+		const size_t old_size = entry->entry->size;
+
+		if (gm_plan_gap(plan, section, &cursor, entry->entry->offset) != 0) {
+			goto error;
+		}
+
+		uint8_t *data = gm_plan_data(plan, old_size + 4);
+		if (!data) {
+			goto error;
+		}
+
+		// null byte not included in size, rest is zero padded
+		const size_t new_len = strlen(entry->patch->meta.strg.new);
+		if (gm_write_u32_field(data, new_len, gm_section_name(section->section), "string length") != 0) {
+			goto error;
+		}
+		memcpy(data + 4, entry->patch->meta.strg.new, new_len);
+
+		cursor += (off_t)old_size + 4;
+	}
+
+	if (cursor > end_offset) {
+		LOG_ERR("%s section: string overflows section", gm_section_name(section->section));
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	if (gm_plan_copy(plan, cursor, (size_t)(end_offset - cursor)) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	free(entries);
+
+	return status;
+}
+
+// Header and tables of a TXTR or AUDO section, generated from the new entry
+// offsets.
+static int gm_plan_entry_table(struct gm_plan *plan, const struct gm_patched_index *section) {
+	const struct gm_index *orig = section->index;
+	const size_t count = section->entry_count;
+	const size_t prefix = gm_entry_prefix(section->section);
+
+	if (count > (SIZE_MAX - 12) / (4 + 12) || gm_entry_table_size(section->section, count) > orig->size + 8) {
+		LOG_ERR("%s section: entry table overflows section", gm_section_name(section->section));
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint8_t *data = gm_plan_data(plan, gm_entry_table_size(section->section, count));
+	if (!data) {
+		return -1;
+	}
+
+	const char *name = gm_section_name(section->section);
+	memcpy(data, name, 4);
+
+	if (gm_write_u32_field(data + 4, section->size, name, "section size") != 0 ||
+	    gm_write_u32_field(data + 8, count, name, "entry count") != 0) {
+		return -1;
+	}
+
+	if (section->section == GM_TXTR) {
+		const uint64_t fileinfo_offset = (uint64_t)section->offset + 12 + 4 * count;
+		uint8_t *fileinfo = data + 12 + 4 * count;
+
+		for (size_t index = 0; index < count; ++ index) {
+			const struct gm_patched_entry *entry = &section->entries[index];
+
+			if (gm_write_u32_field(data + 12 + 4 * index, fileinfo_offset + index * 12, name, "file info offset") != 0 ||
+			    gm_write_u32_field(fileinfo + 8, (uint64_t)entry->offset, name, "entry offset") != 0) {
+				return -1;
+			}
+			WRITE_U32LE(fileinfo,     entry->entry->meta.txtr.unknown1);
+			WRITE_U32LE(fileinfo + 4, entry->entry->meta.txtr.unknown2);
+			fileinfo += 12;
+		}
+	}
+	else {
+		for (size_t index = 0; index < count; ++ index) {
+			if (gm_write_u32_field(data + 12 + 4 * index, (uint64_t)section->entries[index].offset - prefix, name, "entry offset") != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Zero bytes up to offset, e.g. alignment padding of moved entries.
+static int gm_plan_padding(struct gm_plan *plan, off_t offset) {
+	if (offset < (off_t)plan->size) {
+		LOG_ERR("overlapping entries at offset %" PRIi64 " (not supported)", (int64_t)offset);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (offset > (off_t)plan->size && !gm_plan_data(plan, (size_t)offset - plan->size)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// TXTR and AUDO: header and tables are generated, entries are copied or
+// replaced by patches and everything in between is copied.
+static int gm_plan_entries(struct gm_plan *plan, const struct gm_patched_index *section) {
+	const struct gm_index *orig = section->index;
+	const off_t end_offset = orig->offset + 8 + (off_t)orig->size;
+	const size_t count = section->entry_count;
+	const size_t prefix = gm_entry_prefix(section->section);
+	struct gm_patched_entry **entries = NULL;
+	int status = 0;
+
+	if (gm_plan_entry_table(plan, section) != 0) {
+		goto error;
+	}
+
+	off_t cursor = orig->offset + (off_t)gm_entry_table_size(section->section, count);
+	size_t sorted_count = 0;
+
+	entries = gm_sorted_entries(section, false, &sorted_count);
+	if (!entries) {
+		goto error;
+	}
+
+	const struct gm_entry *prev = NULL;
+	for (size_t index = 0; index < sorted_count; ++ index) {
+		const struct gm_patched_entry *entry = entries[index];
+		const off_t start = entry->entry->offset - (off_t)prefix;
+
+		// Appended entries are planned by gm_plan_appended(). Whatever is at
+		// their old location is copied as it is.
+		if (entry->appended) {
+			continue;
+		}
+
+		// Entries that point to the same data (aliases) are planned once. If
+		// one of them is patched its data is used, like the old writer did
+		// the last patch in index order wins.
+		if (prev && prev->offset == entry->entry->offset) {
+			continue;
+		}
+		prev = entry->entry;
+
+		for (size_t alias = index + 1; alias < sorted_count && entries[alias]->entry->offset == entry->entry->offset; ++ alias) {
+			const struct gm_patched_entry *other = entries[alias];
+
+			if (!other->appended && other->patch && (!entry->patch || other > entry)) {
+				entry = other;
+			}
+		}
+
+		if (gm_plan_gap(plan, section, &cursor, start) != 0) {
+			goto error;
+		}
+
+		// the table was generated from the layout, the data has to follow it
+		if ((off_t)plan->size != entry->offset - (off_t)prefix) {
+			LOG_ERR("%s section: planned entry offset %" PRIuPTR " doesn't match layout offset %" PRIi64,
+			        gm_section_name(section->section), plan->size, (int64_t)(entry->offset - (off_t)prefix));
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		if (entry->patch) {
+			if (prefix) {
+				uint8_t *size_prefix = gm_plan_data(plan, prefix);
+				if (!size_prefix ||
+				    gm_write_u32_field(size_prefix, entry->patch->size, gm_section_name(section->section), "entry size") != 0) {
+					goto error;
+				}
+			}
+
+			if (gm_plan_patch(plan, entry->patch) != 0) {
+				goto error;
+			}
+
+			// in append mode smaller replacements keep the whole old slot
+			if (entry->size > entry->patch->size &&
+			    gm_plan_copy(plan, entry->entry->offset + (off_t)entry->patch->size, entry->size - entry->patch->size) != 0) {
+				goto error;
+			}
+		}
+		else if (gm_plan_copy(plan, start, entry->entry->size + prefix) != 0) {
+			goto error;
+		}
+
+		cursor = start + (off_t)(entry->entry->size + prefix);
+	}
+
+	if (cursor > end_offset) {
+		LOG_ERR("%s section: entry overflows section", gm_section_name(section->section));
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	if (gm_plan_copy(plan, cursor, (size_t)(end_offset - cursor)) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	free(entries);
+
+	return status;
+}
+
+// Replacements of GM_PATCH_APPEND that didn't fit into the old data, after
+// the old end of the last section. gm_layout_appended_index() assigned their
+// offsets in this same order.
+static int gm_plan_appended(struct gm_plan *plan, const struct gm_patched_index *index) {
+	for (const struct gm_patched_index *section = index; section->section != GM_END; ++ section) {
+		const size_t prefix = gm_entry_prefix(section->section);
+
+		for (size_t entry_index = 0; entry_index < section->entry_count; ++ entry_index) {
+			const struct gm_patched_entry *entry = &section->entries[entry_index];
+
+			if (!entry->appended || !entry->patch) {
+				continue;
+			}
+
+			if (gm_plan_padding(plan, entry->offset - (off_t)prefix) != 0) {
+				return -1;
+			}
+
+			if (prefix) {
+				uint8_t *size_prefix = gm_plan_data(plan, prefix);
+				if (!size_prefix ||
+				    gm_write_u32_field(size_prefix, entry->patch->size, gm_section_name(section->section), "entry size") != 0) {
+					return -1;
+				}
+			}
+
+			if (gm_plan_patch(plan, entry->patch) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return gm_plan_padding(plan, (off_t)gm_form_size(index) + 8);
+}
+
+// Entries of a compacted TXTR or AUDO section, see gm_layout_compact_index().
+static int gm_plan_compact_entries(struct gm_plan *plan, const struct gm_patched_index *section) {
+	const size_t prefix = gm_entry_prefix(section->section);
+	size_t count = 0;
+	int status = 0;
+
+	if (gm_plan_entry_table(plan, section) != 0) {
+		return -1;
+	}
+
+	struct gm_patched_entry **entries = gm_sorted_entries(section, false, &count);
+	if (!entries) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		const struct gm_patched_entry *entry = entries[index];
+
+		if (index > 0 && entries[index - 1]->offset == entry->offset) {
+			continue;
+		}
+
+		if (gm_plan_padding(plan, entry->offset - (off_t)prefix) != 0) {
+			goto error;
+		}
+
+		if (gm_plan_copy(plan, entry->entry->offset - (off_t)prefix, entry->size + prefix) != 0) {
+			goto error;
+		}
+	}
+
+	if (gm_plan_padding(plan, section->offset + 8 + (off_t)section->size) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	free(entries);
+
+	return status;
+}
+
+struct gm_plan *gm_plan_patched_index(const struct gm_patched_index *index) {
+	struct gm_plan *plan = calloc(1, sizeof(struct gm_plan));
+	if (!plan) {
+		return NULL;
+	}
+
+	uint8_t *data = gm_plan_data(plan, 8);
+	if (!data) {
+		goto error;
+	}
+
+	memcpy(data, "FORM", 4);
+	if (gm_write_u32_field(data + 4, gm_form_size(index), "FORM", "archive size") != 0) {
+		goto error;
+	}
+
+	for (const struct gm_patched_index *section = index; section->section != GM_END; ++ section) {
+		const struct gm_index *orig = section->index;
+
+		if ((off_t)plan->size != section->offset) {
+			LOG_ERR("%s section: planned offset %" PRIuPTR " doesn't match layout offset %" PRIi64,
+			        gm_section_name(section->section), plan->size, (int64_t)section->offset);
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		bool patched = false;
+		for (size_t index = 0; index < section->entry_count && !patched; ++ index) {
+			patched = section->entries[index].patch != NULL;
+		}
+
+		if (!patched && section->offset == orig->offset && section->size == orig->size) {
+			// entries weren't needed or nothing changed
+			if (gm_plan_copy(plan, orig->offset, orig->size + 8) != 0) {
+				goto error;
+			}
+			continue;
+		}
+
+		switch (section->section) {
+		case GM_STRG:
+			if (gm_plan_strg(plan, section) != 0) {
+				goto error;
+			}
+			break;
+
+		case GM_TXTR:
+		case GM_AUDO:
+			if (!orig->loaded) {
+				LOG_ERR("entries of %s section where not loaded", gm_section_name(section->section));
+
+				errno = EINVAL;
+				goto error;
+			}
+
+			if (gm_plan_entries(plan, section) != 0) {
+				goto error;
+			}
+			break;
+
+		default:
+			LOG_ERR("can't patch %s section (not implemented)", gm_section_name(section->section));
+
+			errno = ENOSYS;
+			goto error;
+		}
+	}
+
+	if (gm_plan_appended(plan, index) != 0) {
+		goto error;
+	}
+
+	return plan;
+
+error:
+	{
+		int errnum = errno;
+		gm_free_plan(plan);
+		errno = errnum;
+	}
+
+	return NULL;
+}
+
+static struct gm_patched_index *gm_new_patched_index(const struct gm_index *index) {
+	const size_t count = gm_index_length(index);
+	struct gm_patched_index *patched = calloc(count + 1, sizeof(struct gm_patched_index));
+	if (!patched) {
+		return NULL;
+	}
+
+	// terminated first, so a partially filled index can be freed
+	patched[count].section = GM_END;
+
+	for (size_t i = 0; i < count; ++ i) {
+		size_t entry_count = index[i].entry_count;
+		struct gm_patched_entry *entries = calloc(entry_count > 0 ? entry_count : 1, sizeof(struct gm_patched_entry));
+		if (!entries) {
+			int errnum = errno;
+			gm_free_patched_index(patched);
+			errno = errnum;
+			return NULL;
+		}
+
+		struct gm_entry *index_entries = index[i].entries;
+		for (size_t j = 0; j < entry_count; ++ j) {
+			entries[j].offset = index_entries[j].offset;
+			entries[j].size   = index_entries[j].size;
+			entries[j].entry  = &index_entries[j];
+		}
+
+		patched[i].section     = index[i].section;
+		patched[i].offset      = index[i].offset;
+		patched[i].size        = index[i].size;
+		patched[i].entry_count = entry_count;
+		patched[i].entries     = entries;
+		patched[i].index       = &index[i];
+	}
+
+	return patched;
+}
+
+struct gm_plan *gm_plan_patches(const struct gm_index *index, const struct gm_patch *patches) {
+	return gm_plan_patches_ex(index, patches, 0);
+}
+
+struct gm_plan *gm_plan_patches_ex(const struct gm_index *index, const struct gm_patch *patches, int flags) {
+	struct gm_patched_index *patched = NULL;
+	struct gm_plan *plan = NULL;
+
+	patched = gm_new_patched_index(index);
+	if (!patched) {
+		goto error;
+	}
+
+	// validate all patches
+	for (const struct gm_patch *patch = patches; patch->section != GM_END; ++ patch) {
+		const struct gm_index *found = gm_find_section(index, patch->section);
+		struct gm_patched_index *section = found ? &patched[found - index] : NULL;
+		if (!section) {
+			LOG_ERR("archive contains no %s section", gm_section_name(patch->section));
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		if (gm_patch_entry(section, patch) != 0) {
+			LOG_ERR("applying patch for section %s, entry %" PRIuPTR " failed",
+				gm_section_name(patch->section), patch->index);
+			goto error;
+		}
+	}
+
+	// then compute the new layout and the plan in one go
+	if (flags & GM_PATCH_APPEND) {
+		if (gm_layout_appended_index(patched) != 0) {
+			goto error;
+		}
+	}
+	else if (gm_layout_patched_index(patched) != 0) {
+		goto error;
+	}
+
+	plan = gm_plan_patched_index(patched);
+	if (!plan) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	{
+		int errnum = errno;
+		gm_free_plan(plan);
+		plan = NULL;
+		errno = errnum;
+	}
+
+end:
+	if (patched) {
+		int errnum = errno;
+		gm_free_patched_index(patched);
+		errno = errnum;
+	}
+
+	return plan;
+}
+
+struct gm_plan *gm_plan_compact(const struct gm_index *index) {
+	struct gm_patched_index *patched = NULL;
+	struct gm_plan *plan = NULL;
+
+	patched = gm_new_patched_index(index);
+	if (!patched) {
+		goto error;
+	}
+
+	for (const struct gm_patched_index *section = patched; section->section != GM_END; ++ section) {
+		if ((section->section == GM_TXTR || section->section == GM_AUDO) && !section->index->loaded) {
+			LOG_ERR("entries of %s section where not loaded", gm_section_name(section->section));
+
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	if (gm_layout_compact_index(patched) != 0) {
+		goto error;
+	}
+
+	plan = calloc(1, sizeof(struct gm_plan));
+	if (!plan) {
+		goto error;
+	}
+
+	uint8_t *data = gm_plan_data(plan, 8);
+	if (!data) {
+		goto error;
+	}
+
+	memcpy(data, "FORM", 4);
+	if (gm_write_u32_field(data + 4, gm_form_size(patched), "FORM", "archive size") != 0) {
+		goto error;
+	}
+
+	for (const struct gm_patched_index *section = patched; section->section != GM_END; ++ section) {
+		if (section->section == GM_TXTR || section->section == GM_AUDO) {
+			if (gm_plan_compact_entries(plan, section) != 0) {
+				goto error;
+			}
+		}
+		else if (gm_plan_copy(plan, section->index->offset, section->index->size + 8) != 0) {
+			goto error;
+		}
+	}
+
+	goto end;
+
+error:
+	{
+		int errnum = errno;
+		gm_free_plan(plan);
+		plan = NULL;
+		errno = errnum;
+	}
+
+end:
+	if (patched) {
+		int errnum = errno;
+		gm_free_patched_index(patched);
+		errno = errnum;
+	}
+
+	return plan;
+}
+
+// FNV-1a of a whole source archive, computed while a plan is written. The
+// bytes are hashed in order from the mapping along with the copy, so the
+// archive is only read from the disk once.
+// Ranges that aren't copied (or copied out of order) are hashed as the
+// position passes them.
+struct gm_source_hash {
+	const struct gm_archive *archive;
+	size_t   pos; // everything before this is hashed
+	uint64_t hash;
+};
+
+static void gm_source_hash_init(struct gm_source_hash *hash, const struct gm_archive *archive) {
+	hash->archive = archive;
+	hash->pos     = 0;
+	hash->hash    = GM_FNV1A_OFFSET;
+}
+
+static void gm_source_hash_to(struct gm_source_hash *hash, size_t end) {
+	if (end > hash->archive->size) {
+		end = hash->archive->size;
+	}
+
+	if (end > hash->pos) {
+		hash->hash = gm_fnv1a(hash->hash, hash->archive->data + hash->pos, end - hash->pos);
+		hash->pos  = end;
+	}
+}
+
+static int gm_write_plan_hashed(const struct gm_plan *plan, FILE *src, FILE *dst, struct gm_source_hash *hash) {
+	uint8_t *buf = NULL;
+	size_t bufsize = 0;
+	size_t max_copy = 0;
+	int status = 0;
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+
+		if (extent->type != GM_EXTENT_DATA && extent->size > max_copy) {
+			max_copy = extent->size;
+		}
+	}
+
+	buf = gm_copy_buffer_new(max_copy, &bufsize);
+	if (!buf) {
+		goto error;
+	}
+
+	// extents are contiguous, so dst is only positioned once
+	if (fseeko(dst, 0, SEEK_SET) != 0) {
+		goto error;
+	}
+
+	struct gm_writeback writeback;
+	gm_writeback_init(&writeback, dst);
+	gm_advise_file(fileno(src), 0, 0, GM_ADVICE_SEQUENTIAL);
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+
+		switch (extent->type) {
+		case GM_EXTENT_COPY:
+			if (!hash) {
+				if (gm_copy_range_streamed(src, extent->src.src_offset, dst, extent->size, buf, bufsize, &writeback) != 0) {
+					goto error;
+				}
+				break;
+			}
+
+			for (size_t done = 0; done < extent->size;) {
+				const size_t chunk_size = extent->size - done >= GM_STREAM_CHUNK_SIZE ? GM_STREAM_CHUNK_SIZE : extent->size - done;
+				const off_t srcoff = extent->src.src_offset + (off_t)done;
+
+				// hashing reads the chunk into the page cache for the copy,
+				// which drops it afterwards
+				gm_source_hash_to(hash, (size_t)srcoff + chunk_size);
+
+				if (gm_copy_range_streamed(src, srcoff, dst, chunk_size, buf, bufsize, &writeback) != 0) {
+					goto error;
+				}
+				done += chunk_size;
+			}
+			break;
+
+		case GM_EXTENT_DATA:
+			if (fwrite(plan->data + extent->src.data_offset, extent->size, 1, dst) != 1) {
+				goto error;
+			}
+			break;
+
+		case GM_EXTENT_PATCH:
+			if (gm_write_patch_data(dst, extent->src.patch, buf, bufsize) != 0) {
+				goto error;
+			}
+			gm_writeback(&writeback, dst);
+			break;
+
+		default:
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	if (buf) {
+		int errnum = errno;
+		free(buf);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+int gm_write_plan(const struct gm_plan *plan, FILE *src, FILE *dst) {
+	return gm_write_plan_hashed(plan, src, dst, NULL);
+}
+
+// A COPY extent of one of the plans written by gm_write_plans().
+struct gm_fanout_copy {
+	const struct gm_extent *extent;
+	FILE *dst;
+};
+
+static int gm_compare_fanout_copies(const void *lhs, const void *rhs) {
+	const struct gm_extent *lhs_extent = ((const struct gm_fanout_copy*)lhs)->extent;
+	const struct gm_extent *rhs_extent = ((const struct gm_fanout_copy*)rhs)->extent;
+
+	if (lhs_extent->src.src_offset != rhs_extent->src.src_offset) {
+		return lhs_extent->src.src_offset < rhs_extent->src.src_offset ? -1 : 1;
+	}
+
+	return 0;
+}
+
+// Writes several plans that copy from the same source. Generated data and
+// patches are written first, then the source is read once from start to end
+// and every window is written to all the places that copy it.
+static int gm_write_plans_hashed(const struct gm_plan *const plans[], FILE *src, FILE *const dsts[], size_t count, struct gm_source_hash *hash) {
+	struct gm_fanout_copy *copies = NULL;
+	struct gm_fanout_copy *active = NULL;
+	uint8_t *buf = NULL;
+	size_t bufsize = 0;
+	size_t max_copy = 0;
+	size_t copy_count = 0;
+	int status = 0;
+
+	for (size_t plan_index = 0; plan_index < count; ++ plan_index) {
+		const struct gm_plan *plan = plans[plan_index];
+
+		for (size_t index = 0; index < plan->extent_count; ++ index) {
+			const struct gm_extent *extent = &plan->extents[index];
+
+			if (extent->type == GM_EXTENT_COPY && extent->size > 0) {
+				++ copy_count;
+			}
+
+			if (extent->type != GM_EXTENT_DATA && extent->size > max_copy) {
+				max_copy = extent->size;
+			}
+		}
+	}
+
+	buf    = gm_copy_buffer_new(max_copy, &bufsize);
+	copies = malloc((copy_count > 0 ? copy_count : 1) * sizeof(struct gm_fanout_copy));
+	active = malloc((copy_count > 0 ? copy_count : 1) * sizeof(struct gm_fanout_copy));
+	if (!buf || !copies || !active) {
+		goto error;
+	}
+
+	size_t copy_index = 0;
+	for (size_t plan_index = 0; plan_index < count; ++ plan_index) {
+		const struct gm_plan *plan = plans[plan_index];
+		FILE *dst = dsts[plan_index];
+
+		for (size_t index = 0; index < plan->extent_count; ++ index) {
+			const struct gm_extent *extent = &plan->extents[index];
+
+			switch (extent->type) {
+			case GM_EXTENT_COPY:
+				if (extent->size > 0) {
+					copies[copy_index].extent = extent;
+					copies[copy_index].dst    = dst;
+					++ copy_index;
+				}
+				break;
+
+			case GM_EXTENT_DATA:
+				if (fseeko(dst, extent->offset, SEEK_SET) != 0 ||
+				    fwrite(plan->data + extent->src.data_offset, extent->size, 1, dst) != 1) {
+					goto error;
+				}
+				break;
+
+			case GM_EXTENT_PATCH:
+				if (fseeko(dst, extent->offset, SEEK_SET) != 0 ||
+				    gm_write_patch_data(dst, extent->src.patch, buf, bufsize) != 0) {
+					goto error;
+				}
+				break;
+
+			default:
+				errno = EINVAL;
+				goto error;
+			}
+		}
+	}
+
+	qsort(copies, copy_count, sizeof(struct gm_fanout_copy), gm_compare_fanout_copies);
+
+	// the outputs are written all over the place, so only the source is streamed
+	const int srcfd = fileno(src);
+	off_t dropped = 0;
+	gm_advise_file(srcfd, 0, 0, GM_ADVICE_SEQUENTIAL);
+
+	// Sweep over the source. active holds the copies that overlap the current
+	// window, copies[next] is the next one that starts after it.
+	size_t next = 0;
+	size_t active_count = 0;
+	off_t pos = 0;
+	while (next < copy_count || active_count > 0) {
+		if (active_count == 0 && copies[next].extent->src.src_offset > pos) {
+			pos = copies[next].extent->src.src_offset;
+		}
+
+		while (next < copy_count && copies[next].extent->src.src_offset <= pos) {
+			active[active_count ++] = copies[next ++];
+		}
+
+		// read up to the end of the furthest active copy, but not past the
+		// start of a copy that isn't active yet so it joins the next window
+		off_t end = pos;
+		for (size_t index = 0; index < active_count; ++ index) {
+			const struct gm_extent *extent = active[index].extent;
+			const off_t extent_end = extent->src.src_offset + (off_t)extent->size;
+
+			if (extent_end > end) {
+				end = extent_end;
+			}
+		}
+
+		if (end - pos > (off_t)bufsize) {
+			end = pos + (off_t)bufsize;
+		}
+
+		if (next < copy_count && copies[next].extent->src.src_offset < end) {
+			end = copies[next].extent->src.src_offset;
+		}
+
+		const size_t window_size = (size_t)(end - pos);
+		if (fseeko(src, pos, SEEK_SET) != 0) {
+			goto error;
+		}
+
+		if (fread(buf, window_size, 1, src) != 1) {
+			if (!ferror(src)) {
+				LOG_ERR_MSG("unexpected end of file while copying file data");
+				errno = EINVAL;
+			}
+			goto error;
+		}
+
+		if (hash) {
+			gm_source_hash_to(hash, (size_t)end);
+		}
+
+		size_t kept = 0;
+		for (size_t index = 0; index < active_count; ++ index) {
+			const struct gm_extent *extent = active[index].extent;
+			const off_t extent_end = extent->src.src_offset + (off_t)extent->size;
+			const off_t write_end = extent_end < end ? extent_end : end;
+
+			if (fseeko(active[index].dst, extent->offset + (pos - extent->src.src_offset), SEEK_SET) != 0 ||
+			    fwrite(buf, (size_t)(write_end - pos), 1, active[index].dst) != 1) {
+				goto error;
+			}
+
+			if (extent_end > end) {
+				active[kept ++] = active[index];
+			}
+		}
+		active_count = kept;
+
+		pos = end;
+
+		if (pos - dropped >= GM_STREAM_CHUNK_SIZE) {
+			gm_advise_file(srcfd, dropped, (size_t)(pos - dropped), GM_ADVICE_DONTNEED);
+			dropped = pos;
+		}
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+
+		free(buf);
+		free(copies);
+		free(active);
+
+		errno = errnum;
+	}
+
+	return status;
+}
+
+int gm_write_plans(const struct gm_plan *const plans[], FILE *src, FILE *const dsts[], size_t count) {
+	return gm_write_plans_hashed(plans, src, dsts, count, NULL);
+}
+
+void gm_free_plan(struct gm_plan *plan) {
+	if (plan) {
+		free(plan->extents);
+		free(plan->data);
+		free(plan);
+	}
+}
+
+#define GM_JOURNAL_MAGIC   "GMJL"
+#define GM_JOURNAL_COMMIT  "GMJC"
+#define GM_JOURNAL_VERSION 2
+
+// header: magic, version, archive size before and after the patch
+// record: offset, size, size of the old bytes, new data, old data
+// commit: magic, record count, size of everything before the commit
+//
+// The old bytes are the part of a record that lies within the old archive.
+// They identify the archive the journal was written for and are used to
+// roll a write back that failed.
+#define GM_JOURNAL_HEADER_SIZE 24
+#define GM_JOURNAL_RECORD_SIZE 24
+#define GM_JOURNAL_COMMIT_SIZE 16
+
+// unchanged runs shorter than a record header are written anyway
+#define GM_JOURNAL_MERGE_GAP GM_JOURNAL_RECORD_SIZE
+
+static int gm_sync_file(FILE *fp) {
+	if (fflush(fp) != 0) {
+		return -1;
+	}
+
+	return fsync(fileno(fp));
+}
+
+// The archive can be patched in place if nothing is moved. It may only grow
+// at the end (see GM_PATCH_APPEND).
+static bool gm_plan_in_place(const struct gm_plan *plan, const struct gm_archive *archive) {
+	if (plan->size < archive->size) {
+		return false;
+	}
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+
+		if (extent->type == GM_EXTENT_COPY && extent->src.src_offset != extent->offset) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Record header. The new data and then the old bytes that it replaces
+// follow it.
+static int gm_journal_record(FILE *journal, const struct gm_archive *archive, off_t offset, size_t size, size_t *old_size) {
+	uint8_t buf[GM_JOURNAL_RECORD_SIZE];
+
+	*old_size = (uint64_t)offset >= archive->size ? 0 :
+		size < archive->size - (size_t)offset ? size :
+		archive->size - (size_t)offset;
+
+	WRITE_U64LE(buf,      offset);
+	WRITE_U64LE(buf +  8, size);
+	WRITE_U64LE(buf + 16, *old_size);
+
+	return fwrite(buf, sizeof(buf), 1, journal) == 1 ? 0 : -1;
+}
+
+// Writes the bytes of all DATA extents that differ from the archive and all
+// PATCH extents as journal records, each with the old bytes it replaces.
+static int gm_write_journal(FILE *journal, const struct gm_plan *plan, const struct gm_archive *archive, uint32_t *record_count) {
+	uint8_t header[GM_JOURNAL_HEADER_SIZE];
+	uint8_t *buf = NULL;
+	size_t bufsize = 0;
+	size_t max_patch = 0;
+	int status = 0;
+
+	*record_count = 0;
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+
+		if (extent->type == GM_EXTENT_PATCH && extent->size > max_patch) {
+			max_patch = extent->size;
+		}
+	}
+
+	buf = gm_copy_buffer_new(max_patch, &bufsize);
+	if (!buf) {
+		goto error;
+	}
+
+	memcpy(header, GM_JOURNAL_MAGIC, 4);
+	WRITE_U32LE(header + 4, GM_JOURNAL_VERSION);
+	WRITE_U64LE(header +  8, archive->size);
+	WRITE_U64LE(header + 16, plan->size);
+
+	if (fwrite(header, sizeof(header), 1, journal) != 1) {
+		goto error;
+	}
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+
+		switch (extent->type) {
+		case GM_EXTENT_COPY:
+			break;
+
+		case GM_EXTENT_DATA:
+		{
+			// everything after the old end of the archive is new
+			const size_t known = (uint64_t)extent->offset >= archive->size ? 0 :
+				extent->size < archive->size - (size_t)extent->offset ? extent->size :
+				archive->size - (size_t)extent->offset;
+			const uint8_t *data = plan->data + extent->src.data_offset;
+			const uint8_t *orig = archive->data + (known > 0 ? extent->offset : 0);
+			size_t pos = 0;
+
+			while (pos < extent->size) {
+				if (pos < known && data[pos] == orig[pos]) {
+					++ pos;
+					continue;
+				}
+
+				const size_t start = pos;
+				size_t end = pos + 1;
+				for (size_t same = 0; pos < extent->size && same < GM_JOURNAL_MERGE_GAP; ++ pos) {
+					if (pos < known && data[pos] == orig[pos]) {
+						++ same;
+					}
+					else {
+						same = 0;
+						end  = pos + 1;
+					}
+				}
+
+				const off_t offset = extent->offset + (off_t)start;
+				size_t old_size = 0;
+				if (gm_journal_record(journal, archive, offset, end - start, &old_size) != 0) {
+					goto error;
+				}
+
+				if (fwrite(data + start, end - start, 1, journal) != 1) {
+					goto error;
+				}
+
+				if (old_size > 0 && fwrite(archive->data + offset, old_size, 1, journal) != 1) {
+					goto error;
+				}
+
+				++ *record_count;
+				pos = end;
+			}
+			break;
+		}
+
+		case GM_EXTENT_PATCH:
+		{
+			size_t old_size = 0;
+			if (gm_journal_record(journal, archive, extent->offset, extent->size, &old_size) != 0) {
+				goto error;
+			}
+
+			if (gm_write_patch_data(journal, extent->src.patch, buf, bufsize) != 0) {
+				goto error;
+			}
+
+			if (old_size > 0 && fwrite(archive->data + extent->offset, old_size, 1, journal) != 1) {
+				goto error;
+			}
+
+			++ *record_count;
+			break;
+		}
+
+		default:
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	if (buf) {
+		int errnum = errno;
+		free(buf);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+static int gm_commit_journal(FILE *journal, uint32_t record_count) {
+	uint8_t buf[GM_JOURNAL_COMMIT_SIZE];
+
+	// the records have to be on disk before the commit record is
+	if (gm_sync_file(journal) != 0) {
+		return -1;
+	}
+
+	const off_t size = ftello(journal);
+	if (size < 0) {
+		return -1;
+	}
+
+	memcpy(buf, GM_JOURNAL_COMMIT, 4);
+	WRITE_U32LE(buf + 4, record_count);
+	WRITE_U64LE(buf + 8, size);
+
+	if (fwrite(buf, sizeof(buf), 1, journal) != 1) {
+		return -1;
+	}
+
+	return gm_sync_file(journal);
+}
+
+#define GM_JOURNAL_CHECK_SIZE 4096
+
+static int gm_read_journal_record(FILE *journal, uint64_t pos, uint64_t *offset, uint64_t *size, uint64_t *old_size) {
+	uint8_t record[GM_JOURNAL_RECORD_SIZE];
+
+	if (fseeko(journal, (off_t)pos, SEEK_SET) != 0 || fread(record, sizeof(record), 1, journal) != 1) {
+		return -1;
+	}
+
+	*offset   = U64LE_FROM_BUF(record);
+	*size     = U64LE_FROM_BUF(record +  8);
+	*old_size = U64LE_FROM_BUF(record + 16);
+
+	return 0;
+}
+
+// Whether every byte that a record replaces still is the old byte or already
+// is the new one (after an interrupted replay). Returns 1 if it matches, 0 if
+// it doesn't and -1 on error.
+static int gm_journal_record_matches(FILE *journal, uint64_t pos, uint64_t size, FILE *game, off_t offset, uint64_t old_size) {
+	uint8_t current[GM_JOURNAL_CHECK_SIZE];
+	uint8_t new_data[GM_JOURNAL_CHECK_SIZE];
+	uint8_t old_data[GM_JOURNAL_CHECK_SIZE];
+	const uint64_t data_pos = pos + GM_JOURNAL_RECORD_SIZE;
+
+	for (uint64_t done = 0; done < old_size;) {
+		const size_t chunk_size = old_size - done >= GM_JOURNAL_CHECK_SIZE ? GM_JOURNAL_CHECK_SIZE : (size_t)(old_size - done);
+
+		if (fseeko(game, offset + (off_t)done, SEEK_SET) != 0 ||
+		    fread(current, chunk_size, 1, game) != 1 ||
+		    fseeko(journal, (off_t)(data_pos + done), SEEK_SET) != 0 ||
+		    fread(new_data, chunk_size, 1, journal) != 1 ||
+		    fseeko(journal, (off_t)(data_pos + size + done), SEEK_SET) != 0 ||
+		    fread(old_data, chunk_size, 1, journal) != 1) {
+			return -1;
+		}
+
+		for (size_t index = 0; index < chunk_size; ++ index) {
+			if (current[index] != old_data[index] && current[index] != new_data[index]) {
+				return 0;
+			}
+		}
+
+		done += chunk_size;
+	}
+
+	return 1;
+}
+
+// Writes the old bytes of all records back and truncates the archive to its
+// old size.
+static int gm_rollback_journal(FILE *journal, uint32_t record_count, FILE *game, uint64_t old_archive_size, uint8_t *buf, size_t bufsize) {
+	uint64_t pos = GM_JOURNAL_HEADER_SIZE;
+
+	for (uint32_t index = 0; index < record_count; ++ index) {
+		uint64_t offset = 0, size = 0, old_size = 0;
+		if (gm_read_journal_record(journal, pos, &offset, &size, &old_size) != 0) {
+			return -1;
+		}
+		pos += GM_JOURNAL_RECORD_SIZE;
+
+		if (old_size > 0 &&
+		    (fseeko(game, (off_t)offset, SEEK_SET) != 0 ||
+		     gm_copy_range(journal, (off_t)(pos + size), game, (size_t)old_size, buf, bufsize) != 0)) {
+			return -1;
+		}
+
+		pos += size + old_size;
+	}
+
+	if (fflush(game) != 0 || ftruncate(fileno(game), (off_t)old_archive_size) != 0) {
+		return -1;
+	}
+
+	return gm_sync_file(game);
+}
+
+// Writes a committed journal into the archive and removes it. A journal
+// without a commit record was interrupted before the archive was touched
+// and is just removed, as is one that was written for a different archive.
+// If writing fails the old bytes are written back, so the archive is left
+// unpatched instead of half patched. Returns 0 if the journal was written or
+// there was none, 1 if it was discarded and -1 on error.
+static int gm_replay_journal(const char *filename, const char *journalname) {
+	FILE *journal = NULL;
+	FILE *game    = NULL;
+	uint8_t *buf  = NULL;
+	size_t bufsize = 0;
+	size_t max_record = 0;
+	int status = 0;
+	struct stat st;
+	uint8_t header[GM_JOURNAL_HEADER_SIZE];
+	uint8_t commit[GM_JOURNAL_COMMIT_SIZE];
+
+	journal = fopen(journalname, "rb");
+	if (!journal) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		LOG_ERR("Failed to open journal: %s", journalname);
+		return -1;
+	}
+
+	if (fstat(fileno(journal), &st) != 0) {
+		goto error;
+	}
+
+	const uint64_t journal_size = (uint64_t)st.st_size;
+	if (journal_size < GM_JOURNAL_HEADER_SIZE + GM_JOURNAL_COMMIT_SIZE ||
+		fread(header, sizeof(header), 1, journal) != 1 ||
+		memcmp(header, GM_JOURNAL_MAGIC, 4) != 0 ||
+		U32LE_FROM_BUF(header + 4) != GM_JOURNAL_VERSION ||
+		fseeko(journal, (off_t)(journal_size - GM_JOURNAL_COMMIT_SIZE), SEEK_SET) != 0 ||
+		fread(commit, sizeof(commit), 1, journal) != 1 ||
+		memcmp(commit, GM_JOURNAL_COMMIT, 4) != 0 ||
+		U64LE_FROM_BUF(commit + 8) != journal_size - GM_JOURNAL_COMMIT_SIZE) {
+		LOG_WARN("discarding incomplete journal: %s", journalname);
+		goto discard;
+	}
+
+	if (stat(filename, &st) != 0) {
+		LOG_ERR("Failed to stat archive: %s", filename);
+		goto error;
+	}
+
+	// an interrupted replay might already have appended some of the data
+	const uint64_t old_size     = U64LE_FROM_BUF(header +  8);
+	const uint64_t archive_size = U64LE_FROM_BUF(header + 16);
+	if ((uint64_t)st.st_size < old_size || (uint64_t)st.st_size > archive_size) {
+		LOG_WARN("discarding journal of a different archive: %s", journalname);
+		goto discard;
+	}
+
+	// validate all records before anything is written
+	const uint32_t record_count = U32LE_FROM_BUF(commit + 4);
+	const uint64_t records_end = journal_size - GM_JOURNAL_COMMIT_SIZE;
+	uint64_t pos = GM_JOURNAL_HEADER_SIZE;
+
+	for (uint32_t index = 0; index < record_count; ++ index) {
+		uint64_t offset = 0, size = 0, record_old_size = 0;
+		if (records_end - pos < GM_JOURNAL_RECORD_SIZE ||
+		    gm_read_journal_record(journal, pos, &offset, &size, &record_old_size) != 0) {
+			goto corrupt;
+		}
+		pos += GM_JOURNAL_RECORD_SIZE;
+
+		if (offset > archive_size || size > archive_size - offset || size > records_end - pos) {
+			goto corrupt;
+		}
+
+		// the old bytes are exactly the part of the record inside of the old archive
+		const uint64_t expected_old_size = offset >= old_size ? 0 : size < old_size - offset ? size : old_size - offset;
+		if (record_old_size != expected_old_size || record_old_size > records_end - pos - size) {
+			goto corrupt;
+		}
+
+		if (size > max_record) {
+			max_record = (size_t)size;
+		}
+
+		pos += size + record_old_size;
+	}
+
+	if (pos != records_end) {
+		goto corrupt;
+	}
+
+	buf = gm_copy_buffer_new(max_record, &bufsize);
+	if (!buf) {
+		goto error;
+	}
+
+	game = fopen(filename, "r+b");
+	if (!game) {
+		LOG_ERR("Failed to open archive for writing: %s", filename);
+		goto error;
+	}
+
+	// the old bytes have to match, so the journal isn't written into an
+	// archive of the same size that was replaced in the meantime
+	pos = GM_JOURNAL_HEADER_SIZE;
+	for (uint32_t index = 0; index < record_count; ++ index) {
+		uint64_t offset = 0, size = 0, record_old_size = 0;
+		if (gm_read_journal_record(journal, pos, &offset, &size, &record_old_size) != 0) {
+			goto error;
+		}
+
+		const int matches = gm_journal_record_matches(journal, pos, size, game, (off_t)offset, record_old_size);
+		if (matches < 0) {
+			goto error;
+		}
+
+		if (!matches) {
+			LOG_WARN("discarding journal of a different archive: %s", journalname);
+			goto discard;
+		}
+
+		pos += GM_JOURNAL_RECORD_SIZE + size + record_old_size;
+	}
+
+	pos = GM_JOURNAL_HEADER_SIZE;
+	for (uint32_t index = 0; index < record_count; ++ index) {
+		uint64_t offset = 0, size = 0, record_old_size = 0;
+		if (gm_read_journal_record(journal, pos, &offset, &size, &record_old_size) != 0) {
+			goto rollback;
+		}
+		pos += GM_JOURNAL_RECORD_SIZE;
+
+		if (fseeko(game, (off_t)offset, SEEK_SET) != 0) {
+			goto rollback;
+		}
+
+		if (gm_copy_range(journal, (off_t)pos, game, (size_t)size, buf, bufsize) != 0) {
+			goto rollback;
+		}
+
+		pos += size + record_old_size;
+	}
+
+	if (gm_sync_file(game) != 0) {
+		goto rollback;
+	}
+
+	if (fclose(game) != 0) {
+		game = NULL;
+		goto error;
+	}
+	game = NULL;
+
+	// the contents changed without changing the layout, so a cached index
+	// might still look valid
+	gm_remove_index_cache(filename);
+
+	goto remove;
+
+rollback:
+	{
+		// e.g. the disk is full: leave the archive as it was
+		int errnum = errno;
+
+		if (gm_rollback_journal(journal, record_count, game, old_size, buf, bufsize) != 0) {
+			LOG_ERR("Failed to roll back the write, the journal is kept: %s", journalname);
+			errno = errnum;
+			goto error;
+		}
+
+		LOG_ERR("Failed to write archive, rolled it back: %s", filename);
+
+		if (unlink(journalname) != 0) {
+			LOG_ERR("Failed to remove journal: %s", journalname);
+		}
+
+		errno = errnum;
+		goto error;
+	}
+
+corrupt:
+	LOG_ERR("Corrupt journal: %s", journalname);
+	errno = EINVAL;
+
+error:
+	status = -1;
+	goto end;
+
+discard:
+	status = 1;
+
+remove:
+	if (unlink(journalname) != 0) {
+		LOG_ERR("Failed to remove journal: %s", journalname);
+		status = -1;
+	}
+
+end:
+	if (journal) {
+		int errnum = errno;
+		fclose(journal);
+		errno = errnum;
+		journal = NULL;
+	}
+
+	if (game) {
+		int errnum = errno;
+		fclose(game);
+		errno = errnum;
+		game = NULL;
+	}
+
+	if (buf) {
+		int errnum = errno;
+		free(buf);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+// Writes only the changed bytes of an in place plan into the archive,
+// going through the journal.
+static int gm_patch_in_place(const char *filename, const struct gm_plan *plan, const struct gm_archive *archive) {
+	char *journalname = NULL;
+	FILE *journal = NULL;
+	uint32_t record_count = 0;
+	int status = 0;
+
+	journalname = GM_CONCAT(filename, GM_JOURNAL_EXT);
+	if (!journalname) {
+		return -1;
+	}
+
+	journal = fopen(journalname, "wb");
+	if (!journal) {
+		LOG_ERR("Failed to open journal: %s", journalname);
+		goto error;
+	}
+
+	if (gm_write_journal(journal, plan, archive, &record_count) != 0) {
+		goto error;
+	}
+
+	if (record_count == 0) {
+		// archive is already patched
+		fclose(journal);
+		journal = NULL;
+		unlink(journalname);
+		goto end;
+	}
+
+	if (gm_commit_journal(journal, record_count) != 0) {
+		goto error;
+	}
+
+	if (fclose(journal) != 0) {
+		journal = NULL;
+		goto error;
+	}
+	journal = NULL;
+
+	// From here on the journal is complete. If writing the archive fails
+	// it is rolled back and the journal removed. Only if the roll back fails
+	// too the journal is kept and replayed by the next call.
+	status = gm_replay_journal(filename, journalname);
+	if (status > 0) {
+		// the old bytes didn't match anymore, nothing was written
+		LOG_ERR("Archive was changed while patching it: %s", filename);
+
+		errno  = ESTALE;
+		status = -1;
+	}
+	goto end;
+
+error:
+	status = -1;
+	int errnum = errno;
+
+	if (journal) {
+		fclose(journal);
+		journal = NULL;
+	}
+
+	unlink(journalname);
+	errno = errnum;
+
+end:
+	free(journalname);
+
+	return status;
+}
+
+// Checks that plan writes exactly plan->size bytes and only reads what
+// exists, before anything is written.
+static int gm_check_plan(const struct gm_plan *plan, const struct gm_archive *archive) {
+	size_t offset = 0;
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+		bool valid = extent->offset == (off_t)offset && extent->size <= plan->size - offset;
+
+		switch (extent->type) {
+		case GM_EXTENT_COPY:
+			valid = valid && extent->src.src_offset >= 0 &&
+			        (uint64_t)extent->src.src_offset <= archive->size &&
+			        extent->size <= archive->size - (size_t)extent->src.src_offset;
+			break;
+
+		case GM_EXTENT_DATA:
+			valid = valid && extent->src.data_offset <= plan->data_size &&
+			        extent->size <= plan->data_size - extent->src.data_offset;
+			break;
+
+		case GM_EXTENT_PATCH:
+			valid = valid && extent->size == extent->src.patch->size;
+			break;
+
+		default:
+			valid = false;
+			break;
+		}
+
+		if (!valid) {
+			LOG_ERR("invalid plan extent %" PRIuPTR " at offset %" PRIuPTR, index, offset);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		offset += extent->size;
+	}
+
+	if (offset != plan->size || plan->size > (uint64_t)INT64_MAX) {
+		LOG_ERR("plan writes %" PRIuPTR " bytes, but the new archive has %" PRIuPTR " bytes", offset, plan->size);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Reserves the whole new archive up front, so it is allocated in one piece
+// and a full disk is noticed before anything is written. Returns 1 if the
+// space was reserved and 0 if the file system (or OS) doesn't support it.
+static int gm_preallocate(FILE *fp, size_t size) {
+#if defined(GM_HAVE_FALLOCATE)
+	// not posix_fallocate(), which writes zeros when it isn't supported
+	if (size > 0 && fallocate(fileno(fp), 0, 0, (off_t)size) != 0) {
+		if (errno == ENOSPC || errno == EFBIG) {
+			LOG_ERR("not enough space for the new archive (%" PRIuPTR " bytes)", size);
+			return -1;
+		}
+		return 0;
+	}
+	return 1;
+#else
+	(void)fp;
+	(void)size;
+	return 0;
+#endif
+}
+
+#if defined(GM_HAVE_MMAP)
+// Fills a preallocated file through a shared mapping in plan order. The
+// source is copied straight from the (usually mapped) archive.
+static int gm_write_plan_mapped(const struct gm_plan *plan, const struct gm_archive *archive, FILE *dst, struct gm_source_hash *hash) {
+	uint8_t *mapped = NULL;
+	int status = 0;
+
+	if (plan->size == 0) {
+		return 0;
+	}
+
+	mapped = mmap(NULL, plan->size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(dst), 0);
+	if (mapped == MAP_FAILED) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+		uint8_t *out = mapped + extent->offset;
+
+		switch (extent->type) {
+		case GM_EXTENT_COPY:
+			for (size_t done = 0; done < extent->size;) {
+				const size_t chunk_size = extent->size - done >= GM_STREAM_CHUNK_SIZE ? GM_STREAM_CHUNK_SIZE : extent->size - done;
+				const size_t srcoff = (size_t)extent->src.src_offset + done;
+
+				memcpy(out + done, archive->data + srcoff, chunk_size);
+
+				if (hash) {
+					gm_source_hash_to(hash, srcoff + chunk_size);
+				}
+				done += chunk_size;
+			}
+			break;
+
+		case GM_EXTENT_DATA:
+			memcpy(out, plan->data + extent->src.data_offset, extent->size);
+			break;
+
+		case GM_EXTENT_PATCH:
+		{
+			const struct gm_patch *patch = extent->src.patch;
+
+			if (patch->patch_src == GM_SRC_MEM) {
+				memcpy(out, patch->src.data, patch->size);
+				break;
+			}
+
+			FILE *infile = fopen(patch->src.filename, "rb");
+			if (!infile) {
+				goto error;
+			}
+
+			if (patch->size > 0 && fread(out, patch->size, 1, infile) != 1) {
+				if (!ferror(infile)) {
+					LOG_ERR("unexpected end of file: %s", patch->src.filename);
+					errno = EINVAL;
+				}
+				fclose(infile);
+				goto error;
+			}
+			fclose(infile);
+			break;
+		}
+
+		default:
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	if (msync(mapped, plan->size, MS_ASYNC) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		if (munmap(mapped, plan->size) != 0 && status == 0) {
+			status = -1;
+			errnum = errno;
+		}
+		errno = errnum;
+	}
+
+	return status;
+}
+#endif
+
+// Writes the archive described by plan, in place if possible and otherwise
+// to a temp file that then replaces the archive. If hash is not NULL it is
+// set to the FNV-1a of the whole archive as it was before writing.
+static int gm_apply_plan(const char *filename, const struct gm_archive *archive, const struct gm_plan *plan, int flags, uint64_t *hash) {
+	struct gm_source_hash source_hash;
+	char *tmpname = NULL;
+	FILE *game = NULL;
+	FILE *tmp  = NULL;
+	int status = 0;
+
+	if (gm_check_plan(plan, archive) != 0) {
+		return -1;
+	}
+
+	gm_source_hash_init(&source_hash, archive);
+
+	if (gm_plan_in_place(plan, archive)) {
+		// nothing is copied and the archive is about to change under the mapping
+		if (hash) {
+			*hash = gm_fnv1a_archive(GM_FNV1A_OFFSET, archive, 0, archive->size);
+		}
+		return gm_patch_in_place(filename, plan, archive);
+	}
+
+	tmpname = GM_CONCAT(filename, ".tmp");
+	if (tmpname == NULL) {
+		return -1;
+	}
+
+	game = fopen(filename, "rb");
+	if (!game) {
+		LOG_ERR("Failed to open archive: %s", filename);
+		goto error;
+	}
+
+	// write new archive, readable too because a shared mapping needs that
+	tmp = fopen(tmpname, "w+b");
+	if (!tmp) {
+		LOG_ERR("Failed to open temp file: %s", tmpname);
+		goto error;
+	}
+
+	const int preallocated = gm_preallocate(tmp, plan->size);
+	if (preallocated < 0) {
+		goto error;
+	}
+
+#if defined(GM_HAVE_MMAP)
+	// a mapping of a file that isn't fully allocated can fault on a full disk
+	if ((flags & GM_PATCH_MAP_OUTPUT) && preallocated) {
+		if (gm_write_plan_mapped(plan, archive, tmp, hash ? &source_hash : NULL) != 0) {
+			goto error;
+		}
+	}
+	else
+#endif
+	if (gm_write_plan_hashed(plan, game, tmp, hash ? &source_hash : NULL) != 0) {
+		goto error;
+	}
+
+	if (hash) {
+		// whatever wasn't copied, e.g. replaced data at the end
+		gm_source_hash_to(&source_hash, archive->size);
+		*hash = source_hash.hash;
+	}
+
+	if (fclose(game) != 0) {
+		game = NULL;
+		goto error;
+	}
+	game = NULL;
+
+	if (fclose(tmp) != 0) {
+		tmp = NULL;
+		goto error;
+	}
+	tmp = NULL;
+
+	// delete target mainly to make it work on windows:
+	if (unlink(filename) != 0) {
+		LOG_ERR("Failed to remove original game archive: %s", filename);
+		goto error;
+	}
+
+	if (rename(tmpname, filename) != 0) {
+		LOG_ERR("Failed to rename temp file to: %s", filename);
+		goto error;
+	}
+
+	gm_remove_index_cache(filename);
+
+	goto end;
+
+error:
+	status = -1;
+	int errnum = errno;
+
+	if (game) {
+		fclose(game);
+		game = NULL;
+	}
+
+	if (tmp) {
+		fclose(tmp);
+		tmp = NULL;
+	}
+
+	unlink(tmpname);
+
+	// keep the original error
+	errno = errnum;
+
+end:
+	free(tmpname);
+
+	return status;
+}
+
+#define GM_DELTA_MAGIC   "GMDL"
+#define GM_DELTA_VERSION 1
+
+// header: magic, version, pristine size and hash, patched size and
+//         fingerprint, extent count, data size
+// extent: type, size, source offset (COPY) or data offset (DATA)
+#define GM_DELTA_HEADER_SIZE 56
+#define GM_DELTA_EXTENT_SIZE 20
+
+// A reverse delta is a plan that writes the pristine archive, copying from
+// the patched archive.
+struct gm_delta {
+	uint64_t pristine_size;
+	uint64_t pristine_hash;
+	uint64_t patched_size;
+	uint64_t patched_fingerprint;
+
+	struct gm_plan *plan;
+};
+
+static int gm_compare_copy_sources(const void *lhs, const void *rhs) {
+	const struct gm_extent *lhs_extent = *(const struct gm_extent * const *)lhs;
+	const struct gm_extent *rhs_extent = *(const struct gm_extent * const *)rhs;
+
+	if (lhs_extent->src.src_offset != rhs_extent->src.src_offset) {
+		return lhs_extent->src.src_offset < rhs_extent->src.src_offset ? -1 : 1;
+	}
+
+	return lhs_extent < rhs_extent ? -1 : lhs_extent > rhs_extent ? 1 : 0;
+}
+
+// Inverts plan: every range of the archive that plan copies is copied back
+// from where it ends up, everything else is stored as data.
+static struct gm_plan *gm_reverse_plan(const struct gm_plan *plan, const struct gm_archive *archive) {
+	const struct gm_extent **copies = NULL;
+	struct gm_plan *reverse = NULL;
+	size_t count = 0;
+
+	copies = malloc((plan->extent_count > 0 ? plan->extent_count : 1) * sizeof(struct gm_extent*));
+	if (!copies) {
+		goto error;
+	}
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+
+		if (extent->type == GM_EXTENT_COPY) {
+			if ((uint64_t)extent->src.src_offset + extent->size > archive->size) {
+				LOG_ERR("copied range at offset %" PRIi64 " lies outside of the archive", (int64_t)extent->src.src_offset);
+
+				errno = EINVAL;
+				goto error;
+			}
+			copies[count ++] = extent;
+		}
+	}
+
+	qsort(copies, count, sizeof(struct gm_extent*), gm_compare_copy_sources);
+
+	reverse = calloc(1, sizeof(struct gm_plan));
+	if (!reverse) {
+		goto error;
+	}
+
+	off_t pos = 0;
+	for (size_t index = 0; index < count; ++ index) {
+		const struct gm_extent *extent = copies[index];
+		off_t  src  = extent->src.src_offset;
+		off_t  dst  = extent->offset;
+		size_t size = extent->size;
+
+		if (src + (off_t)size <= pos) {
+			continue;
+		}
+
+		if (src < pos) {
+			// copied twice, e.g. aliased entries
+			const size_t skip = (size_t)(pos - src);
+			src  += (off_t)skip;
+			dst  += (off_t)skip;
+			size -= skip;
+		}
+		else if (src > pos) {
+			uint8_t *data = gm_plan_data(reverse, (size_t)(src - pos));
+			if (!data) {
+				goto error;
+			}
+			memcpy(data, archive->data + pos, (size_t)(src - pos));
+		}
+
+		if (gm_plan_copy(reverse, dst, size) != 0) {
+			goto error;
+		}
+
+		pos = src + (off_t)size;
+	}
+
+	if ((size_t)pos < archive->size) {
+		uint8_t *data = gm_plan_data(reverse, archive->size - (size_t)pos);
+		if (!data) {
+			goto error;
+		}
+		memcpy(data, archive->data + pos, archive->size - (size_t)pos);
+	}
+
+	goto end;
+
+error:
+	{
+		int errnum = errno;
+		gm_free_plan(reverse);
+		reverse = NULL;
+		errno = errnum;
+	}
+
+end:
+	free(copies);
+
+	return reverse;
 }
 
-int gm_shift_tail(struct gm_patched_index *index, off_t offset) {
-	for (; index->section != GM_END; ++ index) {
-		switch (index->section) {
-		// only know how to move these sections so far:
-		case GM_TXTR:
-		case GM_AUDO:
-			break;
+// Chains two plans: outer copies from the output of inner, the result copies
+// from what inner copies from.
+static struct gm_plan *gm_compose_plans(const struct gm_plan *outer, const struct gm_plan *inner) {
+	struct gm_plan *plan = calloc(1, sizeof(struct gm_plan));
+	if (!plan) {
+		return NULL;
+	}
 
-		default:
-			LOG_ERR("can't move %s section (not implemented)", gm_section_name(index->section));
+	for (size_t index = 0; index < outer->extent_count; ++ index) {
+		const struct gm_extent *extent = &outer->extents[index];
 
-			errno = ENOSYS;
-			return -1;
+		if (extent->type == GM_EXTENT_DATA) {
+			uint8_t *data = gm_plan_data(plan, extent->size);
+			if (!data) {
+				goto error;
+			}
+			memcpy(data, outer->data + extent->src.data_offset, extent->size);
+			continue;
 		}
 
-		index->offset += offset;
+		if (extent->type != GM_EXTENT_COPY || (uint64_t)extent->src.src_offset + extent->size > inner->size) {
+			errno = EINVAL;
+			goto error;
+		}
 
-		for (size_t i = 0; i < index->entry_count; ++ i) {
-			index->entries[i].offset += offset;
+		// find the inner extent that contains the start of the range
+		size_t lo = 0, hi = inner->extent_count;
+		while (hi - lo > 1) {
+			const size_t mid = lo + (hi - lo) / 2;
+			if (inner->extents[mid].offset <= extent->src.src_offset) {
+				lo = mid;
+			}
+			else {
+				hi = mid;
+			}
+		}
+
+		off_t  offset = extent->src.src_offset;
+		size_t size   = extent->size;
+		for (size_t inner_index = lo; size > 0 && inner_index < inner->extent_count; ++ inner_index) {
+			const struct gm_extent *part = &inner->extents[inner_index];
+			const size_t skip  = (size_t)(offset - part->offset);
+			const size_t chunk = part->size - skip < size ? part->size - skip : size;
+
+			if (part->type == GM_EXTENT_COPY) {
+				if (gm_plan_copy(plan, part->src.src_offset + (off_t)skip, chunk) != 0) {
+					goto error;
+				}
+			}
+			else if (part->type == GM_EXTENT_DATA) {
+				uint8_t *data = gm_plan_data(plan, chunk);
+				if (!data) {
+					goto error;
+				}
+				memcpy(data, inner->data + part->src.data_offset + skip, chunk);
+			}
+			else {
+				errno = EINVAL;
+				goto error;
+			}
+
+			offset += (off_t)chunk;
+			size   -= chunk;
 		}
 	}
 
-	return 0;
+	return plan;
+
+error:
+	{
+		int errnum = errno;
+		gm_free_plan(plan);
+		errno = errnum;
+	}
+
+	return NULL;
 }
 
-int gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch) {
-	switch (index->section) {
-	// only know how to patch these sections so far:
-	case GM_TXTR:
-	case GM_AUDO:
-		break;
+// Hash of the file plan would write, computed without writing it.
+static int gm_hash_plan(const struct gm_plan *plan, const struct gm_archive *src, uint64_t *hash) {
+	*hash = GM_FNV1A_OFFSET;
 
-	case GM_STRG:
-	{
-		if (patch->index >= index->entry_count) {
-			LOG_ERR("section %s, patch index out of range: %" PRIuPTR " >= %" PRIuPTR,
-			        gm_section_name(index->section), patch->index, index->entry_count);
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+
+		switch (extent->type) {
+		case GM_EXTENT_COPY:
+			if ((uint64_t)extent->src.src_offset + extent->size > src->size) {
+				errno = EINVAL;
+				return -1;
+			}
+			*hash = gm_fnv1a_archive(*hash, src, (size_t)extent->src.src_offset, extent->size);
+			break;
+
+		case GM_EXTENT_DATA:
+			*hash = gm_fnv1a(*hash, plan->data + extent->src.data_offset, extent->size);
+			break;
 
+		default:
 			errno = EINVAL;
 			return -1;
 		}
+	}
 
-		struct gm_patched_entry *entry = &index->entries[patch->index];
-		if (entry->patch) {
-			LOG_ERR("section %s, entry %" PRIuPTR " is already patched",
-			        gm_section_name(index->section), patch->index);
+	return 0;
+}
 
-			errno = EINVAL;
-			return -1;
+static void gm_free_delta(struct gm_delta *delta) {
+	gm_free_plan(delta->plan);
+	delta->plan = NULL;
+}
+
+static int gm_write_delta(const struct gm_delta *delta, const char *deltaname) {
+	const struct gm_plan *plan = delta->plan;
+	char *tmpname = NULL;
+	FILE *fp = NULL;
+	int status = 0;
+	uint8_t buf[GM_DELTA_HEADER_SIZE];
+
+	tmpname = GM_CONCAT(deltaname, ".tmp");
+	if (!tmpname) {
+		return -1;
+	}
+
+	fp = fopen(tmpname, "wb");
+	if (!fp) {
+		goto error;
+	}
+
+	memcpy(buf, GM_DELTA_MAGIC, 4);
+	WRITE_U32LE(buf +  4, GM_DELTA_VERSION);
+	WRITE_U64LE(buf +  8, delta->pristine_size);
+	WRITE_U64LE(buf + 16, delta->pristine_hash);
+	WRITE_U64LE(buf + 24, delta->patched_size);
+	WRITE_U64LE(buf + 32, delta->patched_fingerprint);
+	WRITE_U64LE(buf + 40, plan->extent_count);
+	WRITE_U64LE(buf + 48, plan->data_size);
+
+	if (fwrite(buf, GM_DELTA_HEADER_SIZE, 1, fp) != 1) {
+		goto error;
+	}
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+		const bool copy = extent->type == GM_EXTENT_COPY;
+
+		WRITE_U32LE(buf,     extent->type);
+		WRITE_U64LE(buf + 4, extent->size);
+		WRITE_U64LE(buf + 12, copy ? (uint64_t)extent->src.src_offset : (uint64_t)extent->src.data_offset);
+
+		if (fwrite(buf, GM_DELTA_EXTENT_SIZE, 1, fp) != 1) {
+			goto error;
 		}
+	}
 
-		const size_t new_len = strlen(patch->meta.strg.new);
-		if (entry->entry->size < new_len) {
-			LOG_ERR("section %s, cannot increase string length of entry %" PRIuPTR ": \"%s\" (%" PRIuPTR ") -> \"%s\" (%" PRIuPTR ")",
-			        gm_section_name(index->section), patch->index,
-			        entry->entry->meta.strg, entry->entry->size,
-			        patch->meta.strg.new, new_len);
+	if (plan->data_size > 0 && fwrite(plan->data, plan->data_size, 1, fp) != 1) {
+		goto error;
+	}
 
-			errno = EINVAL;
-			return -1;
+	// only replace the old delta once the new one is complete
+	if (gm_sync_file(fp) != 0) {
+		goto error;
+	}
+
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto error;
+	}
+	fp = NULL;
+
+	// for windows
+	if (unlink(deltaname) != 0 && errno != ENOENT) {
+		goto error;
+	}
+
+	if (rename(tmpname, deltaname) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+	int errnum = errno;
+
+	if (fp) {
+		fclose(fp);
+		fp = NULL;
+	}
+
+	unlink(tmpname);
+	errno = errnum;
+
+end:
+	free(tmpname);
+
+	return status;
+}
+
+// Returns -1 with errno set to ENOENT if there is no delta.
+static int gm_read_delta(struct gm_delta *delta, const char *deltaname) {
+	FILE *fp = NULL;
+	struct gm_plan *plan = NULL;
+	uint8_t buf[GM_DELTA_HEADER_SIZE];
+	struct stat st;
+	int status = 0;
+
+	delta->plan = NULL;
+
+	fp = fopen(deltaname, "rb");
+	if (!fp) {
+		return -1;
+	}
+
+	if (fstat(fileno(fp), &st) != 0) {
+		goto error;
+	}
+
+	if (fread(buf, GM_DELTA_HEADER_SIZE, 1, fp) != 1 ||
+		memcmp(buf, GM_DELTA_MAGIC, 4) != 0 ||
+		U32LE_FROM_BUF(buf + 4) != GM_DELTA_VERSION) {
+		goto corrupt;
+	}
+
+	delta->pristine_size       = U64LE_FROM_BUF(buf +  8);
+	delta->pristine_hash       = U64LE_FROM_BUF(buf + 16);
+	delta->patched_size        = U64LE_FROM_BUF(buf + 24);
+	delta->patched_fingerprint = U64LE_FROM_BUF(buf + 32);
+
+	const uint64_t extent_count = U64LE_FROM_BUF(buf + 40);
+	const uint64_t data_size    = U64LE_FROM_BUF(buf + 48);
+	const uint64_t file_size    = (uint64_t)st.st_size - GM_DELTA_HEADER_SIZE;
+
+	if (extent_count > file_size / GM_DELTA_EXTENT_SIZE ||
+	    data_size != file_size - extent_count * GM_DELTA_EXTENT_SIZE) {
+		goto corrupt;
+	}
+
+	plan = calloc(1, sizeof(struct gm_plan));
+	if (!plan) {
+		goto error;
+	}
+
+	plan->extents = malloc((extent_count > 0 ? extent_count : 1) * sizeof(struct gm_extent));
+	plan->data    = malloc(data_size > 0 ? data_size : 1);
+	if (!plan->extents || !plan->data) {
+		goto error;
+	}
+	plan->extent_capacity = plan->extent_count = (size_t)extent_count;
+	plan->data_capacity   = plan->data_size    = (size_t)data_size;
+
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		struct gm_extent *extent = &plan->extents[index];
+
+		if (fread(buf, GM_DELTA_EXTENT_SIZE, 1, fp) != 1) {
+			goto corrupt;
 		}
 
-		if (strcmp(entry->entry->meta.strg, patch->meta.strg.old) != 0 &&
-		    strcmp(entry->entry->meta.strg, patch->meta.strg.new) != 0) {
-			LOG_ERR("section %s, entry %" PRIuPTR " doesn't contain the expected string \"%s\" (or \"%s\" if already patched), but instead contains \"%s\"",
-			        gm_section_name(index->section), patch->index, patch->meta.strg.old, patch->meta.strg.new, entry->entry->meta.strg);
+		const uint32_t type = U32LE_FROM_BUF(buf);
+		const uint64_t size = U64LE_FROM_BUF(buf + 4);
+		const uint64_t src  = U64LE_FROM_BUF(buf + 12);
 
-			errno = EINVAL;
-			return -1;
+		extent->type   = (enum gm_extent_type)type;
+		extent->offset = (off_t)plan->size;
+		extent->size   = (size_t)size;
+
+		if (type == GM_EXTENT_COPY && src <= delta->patched_size && size <= delta->patched_size - src) {
+			extent->src.src_offset = (off_t)src;
+		}
+		else if (type == GM_EXTENT_DATA && src <= data_size && size <= data_size - src) {
+			extent->src.data_offset = (size_t)src;
+		}
+		else {
+			goto corrupt;
 		}
 
-		entry->patch = patch;
-		return 0;
+		if (size > delta->pristine_size - plan->size) {
+			goto corrupt;
+		}
+		plan->size += (size_t)size;
 	}
 
-	case GM_SPRT:
+	if (plan->size != delta->pristine_size) {
+		goto corrupt;
+	}
+
+	if (data_size > 0 && fread(plan->data, data_size, 1, fp) != 1) {
+		goto corrupt;
+	}
+
+	delta->plan = plan;
+	plan = NULL;
+
+	goto end;
+
+corrupt:
+	LOG_ERR("Corrupt delta: %s", deltaname);
+	errno = EINVAL;
+
+error:
+	status = -1;
+
+end:
 	{
-		bool found = false;
-		for (size_t i = 0; i < index->entry_count; ++ i) {
-			const struct gm_entry *entry = index->entries[i].entry;
-			if (strcmp(entry->meta.sprt.name, patch->meta.sprt.name) == 0) {
-				found = true;
+		int errnum = errno;
 
-				const size_t entry_count = patch->meta.sprt.entry_count;
-				const struct gm_patch_sprt_entry *entries = patch->meta.sprt.entries;
+		gm_free_plan(plan);
+		fclose(fp);
 
-				for (size_t j = 0; j < entry_count; ++ j) {
-					const struct gm_patch_sprt_entry *path_sprt = &entries[j];
+		errno = errnum;
+	}
 
-					const size_t tpag_index = path_sprt->tpag_index;
-					if (tpag_index >= entry->meta.sprt.tpag_count) {
-						LOG_ERR("Sprite %s index outof range: %" PRIuPTR " >= %" PRIuPTR,
-						        patch->meta.sprt.name, tpag_index,
-						        entry->meta.sprt.tpag_count);
+	return status;
+}
 
-						errno = EINVAL;
-						return -1;
-					}
+// Reverse delta for the archive that plan is about to write, based on an
+// existing delta if there is one for the current archive. If a new delta is
+// started *created is set and the caller has to fill in its pristine_hash.
+static int gm_update_delta(struct gm_delta *delta, const char *deltaname, const struct gm_plan *plan, const struct gm_archive *archive, bool *created) {
+	struct gm_plan *reverse = gm_reverse_plan(plan, archive);
+	if (!reverse) {
+		return -1;
+	}
 
-					if (entry->meta.sprt.tpag[tpag_index].x != path_sprt->x ||
-					    entry->meta.sprt.tpag[tpag_index].y != path_sprt->y ||
-					    entry->meta.sprt.tpag[tpag_index].width  != path_sprt->width ||
-					    entry->meta.sprt.tpag[tpag_index].height != path_sprt->height ||
-					    entry->meta.sprt.tpag[tpag_index].txtr_index != path_sprt->txtr_index) {
-
-						LOG_ERR("Sprite %s %" PRIuPTR " has incompatible coordinates. patch: x=%" PRIuPTR
-						        " y=%" PRIuPTR " width=%" PRIuPTR " height=%" PRIuPTR
-						        " txtr_index=%" PRIuPTR ", game archive: x=%"  PRIuPTR
-						        " y=%" PRIuPTR " width=%" PRIuPTR " height=%" PRIuPTR
-						        " txtr_index=%" PRIuPTR,
-						        patch->meta.sprt.name,
-						        tpag_index,
-						        path_sprt->x,
-						        path_sprt->y,
-						        path_sprt->width,
-						        path_sprt->height,
-						        path_sprt->txtr_index,
-						        entry->meta.sprt.tpag[tpag_index].x,
-						        entry->meta.sprt.tpag[tpag_index].y,
-						        entry->meta.sprt.tpag[tpag_index].width,
-						        entry->meta.sprt.tpag[tpag_index].height,
-						        entry->meta.sprt.tpag[tpag_index].txtr_index);
-
-						errno = EINVAL;
-						return -1;
-					}
-				}
+	if (gm_read_delta(delta, deltaname) == 0) {
+		if (delta->patched_size == archive->size && delta->patched_fingerprint == gm_archive_fingerprint(archive)) {
+			struct gm_plan *composed = gm_compose_plans(delta->plan, reverse);
+			gm_free_plan(reverse);
+
+			if (!composed) {
+				return -1;
 			}
-		}
 
-		if (!found) {
-			LOG_ERR("can't find sprite %s in game archive", patch->meta.sprt.name);
+			gm_free_plan(delta->plan);
+			delta->plan = composed;
 
-			errno = EINVAL;
-			return -1;
+			return 0;
 		}
 
-		return 0;
+		LOG_WARN("%s doesn't belong to the archive, creating a new one", deltaname);
+		gm_free_delta(delta);
+	}
+	else if (errno != ENOENT) {
+		int errnum = errno;
+		gm_free_plan(reverse);
+		errno = errnum;
+		return -1;
 	}
 
-	default:
-		LOG_ERR("can't patch %s section (not implemented)", gm_section_name(index->section));
+	// the current archive is the unpatched one, it is hashed while it is copied
+	delta->pristine_size = archive->size;
+	delta->plan = reverse;
+	*created = true;
 
-		errno = ENOSYS;
-		return -1;
+	return 0;
+}
+
+// Checks that the delta belongs to the archive and restores the original.
+static int gm_apply_delta(const char *filename, bool verify_only) {
+	char *deltaname   = NULL;
+	char *journalname = NULL;
+	struct gm_archive *archive = NULL;
+	struct gm_delta delta = { .plan = NULL };
+	int status = 0;
+
+	deltaname   = GM_CONCAT(filename, GM_DELTA_EXT);
+	journalname = GM_CONCAT(filename, GM_JOURNAL_EXT);
+	if (!deltaname || !journalname) {
+		goto error;
 	}
 
-	if (patch->index >= index->entry_count) {
-		LOG_ERR("patch index out of range: section = %s, patch index = %" PRIuPTR ", entry count = %" PRIuPTR,
-		        gm_section_name(index->section), patch->index, index->entry_count);
+	if (gm_replay_journal(filename, journalname) < 0) {
+		goto error;
+	}
 
-		errno = EINVAL;
-		return -1;
+	if (gm_read_delta(&delta, deltaname) != 0) {
+		LOG_ERR("Failed to read delta: %s", deltaname);
+		goto error;
 	}
 
-	struct gm_patched_entry *entry = &index->entries[patch->index];
-	if (entry->patch) {
-		LOG_ERR("section %s, entry %" PRIuPTR " is already patched", gm_section_name(index->section), patch->index);
+	archive = gm_open_archive(filename);
+	if (!archive) {
+		goto error;
+	}
+
+	if (delta.patched_size != archive->size || delta.patched_fingerprint != gm_archive_fingerprint(archive)) {
+		LOG_ERR("%s doesn't belong to the archive", deltaname);
 
 		errno = EINVAL;
-		return -1;
+		goto error;
 	}
 
-	if (entry->entry->type != patch->type) {
-		LOG_ERR("section %s, entry %" PRIuPTR " type missmatch: entry type = %s, patch type = %s",
-			gm_section_name(index->section), patch->index, gm_typename(entry->entry->type), gm_typename(patch->type));
+	uint64_t hash = 0;
+	if (gm_hash_plan(delta.plan, archive, &hash) != 0) {
+		goto error;
+	}
+
+	if (hash != delta.pristine_hash) {
+		LOG_ERR("%s doesn't restore the original archive (it was changed without updating the delta)", deltaname);
 
 		errno = EINVAL;
-		return -1;
+		goto error;
 	}
 
-	if (index->section == GM_TXTR) {
-		// validate replacement sprite dimensions
-		if (entry->entry->meta.txtr.width  != patch->meta.txtr.width ||
-		    entry->entry->meta.txtr.height != patch->meta.txtr.height) {
-			LOG_ERR("section %s, entry %" PRIuPTR " sprite dimensions missmatch: entry dimensions = %" PRIuPTR "x%" PRIuPTR
-			        ", patch dimensions = %" PRIuPTR "x%" PRIuPTR,
-				gm_section_name(index->section), patch->index, entry->entry->meta.txtr.width, entry->entry->meta.txtr.height,
-				patch->meta.txtr.width, patch->meta.txtr.height);
-
-			errno = EINVAL;
-			return -1;
-		}
+	if (verify_only) {
+		goto end;
 	}
 
-	off_t offset = patch->size - entry->entry->size;
-	index->size += offset;
-	entry->size  = patch->size;
-	entry->patch = patch;
+	if (gm_apply_plan(filename, archive, delta.plan, 0, NULL) != 0) {
+		goto error;
+	}
 
-	// also look at previous siblings, just in case
-	for (size_t i = 0; i < index->entry_count; ++ i) {
-		struct gm_patched_entry *other = &index->entries[i];
-		if (other->offset > entry->offset) {
-			other->offset += offset;
-		}
+	if (unlink(deltaname) != 0) {
+		LOG_WARN("couldn't remove delta %s: %s", deltaname, strerror(errno));
 	}
 
-	return gm_shift_tail(index + 1, offset);
-}
+	goto end;
 
-void gm_free_patched_index(struct gm_patched_index *index) {
-	if (index) {
-		for (struct gm_patched_index *ptr = index; ptr->section != GM_END; ++ ptr) {
-			if (ptr->entries) {
-				free(ptr->entries);
-				ptr->entries = NULL;
-			}
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+
+		free(deltaname);
+		free(journalname);
+		gm_free_delta(&delta);
+
+		if (archive) {
+			gm_close_archive(archive);
+			archive = NULL;
 		}
-		free(index);
-	}
-}
 
-const char *gm_section_name(enum gm_section section) {
-	switch (section) {
-	case GM_GEN8: return "GEN8";
-	case GM_OPTN: return "OPTN";
-	case GM_EXTN: return "EXTN";
-	case GM_SOND: return "SOND";
-	case GM_SPRT: return "SPRT";
-	case GM_BGND: return "BGND";
-	case GM_PATH: return "PATH";
-	case GM_SCPT: return "SCPT";
-	case GM_SHDR: return "SHDR";
-	case GM_FONT: return "FONT";
-	case GM_TMLN: return "TMLN";
-	case GM_OBJT: return "OBJT";
-	case GM_ROOM: return "ROOM";
-	case GM_DAFL: return "DAFL";
-	case GM_TPAG: return "TPAG";
-	case GM_CODE: return "CODE";
-	case GM_VARI: return "VARI";
-	case GM_FUNC: return "FUNC";
-	case GM_STRG: return "STRG";
-	case GM_TXTR: return "TXTR";
-	case GM_AUDO: return "AUDO";
-	case GM_AGRP: return "AGRP";
-	case GM_LANG: return "LANG";
-	case GM_GLOB: return "GLOB";
-	case GM_EMBI: return "EMBI";
-	case GM_TGIN: return "TGIN";
-	default: return NULL;
+		errno = errnum;
 	}
+
+	return status;
 }
 
-enum gm_section gm_parse_section(const uint8_t *name) {
-	if      (memcmp("GEN8", name, 4) == 0) { return GM_GEN8; }
-	else if (memcmp("OPTN", name, 4) == 0) { return GM_OPTN; }
-	else if (memcmp("EXTN", name, 4) == 0) { return GM_EXTN; }
-	else if (memcmp("SOND", name, 4) == 0) { return GM_SOND; }
-	else if (memcmp("SPRT", name, 4) == 0) { return GM_SPRT; }
-	else if (memcmp("BGND", name, 4) == 0) { return GM_BGND; }
-	else if (memcmp("PATH", name, 4) == 0) { return GM_PATH; }
-	else if (memcmp("SCPT", name, 4) == 0) { return GM_SCPT; }
-	else if (memcmp("SHDR", name, 4) == 0) { return GM_SHDR; }
-	else if (memcmp("FONT", name, 4) == 0) { return GM_FONT; }
-	else if (memcmp("TMLN", name, 4) == 0) { return GM_TMLN; }
-	else if (memcmp("OBJT", name, 4) == 0) { return GM_OBJT; }
-	else if (memcmp("ROOM", name, 4) == 0) { return GM_ROOM; }
-	else if (memcmp("DAFL", name, 4) == 0) { return GM_DAFL; }
-	else if (memcmp("TPAG", name, 4) == 0) { return GM_TPAG; }
-	else if (memcmp("CODE", name, 4) == 0) { return GM_CODE; }
-	else if (memcmp("VARI", name, 4) == 0) { return GM_VARI; }
-	else if (memcmp("FUNC", name, 4) == 0) { return GM_FUNC; }
-	else if (memcmp("STRG", name, 4) == 0) { return GM_STRG; }
-	else if (memcmp("TXTR", name, 4) == 0) { return GM_TXTR; }
-	else if (memcmp("AUDO", name, 4) == 0) { return GM_AUDO; }
-	else if (memcmp("AGRP", name, 4) == 0) { return GM_AGRP; }
-	else if (memcmp("LANG", name, 4) == 0) { return GM_LANG; }
-	else if (memcmp("GLOB", name, 4) == 0) { return GM_GLOB; }
-	else if (memcmp("EMBI", name, 4) == 0) { return GM_EMBI; }
-	else if (memcmp("TGIN", name, 4) == 0) { return GM_TGIN; }
-	else return GM_END;
-}
-
-int gm_read_index_strg(FILE *game, struct gm_index *section) {
-	uint8_t buffer[4];
-	size_t count = 0;
-	off_t *offsets = NULL;
-	struct gm_entry *entries = NULL;
+// Writes plan like gm_apply_plan() and creates or updates the reverse delta.
+// An existing delta is always updated, so it stays valid no matter what
+// changes the archive.
+static int gm_write_archive(const char *filename, const struct gm_archive *archive, const struct gm_plan *plan, int flags) {
+	struct gm_delta delta = { .plan = NULL };
+	struct stat st;
 	int status = 0;
 
-	if (fread(buffer, 4, 1, game) != 1) {
-		goto error;
+	char *deltaname = GM_CONCAT(filename, GM_DELTA_EXT);
+	if (!deltaname) {
+		return -1;
 	}
 
-	count = U32LE_FROM_BUF(buffer);
-	entries = calloc(count, sizeof(struct gm_entry));
-	if (!entries) {
+	// the delta needs the original data, so it is built before writing
+	bool created = false;
+	if (((flags & GM_PATCH_DELTA) || stat(deltaname, &st) == 0) &&
+	    gm_update_delta(&delta, deltaname, plan, archive, &created) != 0) {
 		goto error;
 	}
 
-	offsets = calloc(count, sizeof(off_t));
-	if (!offsets) {
+	if (gm_apply_plan(filename, archive, plan, flags, created ? &delta.pristine_hash : NULL) != 0) {
 		goto error;
 	}
 
-	for (size_t index = 0; index < count; ++ index) {
-		if (fread(buffer, 4, 1, game) != 1) {
+	if (delta.plan) {
+		struct gm_archive *patched = gm_open_archive(filename);
+		if (!patched) {
 			goto error;
 		}
 
-		uint32_t offset = U32LE_FROM_BUF(buffer);
-		if (offset > INT32_MAX) {
-			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, offset, INT32_MAX);
+		delta.patched_size        = patched->size;
+		delta.patched_fingerprint = gm_archive_fingerprint(patched);
+		gm_close_archive(patched);
 
-			errno = ERANGE;
+		if (gm_write_delta(&delta, deltaname) != 0) {
+			LOG_ERR("Failed to write delta: %s", deltaname);
 			goto error;
 		}
-		offsets[index] = (off_t)offset;
 	}
 
-	for (size_t index = 0; index < count; ++ index) {
-		struct gm_entry *entry = &entries[index];
-		if (fseeko(game, offsets[index], SEEK_SET) != 0) {
-			goto error;
-		}
+	goto end;
 
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
-		}
+error:
+	status = -1;
 
-		uint32_t size = U32LE_FROM_BUF(buffer);
-		if (size == UINT32_MAX) {
-			LOG_ERR("size too big: size = %" PRIu32 ", max. allowed = %" PRIu32, size, UINT32_MAX - 1);
+end:
+	{
+		int errnum = errno;
 
-			errno = ERANGE;
-			goto error;
-		}
-		// null byte is not included in size
-		++ size;
+		free(deltaname);
+		gm_free_delta(&delta);
+
+		errno = errnum;
+	}
+
+	return status;
+}
+
+int gm_unpatch_archive(const char *filename) {
+	return gm_apply_delta(filename, false);
+}
+
+int gm_verify_delta(const char *filename) {
+	return gm_apply_delta(filename, true);
+}
+
+// Hashes the payload of a patch that has no precomputed hash.
+static int gm_hash_patch(const struct gm_patch *patch, uint64_t *hash) {
+	uint8_t *buf = NULL;
+	FILE *fp = NULL;
+	int status = 0;
+
+	*hash = GM_FNV1A_OFFSET;
+
+	switch (patch->patch_src) {
+	case GM_SRC_MEM:
+		*hash = gm_fnv1a(*hash, patch->src.data, patch->size);
+		break;
 
-		char *strg = malloc(size);
-		if (!strg) {
+	case GM_SRC_FILE:
+		buf = malloc(GM_COPY_BUFFER_SIZE);
+		if (!buf) {
 			goto error;
 		}
 
-		if (fread(strg, size, 1, game) != 1) {
-			free(strg);
+		fp = fopen(patch->src.filename, "rb");
+		if (!fp) {
 			goto error;
 		}
 
-		if (strg[size - 1] != '\0') {
-			LOG_ERR("string at offset %" PRIi64 " (index %" PRIuPTR ") is not null terminated",
-			        (int64_t) offsets[index], index);
-
-			free(strg);
-			errno = EINVAL;
-			goto error;
+		for (size_t remaining = patch->size; remaining > 0;) {
+			const size_t count = remaining < GM_COPY_BUFFER_SIZE ? remaining : GM_COPY_BUFFER_SIZE;
+			if (fread(buf, count, 1, fp) != 1) {
+				if (!ferror(fp)) {
+					LOG_ERR("unexpected end of file while hashing: %s", patch->src.filename);
+					errno = EINVAL;
+				}
+				goto error;
+			}
+			*hash = gm_fnv1a(*hash, buf, count);
+			remaining -= count;
 		}
+		break;
 
-		entry->offset    = offsets[index];
-		entry->size      = size;
-		entry->meta.strg = strg;
+	default:
+		errno = EINVAL;
+		goto error;
 	}
 
-	section->entry_count = count;
-	section->entries     = entries;
-
 	goto end;
 
 error:
 	status = -1;
 
-	if (entries) {
-		for (size_t index = 0; index < count; ++ index) {
-			struct gm_entry *entry = &entries[index];
-			free(entry->meta.strg);
-			entry->meta.strg = NULL;
-		}
-		free(entries);
-		entries = NULL;
-	}
-
 end:
+	{
+		int errnum = errno;
+
+		free(buf);
 
-	if (offsets) {
-		free(offsets);
-		offsets = NULL;
+		if (fp) {
+			fclose(fp);
+		}
+
+		errno = errnum;
 	}
 
 	return status;
 }
 
-int gm_read_index_sprt(FILE *game, struct gm_index *section) {
-	uint8_t *buffer = NULL;
-	size_t buffer_size = 32 * 4;
-	size_t count = 0;
-	char *str = NULL;
-	struct gm_entry *entries = NULL;
-	struct gm_tpag *tpag = NULL;
-	int status = 0;
-
-	buffer = (uint8_t*)malloc(buffer_size);
-	if (!buffer) {
-		goto error;
+// Returns 1 if the archive already contains what patch would write, 0 if it
+// doesn't (or if the patch is invalid, which gm_plan_patches() reports) and
+// -1 on error. Sprite patches only validate, so they never need a write.
+static int gm_patch_is_applied(const struct gm_archive *archive, const struct gm_index *index, const struct gm_patch *patch) {
+	if (patch->section == GM_SPRT) {
+		return 1;
 	}
 
-	if (fread(buffer, 4, 1, game) != 1) {
-		goto error;
+	const struct gm_index *section = gm_find_section(index, patch->section);
+	if (!section || patch->index >= section->entry_count) {
+		return 0;
 	}
 
-	count = U32LE_FROM_BUF(buffer);
-	entries = calloc(count, sizeof(struct gm_entry));
-	if (!entries) {
-		goto error;
-	}
+	const struct gm_entry *entry = &section->entries[patch->index];
 
-	for (size_t index = 0; index < count; ++ index) {
-		struct gm_entry *entry = &entries[index];
+	switch (patch->section) {
+	case GM_STRG:
+		return strcmp(entry->meta.strg, patch->meta.strg.new) == 0;
 
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
+	case GM_TXTR:
+	case GM_AUDO:
+	{
+		if (entry->type != patch->type || entry->size != patch->size ||
+		    entry->offset < 0 || (uint64_t)entry->offset > archive->size ||
+		    archive->size - (size_t)entry->offset < entry->size) {
+			return 0;
 		}
 
-		const off_t next_offset = ftello(game);
-		if (next_offset < 0) {
-			goto error;
+		uint64_t hash = patch->hash;
+		if (hash == 0 && gm_hash_patch(patch, &hash) != 0) {
+			return -1;
 		}
 
-		const off_t offset = U32LE_FROM_BUF(buffer);
-		if (fseeko(game, offset, SEEK_SET) != 0) {
-			goto error;
-		}
+		return gm_fnv1a_archive(GM_FNV1A_OFFSET, archive, (size_t)entry->offset, entry->size) == hash;
+	}
 
-		if (fread(buffer, 20 * 4, 1, game) != 1) {
-			goto error;
-		}
+	default:
+		return 0;
+	}
+}
 
-		const uint32_t str_offset = U32LE_FROM_BUF(buffer);
-		if (str_offset > INT32_MAX && str_offset >= 4) {
-			LOG_ERR("offset not in range: offset = %" PRIu32 ", min. allowed = 4, max. allowed = %" PRIu32, str_offset, INT32_MAX);
+#define GM_PLAN_MAGIC   "GMPL"
+#define GM_PLAN_VERSION 1
 
-			errno = ERANGE;
-			goto error;
-		}
+// header: magic, version, source size and fingerprint, hash of the source
+//         bytes the plan doesn't copy, patch set hash, extent count, data size
+// extent: type, size, source offset (COPY), data offset (DATA) or index of
+//         the patch in the patch set (PATCH)
+#define GM_PLAN_HEADER_SIZE 56
+#define GM_PLAN_EXTENT_SIZE 20
 
-		const uint32_t tpag_count = U32LE_FROM_BUF(buffer + (19 * 4));
-		if (tpag_count > INT32_MAX) {
-			LOG_ERR("count too big: count = %" PRIu32 ", max. allowed = %" PRIu32, tpag_count, INT32_MAX);
+// Identifies a patch set, including the payloads. Sets read from a directory
+// have no precomputed hashes, so their files are hashed here.
+static int gm_hash_patches(const struct gm_patch *patches, int flags, uint64_t *hash) {
+	uint8_t buf[32];
 
-			errno = ERANGE;
-			goto error;
+	// only GM_PATCH_APPEND changes the plan
+	WRITE_U32LE(buf, (uint32_t)(flags & GM_PATCH_APPEND));
+	*hash = gm_fnv1a(GM_FNV1A_OFFSET, buf, 4);
+
+	for (const struct gm_patch *patch = patches; patch->section != GM_END; ++ patch) {
+		uint64_t payload = patch->hash;
+		if (payload == 0 && (patch->section == GM_TXTR || patch->section == GM_AUDO) &&
+		    gm_hash_patch(patch, &payload) != 0) {
+			return -1;
 		}
 
-		const size_t tpag_buffer_size = tpag_count * 4;
-		if (buffer_size < tpag_buffer_size) {
-			uint8_t *new_buffer = realloc(buffer, tpag_buffer_size);
-			if (!new_buffer) {
-				goto error;
-			}
+		WRITE_U32LE(buf,      patch->section);
+		WRITE_U32LE(buf +  4, patch->type);
+		WRITE_U64LE(buf +  8, patch->index);
+		WRITE_U64LE(buf + 16, patch->size);
+		WRITE_U64LE(buf + 24, payload);
+		*hash = gm_fnv1a(*hash, buf, sizeof(buf));
 
-			buffer = new_buffer;
-			buffer_size = tpag_buffer_size;
-		}
+		switch (patch->section) {
+		case GM_STRG:
+			*hash = gm_fnv1a(*hash, (const uint8_t*)patch->meta.strg.old, strlen(patch->meta.strg.old) + 1);
+			*hash = gm_fnv1a(*hash, (const uint8_t*)patch->meta.strg.new, strlen(patch->meta.strg.new) + 1);
+			break;
 
-		if (fread(buffer, tpag_buffer_size, 1, game) != 1) {
-			goto error;
-		}
+		case GM_SPRT:
+			*hash = gm_fnv1a(*hash, (const uint8_t*)patch->meta.sprt.name, strlen(patch->meta.sprt.name) + 1);
+			break;
 
-		tpag = (struct gm_tpag*)calloc(tpag_count, sizeof(struct gm_tpag));
-		if (!tpag) {
-			goto error;
+		case GM_TXTR:
+			WRITE_U64LE(buf,     patch->meta.txtr.width);
+			WRITE_U64LE(buf + 8, patch->meta.txtr.height);
+			*hash = gm_fnv1a(*hash, buf, 16);
+			break;
+
+		default:
+			break;
 		}
+	}
 
-		for (size_t tpag_index = 0; tpag_index < tpag_count; ++ tpag_index) {
-			uint32_t tpag_offset = U32LE_FROM_BUF(buffer + (tpag_index * 4));
-			uint8_t tpag_buffer[11 * 2];
+	return 0;
+}
 
-			if (fseeko(game, tpag_offset, SEEK_SET) != 0) {
-				goto error;
-			}
+// Hash of all source bytes that plan doesn't copy as they are. A plan
+// depends on the archive only through these and the section headers.
+static int gm_hash_replaced(const struct gm_plan *plan, const struct gm_archive *archive, uint64_t *hash) {
+	const struct gm_extent **copies = malloc((plan->extent_count > 0 ? plan->extent_count : 1) * sizeof(struct gm_extent*));
+	if (!copies) {
+		return -1;
+	}
 
-			if (fread(tpag_buffer, 11 * 2, 1, game) != 1) {
-				goto error;
-			}
+	size_t count = 0;
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
 
-			tpag[tpag_index].x          = U16LE_FROM_BUF(tpag_buffer);
-			tpag[tpag_index].y          = U16LE_FROM_BUF(tpag_buffer +  2);
-			tpag[tpag_index].width      = U16LE_FROM_BUF(tpag_buffer +  4);
-			tpag[tpag_index].height     = U16LE_FROM_BUF(tpag_buffer +  6);
-			tpag[tpag_index].txtr_index = U16LE_FROM_BUF(tpag_buffer + 20);
+		if (extent->type == GM_EXTENT_COPY) {
+			if ((uint64_t)extent->src.src_offset + extent->size > archive->size) {
+				free(copies);
+				errno = EINVAL;
+				return -1;
+			}
+			copies[count ++] = extent;
 		}
+	}
 
-		if (fseeko(game, str_offset - 4, SEEK_SET) != 0) {
-			goto error;
+	qsort(copies, count, sizeof(struct gm_extent*), gm_compare_copy_sources);
+
+	*hash = GM_FNV1A_OFFSET;
+	size_t pos = 0;
+	for (size_t index = 0; index < count; ++ index) {
+		const size_t src = (size_t)copies[index]->src.src_offset;
+		const size_t end = src + copies[index]->size;
+
+		if (src > pos) {
+			*hash = gm_fnv1a_archive(*hash, archive, pos, src - pos);
 		}
 
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
+		if (end > pos) {
+			pos = end;
 		}
+	}
+	*hash = gm_fnv1a_archive(*hash, archive, pos, archive->size - pos);
 
-		uint32_t str_length = U32LE_FROM_BUF(buffer);
-		if (str_length == UINT32_MAX) {
-			LOG_ERR("string size too big: string size = %" PRIu32 ", max. allowed = %" PRIu32, str_length, UINT32_MAX);
+	free(copies);
 
-			errno = ERANGE;
-			goto error;
-		}
+	return 0;
+}
+
+int gm_save_plan(const char *planname, const struct gm_plan *plan, const struct gm_archive *archive, const struct gm_patch *patches, int flags) {
+	char *tmpname = NULL;
+	FILE *fp = NULL;
+	int status = 0;
+	uint64_t replaced_hash = 0;
+	uint64_t patches_hash = 0;
+	uint8_t buf[GM_PLAN_HEADER_SIZE];
+
+	if (gm_hash_replaced(plan, archive, &replaced_hash) != 0 ||
+	    gm_hash_patches(patches, flags, &patches_hash) != 0) {
+		return -1;
+	}
+
+	tmpname = GM_CONCAT(planname, ".tmp");
+	if (!tmpname) {
+		return -1;
+	}
+
+	fp = fopen(tmpname, "wb");
+	if (!fp) {
+		goto error;
+	}
+
+	memcpy(buf, GM_PLAN_MAGIC, 4);
+	WRITE_U32LE(buf +  4, GM_PLAN_VERSION);
+	WRITE_U64LE(buf +  8, archive->size);
+	WRITE_U64LE(buf + 16, gm_archive_fingerprint(archive));
+	WRITE_U64LE(buf + 24, replaced_hash);
+	WRITE_U64LE(buf + 32, patches_hash);
+	WRITE_U64LE(buf + 40, plan->extent_count);
+	WRITE_U64LE(buf + 48, plan->data_size);
+
+	if (fwrite(buf, GM_PLAN_HEADER_SIZE, 1, fp) != 1) {
+		goto error;
+	}
 
-		str = calloc(str_length + 1, 1);
-		if (str == NULL) {
+	for (size_t index = 0; index < plan->extent_count; ++ index) {
+		const struct gm_extent *extent = &plan->extents[index];
+		uint64_t src = 0;
+
+		switch (extent->type) {
+		case GM_EXTENT_COPY:  src = (uint64_t)extent->src.src_offset; break;
+		case GM_EXTENT_DATA:  src = extent->src.data_offset; break;
+		case GM_EXTENT_PATCH: src = (uint64_t)(extent->src.patch - patches); break;
+		default:
+			errno = EINVAL;
 			goto error;
 		}
 
-		size_t read_count;
-		if ((read_count = fread(str, str_length, 1, game)) != 1) {
+		WRITE_U32LE(buf,      extent->type);
+		WRITE_U64LE(buf +  4, extent->size);
+		WRITE_U64LE(buf + 12, src);
+
+		if (fwrite(buf, GM_PLAN_EXTENT_SIZE, 1, fp) != 1) {
 			goto error;
 		}
+	}
 
-		entry->meta.sprt.name       = str;
-		entry->meta.sprt.tpag_count = tpag_count;
-		entry->meta.sprt.tpag       = tpag;
+	if (plan->data_size > 0 && fwrite(plan->data, plan->data_size, 1, fp) != 1) {
+		goto error;
+	}
 
-		str  = NULL;
-		tpag = NULL;
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto error;
+	}
+	fp = NULL;
 
-		if (fseeko(game, next_offset, SEEK_SET) != 0) {
-			goto error;
-		}
+	// for windows
+	if (unlink(planname) != 0 && errno != ENOENT) {
+		goto error;
 	}
 
-	section->entry_count = count;
-	section->entries     = entries;
+	if (rename(tmpname, planname) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+	int errnum = errno;
+
+	if (fp) {
+		fclose(fp);
+		fp = NULL;
+	}
+
+	unlink(tmpname);
+	errno = errnum;
+
+end:
+	free(tmpname);
 
-	goto end;
+	return status;
+}
 
-error:
-	status = -1;
+// *plan is NULL if there is no saved plan or if it was made for a different
+// archive or patch set.
+int gm_load_plan(const char *planname, const struct gm_archive *archive, const struct gm_patch *patches, int flags, struct gm_plan **plan) {
+	FILE *fp = NULL;
+	struct gm_plan *loaded = NULL;
+	uint8_t buf[GM_PLAN_HEADER_SIZE];
+	struct stat st;
+	int status = 0;
 
-	if (entries) {
-		for (size_t index = 0; index < count; ++ index) {
-			struct gm_entry *entry = &entries[index];
-			free(entry->meta.sprt.name);
-			entry->meta.sprt.name = NULL;
+	*plan = NULL;
 
-			free(entry->meta.sprt.tpag);
-			entry->meta.sprt.tpag = NULL;
-		}
-		free(entries);
-		entries = NULL;
+	fp = fopen(planname, "rb");
+	if (!fp) {
+		return errno == ENOENT ? 0 : -1;
 	}
 
-end:
-
-	if (buffer) {
-		free(buffer);
-		buffer = NULL;
+	if (fstat(fileno(fp), &st) != 0) {
+		goto error;
 	}
 
-	if (str) {
-		free(str);
-		str = NULL;
+	if (fread(buf, GM_PLAN_HEADER_SIZE, 1, fp) != 1 ||
+		memcmp(buf, GM_PLAN_MAGIC, 4) != 0 ||
+		U32LE_FROM_BUF(buf + 4) != GM_PLAN_VERSION) {
+		goto corrupt;
 	}
 
-	if (tpag) {
-		free(tpag);
-		tpag = NULL;
+	if (U64LE_FROM_BUF(buf + 8) != archive->size || U64LE_FROM_BUF(buf + 16) != gm_archive_fingerprint(archive)) {
+		goto end;
 	}
 
-	return status;
-}
+	size_t patch_count = 0;
+	while (patches[patch_count].section != GM_END) {
+		++ patch_count;
+	}
 
-int gm_read_index_txtr(FILE *game, struct gm_index *section) {
-	uint8_t buffer[12];
-	size_t count = 0;
-	off_t *info_offsets = NULL;
-	struct gm_entry *entries = NULL;
-	int status = 0;
+	const uint64_t replaced_hash = U64LE_FROM_BUF(buf + 24);
+	const uint64_t patches_hash  = U64LE_FROM_BUF(buf + 32);
+	const uint64_t extent_count  = U64LE_FROM_BUF(buf + 40);
+	const uint64_t data_size     = U64LE_FROM_BUF(buf + 48);
+	const uint64_t file_size     = (uint64_t)st.st_size - GM_PLAN_HEADER_SIZE;
 
-	if (fread(buffer, 4, 1, game) != 1) {
+	uint64_t hash = 0;
+	if (gm_hash_patches(patches, flags, &hash) != 0) {
 		goto error;
 	}
 
-	count = U32LE_FROM_BUF(buffer);
-	entries = calloc(count, sizeof(struct gm_entry));
-	if (!entries) {
+	if (hash != patches_hash) {
+		goto end;
+	}
+
+	if (extent_count > file_size / GM_PLAN_EXTENT_SIZE ||
+	    data_size != file_size - extent_count * GM_PLAN_EXTENT_SIZE) {
+		goto corrupt;
+	}
+
+	loaded = calloc(1, sizeof(struct gm_plan));
+	if (!loaded) {
 		goto error;
 	}
 
-	info_offsets = calloc(count, sizeof(off_t));
-	if (!info_offsets) {
+	loaded->extents = malloc((extent_count > 0 ? extent_count : 1) * sizeof(struct gm_extent));
+	loaded->data    = malloc(data_size > 0 ? data_size : 1);
+	if (!loaded->extents || !loaded->data) {
 		goto error;
 	}
+	loaded->extent_capacity = loaded->extent_count = (size_t)extent_count;
+	loaded->data_capacity   = loaded->data_size    = (size_t)data_size;
 
-	for (size_t index = 0; index < count; ++ index) {
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
+	for (size_t index = 0; index < loaded->extent_count; ++ index) {
+		struct gm_extent *extent = &loaded->extents[index];
+
+		if (fread(buf, GM_PLAN_EXTENT_SIZE, 1, fp) != 1) {
+			goto corrupt;
 		}
 
-		uint32_t offset = U32LE_FROM_BUF(buffer);
-		if (offset > INT32_MAX) {
-			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, offset, INT32_MAX);
+		const uint32_t type = U32LE_FROM_BUF(buf);
+		const uint64_t size = U64LE_FROM_BUF(buf + 4);
+		const uint64_t src  = U64LE_FROM_BUF(buf + 12);
 
-			errno = ERANGE;
-			goto error;
-		}
-		info_offsets[index] = (off_t)offset;
-	}
+		extent->type   = (enum gm_extent_type)type;
+		extent->offset = (off_t)loaded->size;
+		extent->size   = (size_t)size;
 
-	for (size_t index = 0; index < count; ++ index) {
-		struct gm_entry *entry = &entries[index];
-		if (fseeko(game, info_offsets[index], SEEK_SET) != 0) {
-			goto error;
+		if (type == GM_EXTENT_COPY && src <= archive->size && size <= archive->size - src) {
+			extent->src.src_offset = (off_t)src;
 		}
-
-		if (fread(buffer, 12, 1, game) != 1) {
-			goto error;
+		else if (type == GM_EXTENT_DATA && src <= data_size && size <= data_size - src) {
+			extent->src.data_offset = (size_t)src;
 		}
-
-		const uint32_t unknown1 = U32LE_FROM_BUF(buffer);
-		if (unknown1 > 1) {
-			LOG_ERR("at offset %" PRIi64 ", section %s, entry %" PRIuPTR ": unexpected value of non-reverse engineered field: unknown1 = %" PRIu32,
-				(int64_t)info_offsets[index], gm_section_name(section->section), index, unknown1);
-
-			errno = ENOSYS;
-			goto error;
+		else if (type == GM_EXTENT_PATCH && src < patch_count && size == patches[src].size) {
+			extent->src.patch = &patches[src];
 		}
-
-		const uint32_t unknown2 = U32LE_FROM_BUF(buffer + 4);
-		if (unknown2 > 0) {
-			LOG_ERR("at offset %" PRIi64 ", section %s, entry %" PRIuPTR ": unexpected value of non-reverse engineered field: unknown2 = %" PRIu32,
-				(int64_t)info_offsets[index], gm_section_name(section->section), index, unknown2);
-
-			errno = ENOSYS;
-			goto error;
+		else {
+			goto corrupt;
 		}
 
-		const uint32_t offset = U32LE_FROM_BUF(buffer + 8);
-		if (offset > INT32_MAX) {
-			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, offset, INT32_MAX);
-
-			errno = ERANGE;
-			goto error;
-		}
-		entry->offset = (off_t)offset;
-		if (fseeko(game, (off_t)offset, SEEK_SET) != 0) {
-			goto error;
+		if (size > SIZE_MAX - loaded->size) {
+			goto corrupt;
 		}
+		loaded->size += (size_t)size;
+	}
 
-		struct png_info meta;
-		if (parse_png_info(game, &meta) != 0) {
-			LOG_ERR("section %s, entry %" PRIuPTR ": error parsing sprite file",
-				gm_section_name(section->section), index);
+	if (data_size > 0 && fread(loaded->data, data_size, 1, fp) != 1) {
+		goto corrupt;
+	}
 
-			goto error;
-		}
+	// everything the plan doesn't copy has to be what it was made for
+	if (gm_hash_replaced(loaded, archive, &hash) != 0) {
+		goto error;
+	}
 
-		entry->size = meta.filesize;
-		entry->type = GM_PNG;
-		entry->meta.txtr.unknown1 = unknown1;
-		entry->meta.txtr.unknown2 = unknown2;
-		entry->meta.txtr.width  = meta.width;
-		entry->meta.txtr.height = meta.height;
+	if (hash == replaced_hash) {
+		*plan  = loaded;
+		loaded = NULL;
 	}
 
-	section->entry_count = count;
-	section->entries     = entries;
+	goto end;
 
+corrupt:
+	// only a cache, so it is just made again
+	LOG_WARN("ignoring corrupt plan: %s", planname);
 	goto end;
 
 error:
 	status = -1;
 
-	if (entries) {
-		free(entries);
-		entries = NULL;
-	}
-
 end:
+	{
+		int errnum = errno;
+
+		gm_free_plan(loaded);
+		fclose(fp);
 
-	if (info_offsets) {
-		free(info_offsets);
-		info_offsets = NULL;
+		errno = errnum;
 	}
 
 	return status;
 }
 
-int gm_read_index_audo(FILE *game, struct gm_index *section) {
-	uint8_t buffer[12];
-	size_t count = 0;
-	off_t *offsets = NULL;
-	struct gm_entry *entries = NULL;
-	int status = 0;
+static uint32_t gm_patched_sections(const struct gm_patch *patches) {
+	uint32_t patched_mask = 0;
+	for (const struct gm_patch *patch = patches; patch->section != GM_END; ++ patch) {
+		patched_mask |= GM_SECTION_BIT(patch->section);
+	}
+	return patched_mask;
+}
 
-	if (fread(buffer, 4, 1, game) != 1) {
-		goto error;
+// Only parse the entries of sections that are patched or that might be
+// moved by a patch. All other sections are copied as they are.
+static int gm_load_patched_sections(struct gm_index *index, uint32_t patched_mask, int flags) {
+	// Entries appended by GM_PATCH_APPEND can point into any TXTR or AUDO
+	// section, so all of them are needed as soon as one of them changes.
+	const uint32_t entries_mask = GM_SECTION_BIT(GM_TXTR) | GM_SECTION_BIT(GM_AUDO);
+	const uint32_t load_mask = (flags & GM_PATCH_APPEND) || (patched_mask & entries_mask) ?
+		patched_mask | entries_mask : patched_mask;
+
+	bool moved = false;
+	for (struct gm_index *section = index; section->section != GM_END; ++ section) {
+		const bool patched = patched_mask & GM_SECTION_BIT(section->section);
+
+		if (((load_mask & GM_SECTION_BIT(section->section)) || moved) && gm_load_section(index, section) != 0) {
+			return -1;
+		}
+
+		if (patched && (section->section == GM_TXTR || section->section == GM_AUDO)) {
+			moved = true;
+		}
 	}
 
-	count = U32LE_FROM_BUF(buffer);
-	entries = calloc(count, sizeof(struct gm_entry));
-	if (!entries) {
+	return 0;
+}
+
+int gm_patch_archive(const char *filename, const struct gm_patch *patches) {
+	return gm_patch_archive_ex(filename, patches, 0);
+}
+
+int gm_patch_archive_ex(const char *filename, const struct gm_patch *patches, int flags) {
+	char *journalname = NULL;
+	struct gm_archive *archive       = NULL;
+	struct gm_index *index           = NULL;
+	struct gm_plan *plan             = NULL;
+	struct gm_patch *pending         = NULL;
+	char *planname                   = NULL;
+	int status = 0;
+
+	journalname = GM_CONCAT(filename, GM_JOURNAL_EXT);
+	if (journalname == NULL) {
 		goto error;
 	}
 
-	offsets = calloc(count, sizeof(off_t));
-	if (!offsets) {
+	// finish a previously interrupted in place patch first
+	if (gm_replay_journal(filename, journalname) < 0) {
 		goto error;
 	}
 
-	for (size_t index = 0; index < count; ++ index) {
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
-		}
-
-		uint32_t offset = U32LE_FROM_BUF(buffer);
-		if (offset > INT32_MAX) {
-			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, offset, INT32_MAX);
-
-			errno = ERANGE;
-			goto error;
-		}
-		offsets[index] = (off_t)offset;
+	// opened by name so the index cache can be used
+	archive = gm_open_archive(filename);
+	if (!archive) {
+		goto error;
 	}
 
-	for (size_t index = 0; index < count; ++ index) {
-		struct gm_entry *entry = &entries[index];
-		if (fseeko(game, offsets[index], SEEK_SET) != 0) {
+	// A saved plan for exactly this archive and patch set is used without
+	// reading the index again.
+	if (flags & GM_PATCH_PLAN_CACHE) {
+		planname = GM_CONCAT(filename, GM_PLAN_EXT);
+		if (planname == NULL) {
 			goto error;
 		}
 
-		if (fread(buffer, 4, 1, game) != 1) {
+		if (gm_load_plan(planname, archive, patches, flags, &plan) != 0) {
 			goto error;
 		}
 
-		uint32_t size = U32LE_FROM_BUF(buffer);
-		uint32_t hdrsize = size < 12 ? size : 12;
-		if (fread(buffer, hdrsize, 1, game) != 1) {
-			goto error;
-		}
-		if (hdrsize >= 12 &&
-		    memcmp(buffer, "RIFF", 4) == 0 &&
-		    memcmp(buffer + 8, "WAVE", 4) == 0) {
-			entry->type = GM_WAVE;
-		}
-		else if (hdrsize >= 4 && memcmp(buffer, "OggS", 4) == 0) {
-			entry->type = GM_OGG;
+		if (plan) {
+			goto write;
 		}
-		else {
-			entry->type = GM_UNKNOWN;
-		}
-		entry->offset = offsets[index] + 4;
-		entry->size   = size;
 	}
 
-	section->entry_count = count;
-	section->entries     = entries;
+	index = gm_read_index_ex(archive, 0, GM_INDEX_LAZY | gm_default_index_flags());
+	if (!index) {
+		goto error;
+	}
 
-	goto end;
+	if (gm_load_patched_sections(index, gm_patched_sections(patches), flags) != 0) {
+		goto error;
+	}
 
-error:
-	status = -1;
+	// Only apply what isn't already in the archive, so patching an already
+	// patched archive again doesn't touch the file at all.
+	size_t patch_count = 0;
+	while (patches[patch_count].section != GM_END) {
+		++ patch_count;
+	}
 
-	if (entries) {
-		free(entries);
-		entries = NULL;
+	pending = malloc((patch_count + 1) * sizeof(struct gm_patch));
+	if (!pending) {
+		goto error;
 	}
 
-end:
+	size_t pending_count = 0;
+	bool needs_write = false;
+	for (const struct gm_patch *patch = patches; patch->section != GM_END; ++ patch) {
+		const int applied = gm_patch_is_applied(archive, index, patch);
+		if (applied < 0) {
+			goto error;
+		}
 
-	if (offsets) {
-		free(offsets);
-		offsets = NULL;
+		// sprite patches are kept to validate the textures that are written
+		if (!applied || patch->section == GM_SPRT) {
+			pending[pending_count ++] = *patch;
+			needs_write = needs_write || !applied;
+		}
 	}
+	pending[pending_count] = patches[patch_count];
 
-	return status;
-}
-
-struct gm_index *gm_read_index(FILE *game) {
-	size_t capacity = 32;
-	size_t count = 0;
-	struct gm_index *index = calloc(capacity, sizeof(struct gm_index));
-	if (!index) {
-		goto error;
+	if (!needs_write) {
+		goto end;
 	}
 
-	uint8_t buffer[8];
-	if (fread(buffer, 8, 1, game) != 1) {
+	plan = gm_plan_patches_ex(index, pending, flags);
+	if (!plan) {
 		goto error;
 	}
 
-	if (memcmp(buffer, "FORM", 4) != 0) {
-		LOG_ERR("unsupported file magic: '%c%c%c%c' (0x%0x 0x%0x 0x%0x 0x%0x)",
-			buffer[0], buffer[1], buffer[2], buffer[3],
-			buffer[0], buffer[1], buffer[2], buffer[3]);
+	// Plans of a partly patched archive also depend on the entries that were
+	// skipped, so only plans for all patches are saved. Patch extents then
+	// point into pending at the same positions as in patches.
+	if (planname && pending_count == patch_count &&
+	    gm_save_plan(planname, plan, archive, pending, flags) != 0) {
+		LOG_WARN("Failed to save plan: %s", planname);
+	}
 
-		errno = ENOSYS;
+write:
+	if (gm_write_archive(filename, archive, plan, flags) != 0) {
 		goto error;
 	}
 
-	const size_t form_size = U32LE_FROM_BUF(buffer + 4);
-	const off_t end_offset = form_size + 8;
-	off_t offset = 8;
-
-	while (offset < end_offset) {
-		if (fread(buffer, 8, 1, game) != 1) {
-			goto error;
-		}
+	goto end;
 
-		enum gm_section section_type = gm_parse_section(buffer);
-		if (section_type == GM_END) {
-			LOG_ERR("at offset %" PRIi64 ": unsupported section magic: '%c%c%c%c' (0x%0x 0x%0x 0x%0x 0x%0x)",
-				(int64_t)offset,
-				buffer[0], buffer[1], buffer[2], buffer[3],
-				buffer[0], buffer[1], buffer[2], buffer[3]);
+error:
+	status = -1;
 
-			errno = ENOSYS;
-			goto error;
-		}
+end:
+	{
+		int errnum = errno;
 
-		size_t section_size = U32LE_FROM_BUF(buffer + 4);
-		if (section_size > INT32_MAX - 8 || offset > INT32_MAX - 8 - (int32_t)section_size) {
-			LOG_ERR("section size big: section size = %" PRIuPTR ", max. allowed = %" PRIu32, section_size, INT32_MAX);
+		free(journalname);
+		free(planname);
+		free(pending);
 
-			errno = ERANGE;
-			goto error;
+		if (index) {
+			gm_free_index(index);
+			index = NULL;
 		}
 
-		if ((size_t)offset + section_size + 8 > (size_t)end_offset) {
-			LOG_ERR("%s section overflows file: section offset = %" PRIi64 ", section size = %" PRIuPTR ", file size = %" PRIi64,
-				gm_section_name(section_type), (int64_t)offset, section_size + 8, (int64_t)end_offset);
-
-			errno = EINVAL;
-			goto error;
+		if (archive) {
+			gm_close_archive(archive);
+			archive = NULL;
 		}
 
-		if (count >= capacity) {
-			capacity *= 2;
-			struct gm_index *new_index = realloc(index, capacity * sizeof(struct gm_index));
-			if (!new_index) {
-				goto error;
-			}
-			memset(new_index + count * sizeof(struct gm_index), 0, (capacity - count) * sizeof(struct gm_index));
-			index = new_index;
+		if (plan) {
+			gm_free_plan(plan);
+			plan = NULL;
 		}
 
-		struct gm_index *section = &index[count];
-		section->section = section_type;
-		section->offset  = offset;
-		section->size    = section_size;
+		errno = errnum;
+	}
 
-		switch (section_type) {
-		case GM_STRG:
-			if (gm_read_index_strg(game, section) != 0) {
-				goto error;
-			}
-			break;
+	return status;
+}
 
-		case GM_SPRT:
-			if (gm_read_index_sprt(game, section) != 0) {
-				goto error;
-			}
-			break;
+// A patch of a patch set passed to gm_merge_patches(). order is the position
+// in all layers, so patches of later layers compare greater.
+struct gm_layered_patch {
+	const struct gm_patch *patch;
+	size_t layer;
+	size_t order;
+};
 
-		case GM_TXTR:
-			if (gm_read_index_txtr(game, section) != 0) {
-				goto error;
-			}
-			break;
+// Orders patches by the entry they patch. Sprite patches are identified by
+// the sprite name.
+static int gm_compare_patch_targets(const struct gm_patch *lhs, const struct gm_patch *rhs) {
+	if (lhs->section != rhs->section) {
+		return lhs->section < rhs->section ? -1 : 1;
+	}
 
-		case GM_AUDO:
-			if (gm_read_index_audo(game, section) != 0) {
-				goto error;
-			}
-			break;
+	if (lhs->section == GM_SPRT) {
+		return strcmp(lhs->meta.sprt.name, rhs->meta.sprt.name);
+	}
 
-		default:
-			break;
-		}
+	return lhs->index < rhs->index ? -1 : lhs->index > rhs->index ? 1 : 0;
+}
 
-		offset += section_size + 8;
-		if (fseeko(game, offset, SEEK_SET) != 0) {
-			goto error;
-		}
+// Orders by the patched entry, then patches of later layers first.
+static int gm_compare_layered_patches(const void *lhs, const void *rhs) {
+	const struct gm_layered_patch *lpatch = (const struct gm_layered_patch*)lhs;
+	const struct gm_layered_patch *rpatch = (const struct gm_layered_patch*)rhs;
 
-		++ count;
+	const int cmp = gm_compare_patch_targets(lpatch->patch, rpatch->patch);
+	if (cmp != 0) {
+		return cmp;
 	}
 
-	goto end;
+	return lpatch->order < rpatch->order ? 1 : lpatch->order > rpatch->order ? -1 : 0;
+}
 
-error:
-	if (index) {
-		gm_free_index(index);
-		index = NULL;
+struct gm_patch *gm_merge_patches(const struct gm_patch *const layers[], size_t layer_count) {
+	struct gm_layered_patch *sorted = NULL;
+	struct gm_patch *merged = NULL;
+
+	size_t count = 0;
+	for (size_t layer = 0; layer < layer_count; ++ layer) {
+		for (const struct gm_patch *patch = layers[layer]; patch->section != GM_END; ++ patch) {
+			++ count;
+		}
 	}
 
-end:
-	return index;
-}
+	sorted = malloc((count > 0 ? count : 1) * sizeof(struct gm_layered_patch));
+	merged = malloc((count + 1) * sizeof(struct gm_patch));
+	if (!sorted || !merged) {
+		goto error;
+	}
 
-size_t gm_form_size(const struct gm_patched_index *index) {
-	size_t size = 0;
-	while (index->section != GM_END) {
-		size += index->size + 8;
-		++ index;
+	size_t order = 0;
+	for (size_t layer = 0; layer < layer_count; ++ layer) {
+		for (const struct gm_patch *patch = layers[layer]; patch->section != GM_END; ++ patch) {
+			sorted[order].patch = patch;
+			sorted[order].layer = layer;
+			sorted[order].order = order;
+			++ order;
+		}
 	}
-	return size;
-}
 
-int gm_write_hdr(FILE *fp, const uint8_t *magic, size_t size) {
-	if (!magic) {
-		LOG_ERR_MSG("magic may not be NULL");
+	qsort(sorted, count, sizeof(struct gm_layered_patch), gm_compare_layered_patches);
 
-		errno = EINVAL;
-		return -1;
+	// Keep the patches of the last layer that patches an entry. Conflicts
+	// within the same layer are kept, so gm_patch_entry() still reports them.
+	size_t merged_count = 0;
+	for (size_t index = 0; index < count;) {
+		const size_t layer = sorted[index].layer;
+		size_t next = index;
+
+		do {
+			if (sorted[next].layer == layer) {
+				merged[merged_count ++] = *sorted[next].patch;
+			}
+			++ next;
+		} while (next < count && gm_compare_patch_targets(sorted[index].patch, sorted[next].patch) == 0);
+
+		index = next;
 	}
 
-	if (size > UINT32_MAX) {
-		LOG_ERR("section size out of range: size = %" PRIuPTR ", max size = %" PRIu32, size, UINT32_MAX);
+	memset(&merged[merged_count], 0, sizeof(struct gm_patch));
+	merged[merged_count].section = GM_END;
 
-		errno = EINVAL;
-		return -1;
+	free(sorted);
+
+	return merged;
+
+error:
+	{
+		int errnum = errno;
+		free(sorted);
+		free(merged);
+		errno = errnum;
 	}
 
-	uint8_t buffer[8];
-	memcpy(buffer, magic, 4);
-	WRITE_U32LE(buffer + 4, (uint32_t)size);
+	return NULL;
+}
 
-	if (fwrite(buffer, 8, 1, fp) != 1) {
+int gm_patch_archive_layers(const char *filename, const struct gm_patch *const layers[], size_t layer_count, int flags) {
+	struct gm_patch *patches = gm_merge_patches(layers, layer_count);
+	if (!patches) {
 		return -1;
 	}
 
-	return 0;
-}
+	const int status = gm_patch_archive_ex(filename, patches, flags);
 
-size_t gm_index_length(const struct gm_index *index) {
-	size_t len = 0;
-	while (index->section != GM_END) {
-		++ len;
-		++ index;
+	{
+		int errnum = errno;
+		free(patches);
+		errno = errnum;
 	}
-	return len;
+
+	return status;
 }
 
-int gm_patch_archive(const char *filename, const struct gm_patch *patches) {
-	char *tmpname = NULL;
-	FILE *game = NULL;
-	FILE *tmp  = NULL;
-	struct gm_index *index           = NULL;
-	struct gm_patched_index *patched = NULL;
+int gm_patch_archive_fanout(const char *filename, const struct gm_patch_target *targets, size_t target_count, int flags) {
+	char *journalname = NULL;
+	char *deltaname   = NULL;
+	struct gm_delta delta      = { .plan = NULL };
+	struct gm_source_hash source_hash;
+	struct gm_archive *archive = NULL;
+	struct gm_index *index     = NULL;
+	struct gm_plan **plans     = NULL;
+	FILE **tmps                = NULL;
+	char **tmpnames            = NULL;
+	FILE *game                 = NULL;
+	size_t source_target       = target_count;
+	bool created               = false;
+	struct stat st;
 	int status = 0;
 
-	tmpname = GM_CONCAT(filename, ".tmp");
-	if (tmpname == NULL) {
+	journalname = GM_CONCAT(filename, GM_JOURNAL_EXT);
+	if (journalname == NULL) {
 		goto error;
 	}
 
-	game = fopen(filename, "rb");
-	if (!game) {
-		LOG_ERR("Failed to open archive: %s", filename);
+	if (gm_replay_journal(filename, journalname) < 0) {
+		goto error;
+	}
+
+	plans    = calloc(target_count > 0 ? target_count : 1, sizeof(struct gm_plan*));
+	tmps     = calloc(target_count > 0 ? target_count : 1, sizeof(FILE*));
+	tmpnames = calloc(target_count > 0 ? target_count : 1, sizeof(char*));
+	if (!plans || !tmps || !tmpnames) {
+		goto error;
+	}
+
+	archive = gm_open_archive(filename);
+	if (!archive) {
+		goto error;
+	}
+
+	// the output that replaces the source needs its reverse delta updated
+	struct stat source_st;
+	if (stat(filename, &source_st) != 0) {
 		goto error;
 	}
 
-	index = gm_read_index(game);
+	for (size_t target = 0; target < target_count; ++ target) {
+		if (stat(targets[target].filename, &st) == 0 && st.st_dev == source_st.st_dev && st.st_ino == source_st.st_ino) {
+			source_target = target;
+			break;
+		}
+	}
+
+	index = gm_read_index_ex(archive, 0, GM_INDEX_LAZY | gm_default_index_flags());
 	if (!index) {
 		goto error;
 	}
 
-	// build patch index
-	const size_t count = gm_index_length(index);
-	patched = calloc(count + 1, sizeof(struct gm_patched_index));
-	if (!patched) {
+	// the index is shared by all plans, so it needs everything any of them needs
+	uint32_t patched_mask = 0;
+	for (size_t target = 0; target < target_count; ++ target) {
+		patched_mask |= gm_patched_sections(targets[target].patches);
+	}
+
+	if (gm_load_patched_sections(index, patched_mask, flags) != 0) {
 		goto error;
 	}
 
-	for (size_t i = 0; i < count; ++ i) {
-		size_t entry_count = index[i].entry_count;
-		struct gm_patched_entry *entries = calloc(entry_count, sizeof(struct gm_patched_entry));
-		if (!entries) {
+	for (size_t target = 0; target < target_count; ++ target) {
+		plans[target] = gm_plan_patches_ex(index, targets[target].patches, flags);
+		if (!plans[target] || gm_check_plan(plans[target], archive) != 0) {
+			LOG_ERR("Failed to plan patches for: %s", targets[target].filename);
 			goto error;
 		}
 
-		struct gm_entry *index_entries = index[i].entries;
-		for (size_t j = 0; j < entry_count; ++ j) {
-			entries[j].offset = index_entries[j].offset;
-			entries[j].size   = index_entries[j].size;
-			entries[j].entry  = &index_entries[j];
+		tmpnames[target] = GM_CONCAT(targets[target].filename, ".tmp");
+		if (!tmpnames[target]) {
+			goto error;
 		}
 
-		patched[i].section     = index[i].section;
-		patched[i].offset      = index[i].offset;
-		patched[i].size        = index[i].size;
-		patched[i].entry_count = entry_count;
-		patched[i].entries     = entries;
-		patched[i].index       = &index[i];
-	}
-	patched[count].section = GM_END;
+		tmps[target] = fopen(tmpnames[target], "wb");
+		if (!tmps[target]) {
+			LOG_ERR("Failed to open temp file: %s", tmpnames[target]);
+			goto error;
+		}
 
-	// adjust patch index
-	for (const struct gm_patch *patch = patches; patch->section != GM_END; ++ patch) {
-		struct gm_patched_index *section = gm_get_section(patched, patch->section);
-		if (!section) {
-			LOG_ERR("archive contains no %s section", gm_section_name(patch->section));
+		if (gm_preallocate(tmps[target], plans[target]->size) < 0) {
+			goto error;
+		}
+	}
 
-			errno = EINVAL;
+	if (source_target < target_count) {
+		deltaname = GM_CONCAT(filename, GM_DELTA_EXT);
+		if (!deltaname) {
 			goto error;
 		}
 
-		if (gm_patch_entry(section, patch) != 0) {
-			LOG_ERR("applying patch for section %s, entry %" PRIuPTR " failed",
-				gm_section_name(patch->section), patch->index);
+		// same as gm_write_archive(): an existing delta is always updated
+		if (((flags & GM_PATCH_DELTA) || stat(deltaname, &st) == 0) &&
+		    gm_update_delta(&delta, deltaname, plans[source_target], archive, &created) != 0) {
 			goto error;
 		}
 	}
 
-	// write new archive
-	tmp = fopen(tmpname, "wb");
-	if (!tmp) {
-		LOG_ERR("Failed to open temp file: %s", tmpname);
+	game = fopen(filename, "rb");
+	if (!game) {
+		LOG_ERR("Failed to open archive: %s", filename);
 		goto error;
 	}
 
-	size_t form_size = gm_form_size(patched);
-	if (gm_write_hdr(tmp, (const uint8_t*)"FORM", form_size) != 0) {
+	gm_source_hash_init(&source_hash, archive);
+
+	if (gm_write_plans_hashed((const struct gm_plan *const*)plans, game, tmps, target_count, created ? &source_hash : NULL) != 0) {
 		goto error;
 	}
 
-	for (struct gm_patched_index *ptr = patched; ptr->section != GM_END; ++ ptr) {
-		uint8_t buffer[12];
+	if (created) {
+		gm_source_hash_to(&source_hash, archive->size);
+		delta.pristine_hash = source_hash.hash;
+	}
+
+	for (size_t target = 0; target < target_count; ++ target) {
+		FILE *tmp = tmps[target];
+		tmps[target] = NULL;
 
-		if (fseeko(tmp, ptr->offset, SEEK_SET) != 0) {
+		if (fclose(tmp) != 0) {
 			goto error;
 		}
+	}
 
-		if (gm_write_hdr(tmp, (const uint8_t*)gm_section_name(ptr->section), ptr->size) != 0) {
+	// Only replace the outputs once all of them are written. The source stays
+	// open, so it can be one of the outputs.
+	for (size_t target = 0; target < target_count; ++ target) {
+		// delete target mainly to make it work on windows:
+		if (unlink(targets[target].filename) != 0 && errno != ENOENT) {
+			LOG_ERR("Failed to remove old archive: %s", targets[target].filename);
 			goto error;
 		}
 
-		switch (ptr->section) {
-		case GM_STRG:
-		{
-			WRITE_U32LE(buffer, ptr->entry_count);
-			if (fwrite(buffer, 4, 1, tmp) != 1) {
-				goto error;
-			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				const uint32_t offset = ptr->entries[i].offset;
-				WRITE_U32LE(buffer, offset);
-				if (fwrite(buffer, 4, 1, tmp) != 1) {
-					goto error;
-				}
-			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				struct gm_patched_entry *entry = &ptr->entries[i];
-				if (entry->patch) {
-					if (fseeko(tmp, entry->offset, SEEK_SET) != 0) {
-						goto error;
-					}
-					// null byte not included in size
-					size_t new_len = strlen(entry->patch->meta.strg.new);
-					WRITE_U32LE(buffer, new_len);
-					if (fwrite(buffer, 4, 1, tmp) != 1) {
-						goto error;
-					}
-					++ new_len;
-					if (fwrite(entry->patch->meta.strg.new, new_len, 1, tmp) != 1) {
-						goto error;
-					}
-					const size_t old_len = entry->size;
-					while (new_len < old_len) {
-						if (fwrite("", 1, 1, tmp) != 1) {
-							goto error;
-						}
-						++ new_len;
-					}
-				}
-				else if (gm_copydata(game, entry->entry->offset, tmp, entry->offset, entry->size + 4) != 0) {
-					goto error;
-				}
-			}
-			const off_t offset = ftello(tmp);
-			if (offset < 0) {
-				goto error;
-			}
-			const off_t relative_offset = offset - ptr->offset;
-			const size_t full_size = ptr->size + 8;
-			if ((size_t) relative_offset < full_size) {
-				// This seems just to be some zero padding, maybe for alignment, but let's copy it anyway.
-				if (gm_copydata(game, ptr->index->offset + relative_offset, tmp, offset, full_size - relative_offset) != 0) {
-					goto error;
-				}
-			}
-			break;
+		if (rename(tmpnames[target], targets[target].filename) != 0) {
+			LOG_ERR("Failed to rename temp file to: %s", targets[target].filename);
+			goto error;
 		}
 
-		case GM_TXTR:
-		{
-			WRITE_U32LE(buffer, ptr->entry_count);
-			if (fwrite(buffer, 4, 1, tmp) != 1) {
-				goto error;
-			}
-			const uint32_t fileinfo_offset = (uint32_t)ptr->offset + 12 + 4 * ptr->entry_count;
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				WRITE_U32LE(buffer, fileinfo_offset + i * 12);
-				if (fwrite(buffer, 4, 1, tmp) != 1) {
-					goto error;
-				}
-			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				struct gm_patched_entry *entry = &ptr->entries[i];
-				WRITE_U32LE(buffer, entry->entry->meta.txtr.unknown1);
-				WRITE_U32LE(buffer + 4, entry->entry->meta.txtr.unknown2);
-				WRITE_U32LE(buffer + 8, entry->offset);
-				if (fwrite(buffer, 12, 1, tmp) != 1) {
-					goto error;
-				}
-			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				struct gm_patched_entry *entry = &ptr->entries[i];
-				if (entry->patch) {
-					if (fseeko(tmp, entry->offset, SEEK_SET) != 0) {
-						goto error;
-					}
-					if (gm_write_patch_data(tmp, entry->patch) != 0) {
-						goto error;
-					}
-				}
-				else if (gm_copydata(game, entry->entry->offset, tmp, entry->offset, entry->size) != 0) {
-					goto error;
-				}
-			}
-			break;
+		gm_remove_index_cache(targets[target].filename);
+
+		free(tmpnames[target]);
+		tmpnames[target] = NULL;
+	}
+
+	if (delta.plan) {
+		struct gm_archive *patched = gm_open_archive(filename);
+		if (!patched) {
+			goto error;
 		}
 
-		case GM_AUDO:
-			WRITE_U32LE(buffer, ptr->entry_count);
-			if (fwrite(buffer, 4, 1, tmp) != 1) {
-				goto error;
-			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				uint32_t offset = ptr->entries[i].offset - 4;
-				WRITE_U32LE(buffer, offset);
-				if (fwrite(buffer, 4, 1, tmp) != 1) {
-					goto error;
-				}
+		delta.patched_size        = patched->size;
+		delta.patched_fingerprint = gm_archive_fingerprint(patched);
+		gm_close_archive(patched);
+
+		if (gm_write_delta(&delta, deltaname) != 0) {
+			LOG_ERR("Failed to write delta: %s", deltaname);
+			goto error;
+		}
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+
+		free(journalname);
+		free(deltaname);
+		gm_free_delta(&delta);
+
+		if (game) {
+			fclose(game);
+		}
+
+		for (size_t target = 0; target < target_count; ++ target) {
+			if (tmps && tmps[target]) {
+				fclose(tmps[target]);
 			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				struct gm_patched_entry *entry = &ptr->entries[i];
-				if (entry->patch) {
-					if (fseeko(tmp, entry->offset - 4, SEEK_SET) != 0) {
-						goto error;
-					}
-					WRITE_U32LE(buffer, entry->patch->size);
-					if (fwrite(buffer, 4, 1, tmp) != 1) {
-						goto error;
-					}
-					if (gm_write_patch_data(tmp, entry->patch) != 0) {
-						goto error;
-					}
-				}
-				else if (gm_copydata(game, entry->entry->offset - 4, tmp, entry->offset - 4, entry->size + 4) != 0) {
-					goto error;
-				}
+
+			if (tmpnames && tmpnames[target]) {
+				unlink(tmpnames[target]);
+				free(tmpnames[target]);
 			}
-			break;
 
-		default:
-			if (gm_copydata(game, ptr->index->offset, tmp, ptr->offset, ptr->size + 8) != 0) {
-				goto error;
+			if (plans) {
+				gm_free_plan(plans[target]);
 			}
 		}
+
+		free(tmps);
+		free(tmpnames);
+		free(plans);
+
+		if (index) {
+			gm_free_index(index);
+			index = NULL;
+		}
+
+		if (archive) {
+			gm_close_archive(archive);
+			archive = NULL;
+		}
+
+		errno = errnum;
 	}
 
-	if (fclose(game) != 0) {
-		game = NULL;
+	return status;
+}
+
+int gm_compact_archive(const char *filename) {
+	char *journalname = NULL;
+	struct gm_archive *archive = NULL;
+	struct gm_index *index     = NULL;
+	struct gm_plan *plan       = NULL;
+	int status = 0;
+
+	journalname = GM_CONCAT(filename, GM_JOURNAL_EXT);
+	if (journalname == NULL) {
 		goto error;
 	}
 
-	if (fclose(tmp) != 0) {
-		tmp = NULL;
+	if (gm_replay_journal(filename, journalname) < 0) {
 		goto error;
 	}
 
-	// delete target mainly to make it work on windows:
-	if (unlink(filename) != 0) {
-		LOG_ERR("Failed to remove original game archive: %s", filename);
+	archive = gm_open_archive(filename);
+	if (!archive) {
 		goto error;
 	}
 
-	if (rename(tmpname, filename) != 0) {
-		LOG_ERR("Failed to rename temp file to: %s", filename);
+	// everything else is copied as it is
+	index = gm_read_index_ex(archive, GM_SECTION_BIT(GM_TXTR) | GM_SECTION_BIT(GM_AUDO),
+	                         GM_INDEX_LAZY | gm_default_index_flags());
+	if (!index) {
 		goto error;
 	}
 
-	goto end;
-
-error:
-	status = -1;
-	int errnum = errno;
-
-	if (game) {
-		fclose(game);
-		game = NULL;
+	plan = gm_plan_compact(index);
+	if (!plan) {
+		goto error;
 	}
 
-	if (tmp) {
-		fclose(tmp);
-		tmp = NULL;
+	if (gm_write_archive(filename, archive, plan, 0) != 0) {
+		goto error;
 	}
 
-	if (tmpname[0]) {
-		unlink(tmpname);
-	}
+	goto end;
 
-	// keep the original error
-	errno = errnum;
+error:
+	status = -1;
 
 end:
+	{
+		int errnum = errno;
 
-	if (tmpname) {
-		free(tmpname);
-		tmpname = NULL;
-	}
+		free(journalname);
 
-	if (index) {
-		gm_free_index(index);
-		index = NULL;
-	}
+		if (index) {
+			gm_free_index(index);
+			index = NULL;
+		}
 
-	if (patched) {
-		gm_free_patched_index(patched);
-		patched = NULL;
+		if (archive) {
+			gm_close_archive(archive);
+			archive = NULL;
+		}
+
+		if (plan) {
+			gm_free_plan(plan);
+			plan = NULL;
+		}
+
+		errno = errnum;
 	}
 
 	return status;
@@ -1617,6 +7297,7 @@ static int gm_patch_scan_dir(struct gm_patch_buf *pbuf, const char *dirname, con
 			struct gm_patch *patch = &pbuf->patches[pbuf->size];
 			patch->index        = index;
 			patch->patch_src    = GM_SRC_FILE;
+			patch->hash         = 0;
 			patch->src.filename = GM_JOIN_PATH(dirname, subdirname, entry->d_name);
 
 			if (patch->src.filename == NULL) {
@@ -1712,8 +7393,11 @@ static int gm_read_audo_info(FILE *fp, struct gm_patch *patch) {
 }
 
 int gm_patch_archive_from_dir(const char *filename, const char *dirname) {
+	return gm_patch_archive_from_dir_ex(filename, dirname, 0);
+}
+
+struct gm_patch *gm_read_patch_dir(const char *dirname) {
 	struct gm_patch_buf pbuf;
-	int status = 0;
 
 	pbuf.capacity = 256;
 	pbuf.size     = 0;
@@ -1734,17 +7418,36 @@ int gm_patch_archive_from_dir(const char *filename, const char *dirname) {
 
 	pbuf.patches[pbuf.size].section = GM_END;
 
-	if (gm_patch_archive(filename, pbuf.patches) != 0) {
-		goto error;
-	}
-
-	goto end;
+	return pbuf.patches;
 
 error:
-	status = -1;
+	{
+		int errnum = errno;
+		gm_patch_buf_cleanup(&pbuf);
+		errno = errnum;
+	}
 
-end:
+	return NULL;
+}
+
+void gm_free_patch_dir(struct gm_patch *patches) {
+	struct gm_patch_buf pbuf = { .patches = patches };
 	gm_patch_buf_cleanup(&pbuf);
+}
+
+int gm_patch_archive_from_dir_ex(const char *filename, const char *dirname, int flags) {
+	struct gm_patch *patches = gm_read_patch_dir(dirname);
+	if (!patches) {
+		return -1;
+	}
+
+	const int status = gm_patch_archive_ex(filename, patches, flags);
+
+	{
+		int errnum = errno;
+		gm_free_patch_dir(patches);
+		errno = errnum;
+	}
 
 	return status;
 }
@@ -1775,7 +7478,7 @@ const char *gm_typename(enum gm_filetype type) {
 #define GM_STR(X) #X
 #define GM_LEN(X) sizeof(GM_STR(X))
 
-int gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir) {
+int gm_dump_archive_files(const struct gm_index *index, const struct gm_archive *game, const char *outdir) {
 	char *subdir = NULL;
 	int status = 0;
 
@@ -1795,6 +7498,17 @@ int gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir)
 			continue;
 		}
 
+		if (!index->loaded) {
+			LOG_ERR("entries of %s section where not loaded", gm_section_name(index->section));
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		if (subdir) {
+			free(subdir);
+			subdir = NULL;
+		}
 
 		subdir = GM_JOIN_PATH(outdir, dir);
 		if (subdir == NULL) {
@@ -1836,11 +7550,28 @@ int gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir)
 				goto error;
 			}
 
-			if (gm_copydata(game, entry->offset, fp, 0, entry->size) != 0) {
+			if ((uint64_t)entry->offset > game->size || entry->size > game->size - (size_t)entry->offset) {
+				LOG_ERR("section %s, entry %" PRIuPTR " exceeds archive: offset = %" PRIi64 ", size = %" PRIuPTR ", archive size = %" PRIuPTR,
+				        gm_section_name(index->section), i, (int64_t)entry->offset, entry->size, game->size);
+
+				fclose(fp);
+				errno = EINVAL;
+				goto error;
+			}
+
+			if (i + 1 < index->entry_count) {
+				const struct gm_entry *next = &index->entries[i + 1];
+				gm_advise_archive(game, (size_t)next->offset, next->size, GM_ADVICE_WILLNEED);
+			}
+
+			if (entry->size > 0 && fwrite(game->data + entry->offset, entry->size, 1, fp) != 1) {
 				fclose(fp);
 				goto error;
 			}
 
+			gm_advise_archive(game, (size_t)entry->offset, entry->size, GM_ADVICE_DONTNEED);
+			gm_start_writeback(fp);
+
 			if (fclose(fp) != 0) {
 				goto error;
 			}
@@ -1861,6 +7592,21 @@ end:
 	return status;
 }
 
+int gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir) {
+	struct gm_archive *archive = gm_archive_from_file(game);
+	if (!archive) {
+		return -1;
+	}
+
+	int status = gm_dump_archive_files(index, archive, outdir);
+	int errnum = errno;
+
+	gm_close_archive(archive);
+
+	errno = errnum;
+	return status;
+}
+
 char *gm_concat(const char *strs[], size_t nstrs) {
 	size_t size = 1;
 	char *buf = NULL;
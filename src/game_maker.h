@@ -3,6 +3,7 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <inttypes.h>
 
 #if defined(_WIN16) || defined(_WIN32) || defined(_WIN64)
@@ -55,6 +56,58 @@ enum gm_section {
 	GM_TGIN,
 };
 
+#define GM_SECTION_COUNT (GM_TGIN + 1)
+#define GM_SECTION_BIT(SECTION) (UINT32_C(1) << (SECTION))
+#define GM_ALL_SECTIONS UINT32_MAX
+
+enum gm_index_flags {
+	// keep a reference to the archive so that entries of sections not
+	// requested via the section mask are parsed on first gm_load_section()
+	GM_INDEX_LAZY = 1,
+
+	// load the index from a sidecar cache file next to the archive (only for
+	// archives opened via gm_open_archive()) and (re-)write it when missing
+	// or stale, see gm_default_index_flags()
+	GM_INDEX_CACHE = 2,
+};
+
+// the tools enable GM_INDEX_CACHE when this environment variable is set
+#define GM_INDEX_CACHE_ENV "GM_INDEX_CACHE"
+#define GM_INDEX_CACHE_EXT ".gmidx"
+
+// Patches that don't move anything are written directly into the archive.
+// The changed bytes are first saved to this redo journal next to it, so an
+// interrupted write is finished by the next gm_patch_archive() call.
+#define GM_JOURNAL_EXT ".gmjournal"
+
+enum gm_patch_flags {
+	// Don't move anything. TXTR and AUDO replacements that are bigger than
+	// the old data are appended to the end of the archive and only the offset
+	// tables are changed, so the archive is patched in place. The old data
+	// stays as dead space until gm_compact_archive() is called.
+	GM_PATCH_APPEND = 1,
+
+	// Write a reverse delta (GM_DELTA_EXT) that restores the unpatched
+	// archive, see gm_unpatch_archive(). An existing delta is updated, so it
+	// always leads back to the archive before the first patch.
+	GM_PATCH_DELTA = 2,
+
+	// Save the plan (GM_PLAN_EXT) and reuse it as long as the archive and the
+	// patches are the same, e.g. to patch again after every game update.
+	GM_PATCH_PLAN_CACHE = 4,
+
+	// Fill the new archive through a writable mapping instead of copying the
+	// unchanged parts with write calls. Only used where the whole file could
+	// be allocated up front, otherwise the normal writer is used.
+	GM_PATCH_MAP_OUTPUT = 8,
+};
+
+// The reverse delta contains the original bytes of everything a patch
+// replaced and where everything else is found in the patched archive.
+#define GM_DELTA_EXT ".gmdelta"
+
+#define GM_PLAN_EXT ".gmplan"
+
 enum gm_patch_src {
 	GM_SRC_MEM,
 	GM_SRC_FILE,
@@ -75,6 +128,7 @@ struct gm_patch {
 	enum gm_filetype  type;
 	enum gm_patch_src patch_src;
 	size_t            size;
+	uint64_t          hash; // FNV-1a 64 of the payload, 0 if not known in advance
 
 	union {
 		const uint8_t *data;
@@ -101,19 +155,28 @@ struct gm_patch {
 };
 
 #define GM_PATCH_STRG(INDEX, OLD, NEW) \
-	{ GM_STRG, (INDEX), GM_TXT, GM_SRC_MEM, 0, { .data = NULL }, { .strg = { (OLD), (NEW) } } }
+	{ GM_STRG, (INDEX), GM_TXT, GM_SRC_MEM, 0, 0, { .data = NULL }, { .strg = { (OLD), (NEW) } } }
 
 #define GM_PATCH_SPRT(NAME, ENTRIES, ENTRY_COUNT) \
-	{ GM_SPRT, 0, GM_PNG, GM_SRC_MEM, 0, { .data = NULL }, { .sprt = { (NAME), (ENTRY_COUNT), (ENTRIES) } } }
+	{ GM_SPRT, 0, GM_PNG, GM_SRC_MEM, 0, 0, { .data = NULL }, { .sprt = { (NAME), (ENTRY_COUNT), (ENTRIES) } } }
 
-#define GM_PATCH_TXTR(INDEX, DATA, SIZE, WIDTH, HEIGHT) \
-	{ GM_TXTR, (INDEX), GM_PNG, GM_SRC_MEM, (SIZE), { .data = (DATA) }, { .txtr = { (WIDTH), (HEIGHT) } } }
+#define GM_PATCH_TXTR(INDEX, DATA, SIZE, HASH, WIDTH, HEIGHT) \
+	{ GM_TXTR, (INDEX), GM_PNG, GM_SRC_MEM, (SIZE), (HASH), { .data = (DATA) }, { .txtr = { (WIDTH), (HEIGHT) } } }
 
-#define GM_PATCH_AUDO(INDEX, DATA, SIZE, TYPE) \
-	{ GM_AUDO, (INDEX), (TYPE), GM_SRC_MEM, (SIZE), { .data = (DATA) }, { .txtr = { 0, 0 } } }
+#define GM_PATCH_AUDO(INDEX, DATA, SIZE, HASH, TYPE) \
+	{ GM_AUDO, (INDEX), (TYPE), GM_SRC_MEM, (SIZE), (HASH), { .data = (DATA) }, { .txtr = { 0, 0 } } }
 
 #define GM_PATCH_END \
-	{ GM_END, 0, GM_UNKNOWN, GM_SRC_MEM, 0, { .data = NULL }, { .txtr = { 0, 0 } } }
+	{ GM_END, 0, GM_UNKNOWN, GM_SRC_MEM, 0, 0, { .data = NULL }, { .txtr = { 0, 0 } } }
+
+// One output archive of gm_patch_archive_fanout(). All outputs are written
+// from one pass over the source archive, which itself isn't changed (unless
+// it is one of the outputs). Only an output that replaces the source gets a
+// reverse delta, like with gm_patch_archive_ex().
+struct gm_patch_target {
+	const char *filename;
+	const struct gm_patch *patches;
+};
 
 struct gm_tpag {
 	size_t x;
@@ -137,15 +200,17 @@ struct gm_entry {
 		} txtr;
 
 		struct {
-			char *name;
+			const char *name;
 			size_t tpag_count;
 			struct gm_tpag *tpag;
 		} sprt;
 
-		char *strg;
+		const char *strg;
 	} meta;
 };
 
+struct gm_lookup;
+
 struct gm_index {
 	enum gm_section section;
 
@@ -154,12 +219,32 @@ struct gm_index {
 
 	size_t entry_count;
 	struct gm_entry *entries;
+
+	const struct gm_lookup *lookup;
+
+	// whether entries were parsed, see gm_read_index_ex()
+	int loaded;
+};
+
+struct gm_archive {
+	const uint8_t *data;
+	size_t         size;
+	int            mapped;
+
+	// filename is only known when opened via gm_open_archive()
+	char          *filename;
+	int64_t        mtime;
+	int64_t        mtime_nsec;
+	uint64_t       inode;
 };
 
 struct gm_patched_entry {
 	off_t  offset;
 	size_t size;
 
+	// stored after the end of the last section, see GM_PATCH_APPEND
+	bool appended;
+
 	const struct gm_patch *patch;
 	const struct gm_entry *entry;
 };
@@ -176,26 +261,86 @@ struct gm_patched_index {
 	const struct gm_index *index;
 };
 
+enum gm_extent_type {
+	GM_EXTENT_COPY,  // bytes copied from the original archive
+	GM_EXTENT_DATA,  // bytes generated by the planner (headers, tables, strings)
+	GM_EXTENT_PATCH, // payload of a patch
+};
+
+struct gm_extent {
+	enum gm_extent_type type;
+
+	off_t  offset; // offset in the new archive
+	size_t size;
+
+	union {
+		off_t                  src_offset;  // GM_EXTENT_COPY
+		size_t                 data_offset; // GM_EXTENT_DATA, offset into gm_plan::data
+		const struct gm_patch *patch;       // GM_EXTENT_PATCH
+	} src;
+};
+
+// Everything needed to write a patched archive. The extents are sorted by
+// offset and cover the whole new archive without any gaps.
+struct gm_plan {
+	size_t size;
+
+	size_t extent_count;
+	size_t extent_capacity;
+	struct gm_extent *extents;
+
+	size_t   data_size;
+	size_t   data_capacity;
+	uint8_t *data;
+};
+
 struct gm_patched_index *gm_get_section(struct gm_patched_index *patched, enum gm_section section);
+struct gm_index         *gm_find_section(const struct gm_index *index, enum gm_section section);
 size_t                   gm_index_length(const struct gm_index *index);
 int                      gm_patch_archive(const char *filename, const struct gm_patch *patches);
+int                      gm_patch_archive_ex(const char *filename, const struct gm_patch *patches, int flags);
 int                      gm_patch_archive_from_dir(const char *filename, const char *dirname);
+int                      gm_patch_archive_from_dir_ex(const char *filename, const char *dirname, int flags);
+int                      gm_patch_archive_layers(const char *filename, const struct gm_patch *const layers[], size_t layer_count, int flags);
+int                      gm_patch_archive_fanout(const char *filename, const struct gm_patch_target *targets, size_t target_count, int flags);
+struct gm_patch         *gm_merge_patches(const struct gm_patch *const layers[], size_t layer_count);
+struct gm_patch         *gm_read_patch_dir(const char *dirname);
+void                     gm_free_patch_dir(struct gm_patch *patches);
+int                      gm_compact_archive(const char *filename);
+int                      gm_unpatch_archive(const char *filename);
+int                      gm_verify_delta(const char *filename);
 int                      gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch);
-int                      gm_shift_tail(struct gm_patched_index *index, off_t offset);
+int                      gm_layout_patched_index(struct gm_patched_index *index);
+struct gm_plan          *gm_plan_patched_index(const struct gm_patched_index *index);
+struct gm_plan          *gm_plan_patches(const struct gm_index *index, const struct gm_patch *patches);
+struct gm_plan          *gm_plan_patches_ex(const struct gm_index *index, const struct gm_patch *patches, int flags);
+struct gm_plan          *gm_plan_compact(const struct gm_index *index);
+int                      gm_write_plan(const struct gm_plan *plan, FILE *src, FILE *dst);
+int                      gm_write_plans(const struct gm_plan *const plans[], FILE *src, FILE *const dsts[], size_t count);
+void                     gm_free_plan(struct gm_plan *plan);
+int                      gm_save_plan(const char *planname, const struct gm_plan *plan, const struct gm_archive *archive, const struct gm_patch *patches, int flags);
+int                      gm_load_plan(const char *planname, const struct gm_archive *archive, const struct gm_patch *patches, int flags, struct gm_plan **plan);
+int                      gm_copy_file(const char *srcname, const char *dstname);
 void                     gm_free_patched_index(struct gm_patched_index *index);
 const char              *gm_section_name(enum gm_section section);
 const char              *gm_extension(enum gm_filetype type);
 const char              *gm_typename(enum gm_filetype type);
 enum gm_section          gm_parse_section(const uint8_t *magic);
-int                      gm_read_index_sprt(FILE *game, struct gm_index *section);
-int                      gm_read_index_strg(FILE *game, struct gm_index *section);
-int                      gm_read_index_txtr(FILE *game, struct gm_index *section);
-int                      gm_read_index_audo(FILE *game, struct gm_index *section);
+struct gm_archive       *gm_open_archive(const char *filename);
+struct gm_archive       *gm_archive_from_file(FILE *game);
+void                     gm_close_archive(struct gm_archive *archive);
+struct gm_index         *gm_read_archive_index(const struct gm_archive *game);
+struct gm_index         *gm_read_index_ex(const struct gm_archive *game, uint32_t section_mask, int flags);
+int                      gm_default_index_flags(void);
+int                      gm_load_section(struct gm_index *index, struct gm_index *section);
 struct gm_index         *gm_read_index(FILE *game);
+const char              *gm_get_string(const struct gm_index *strg, off_t offset);
+const struct gm_entry   *gm_find_sprite(const struct gm_index *sprt, const char *name);
 void                     gm_free_index(struct gm_index *index);
-size_t                   gm_form_size(const struct gm_patched_index *index);
+uint64_t                 gm_form_size(const struct gm_patched_index *index);
 int                      gm_write_hdr(FILE *fp, const uint8_t *magic, size_t size);
 int                      gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir);
+int                      gm_dump_archive_files(const struct gm_index *index, const struct gm_archive *game, const char *outdir);
 char                    *gm_concat(const char *strs[], size_t nstrs);
 char                    *gm_join_path(const char *comps[], size_t ncomps);
 
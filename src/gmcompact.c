@@ -0,0 +1,72 @@
+#include "game_maker.h"
+#include "csd3_find_archive.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[]) {
+	int status = 0;
+	const char *gamename = NULL;
+	char *pathbuf = NULL;
+	struct stat info;
+
+	if (argc > 2) {
+		fprintf(stderr, "*** usage: %s [archive]\n", argv[0]);
+		goto error;
+	}
+
+	if (argc == 2) {
+		gamename = argv[1];
+	}
+	else {
+		pathbuf = csd3_find_archive();
+		if (pathbuf == NULL) {
+			fprintf(stderr, "*** ERROR: Couldn't find %s file.\n", CSH3_GAME_ARCHIVE);
+			goto error;
+		}
+		gamename = pathbuf;
+		printf("Found archive: %s\n", gamename);
+	}
+
+	if (stat(gamename, &info) < 0) {
+		perror(gamename);
+		goto error;
+	}
+	const int64_t old_size = (int64_t)info.st_size;
+
+	// drop the data left behind by gmupdate --append
+	if (gm_compact_archive(gamename) != 0) {
+		fprintf(stderr, "*** ERROR: Error compacting archive: %s\n", strerror(errno));
+		goto error;
+	}
+
+	if (stat(gamename, &info) < 0) {
+		perror(gamename);
+		goto error;
+	}
+
+	printf("Successfully compacted archive (%" PRIi64 " -> %" PRIi64 " bytes).\n", old_size, (int64_t)info.st_size);
+
+	goto end;
+
+error:
+	status = 1;
+
+end:
+	if (pathbuf) {
+		free(pathbuf);
+		pathbuf = NULL;
+	}
+
+#ifdef GM_WINDOWS
+	printf("Press ENTER to continue...");
+	getchar();
+#endif
+
+	return status;
+}
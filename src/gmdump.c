@@ -9,7 +9,7 @@
 
 int main(int argc, char *argv[]) {
 	int status = 0;
-	FILE *game = NULL;
+	struct gm_archive *game = NULL;
 	struct gm_index *index = NULL;
 	const char *outdir = ".";
 	const char *gamename = NULL;
@@ -47,20 +47,20 @@ int main(int argc, char *argv[]) {
 	}
 
 	printf("Reading archive...\n");
-	game = fopen(gamename, "rb");
+	game = gm_open_archive(gamename);
 	if (!game) {
 		perror(gamename);
 		goto error;
 	}
 
-	index = gm_read_index(game);
+	index = gm_read_index_ex(game, GM_SECTION_BIT(GM_TXTR) | GM_SECTION_BIT(GM_AUDO), gm_default_index_flags());
 	if (!index) {
 		perror(gamename);
 		goto error;
 	}
 
 	printf("Dumping files...\n");
-	if (gm_dump_files(index, game, outdir) != 0) {
+	if (gm_dump_archive_files(index, game, outdir) != 0) {
 		perror(gamename);
 		goto error;
 	}
@@ -79,7 +79,7 @@ end:
 	}
 
 	if (game) {
-		fclose(game);
+		gm_close_archive(game);
 		game = NULL;
 	}
 
@@ -6,23 +6,29 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 static void gm_print_info(const struct gm_index *index, FILE *out) {
 	fprintf(out, "Offset       Size             Type      Index Info\n");
 	for (; index->section != GM_END; ++ index) {
-		fprintf(out, "0x%010" PRIXPTR " 0x%010" PRIXPTR " --- %-9s -----",
-			(size_t)index->offset,
+		fprintf(out, "0x%010" PRIX64 " 0x%010" PRIXPTR " --- %-9s -----",
+			(uint64_t)index->offset,
 			index->size,
 			gm_section_name(index->section));
 
 		switch (index->section) {
 			case GM_AUDO:
 			case GM_TXTR:
+				if (!index->loaded) {
+					fprintf(out, "\n");
+					break;
+				}
+
 				fprintf(out, " %" PRIuPTR " entries\n", index->entry_count);
 				for (size_t entry_index = 0; entry_index < index->entry_count; ++ entry_index) {
 					const struct gm_entry *entry = &index->entries[entry_index];
-					fprintf(out, "0x%010" PRIXPTR " 0x%010" PRIXPTR "     %-9s %5" PRIuPTR,
-						(size_t)entry->offset,
+					fprintf(out, "0x%010" PRIX64 " 0x%010" PRIXPTR "     %-9s %5" PRIuPTR,
+						(uint64_t)entry->offset,
 						entry->size,
 						gm_typename(entry->type),
 						entry_index);
@@ -45,20 +51,29 @@ static void gm_print_info(const struct gm_index *index, FILE *out) {
 
 int main(int argc, char *argv[]) {
 	int status = 0;
-	FILE *game = NULL;
+	struct gm_archive *game = NULL;
 	struct gm_index *index = NULL;
 	const char *gamename = NULL;
 	char *pathbuf = NULL;
+	uint32_t section_mask = GM_SECTION_BIT(GM_TXTR) | GM_SECTION_BIT(GM_AUDO);
 
-	if (argc > 2) {
-		fprintf(stderr, "*** usage: %s [archive]\n", argv[0]);
-		goto error;
-	}
+	for (int i = 1; i < argc; ++ i) {
+		const char *arg = argv[i];
 
-	if (argc > 1) {
-		gamename = argv[1];
+		if (strcmp(arg, "--sections") == 0) {
+			// only print the section table
+			section_mask = 0;
+		}
+		else if (gamename == NULL) {
+			gamename = arg;
+		}
+		else {
+			fprintf(stderr, "*** usage: %s [--sections] [archive]\n", argv[0]);
+			goto error;
+		}
 	}
-	else {
+
+	if (gamename == NULL) {
 		pathbuf = csd3_find_archive();
 		if (pathbuf == NULL) {
 			fprintf(stderr, "*** ERROR: Couldn't find %s file.\n", CSH3_GAME_ARCHIVE);
@@ -68,13 +83,14 @@ int main(int argc, char *argv[]) {
 		printf("Found archive: %s\n", gamename);
 	}
 
-	game = fopen(gamename, "rb");
+	game = gm_open_archive(gamename);
 	if (!game) {
 		perror(gamename);
 		goto error;
 	}
 
-	index = gm_read_index(game);
+	// the cache always holds all entries, which aren't wanted with --sections
+	index = gm_read_index_ex(game, section_mask, section_mask ? gm_default_index_flags() : 0);
 	if (!index) {
 		perror(gamename);
 		goto error;
@@ -94,7 +110,7 @@ end:
 	}
 
 	if (game) {
-		fclose(game);
+		gm_close_archive(game);
 		game = NULL;
 	}
 
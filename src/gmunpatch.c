@@ -0,0 +1,75 @@
+#include "game_maker.h"
+#include "csd3_find_archive.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[]) {
+	int status = 0;
+	const char *gamename = NULL;
+	char *pathbuf = NULL;
+	bool verify = false;
+	int argind = 1;
+
+	if (argind < argc && strcmp(argv[argind], "--verify") == 0) {
+		verify = true;
+		++ argind;
+	}
+
+	if (argc - argind > 1) {
+		fprintf(stderr, "*** usage: %s [--verify] [archive]\n", argv[0]);
+		goto error;
+	}
+
+	if (argind < argc) {
+		gamename = argv[argind];
+	}
+	else {
+		pathbuf = csd3_find_archive();
+		if (pathbuf == NULL) {
+			fprintf(stderr, "*** ERROR: Couldn't find %s file.\n", CSH3_GAME_ARCHIVE);
+			goto error;
+		}
+		gamename = pathbuf;
+		printf("Found archive: %s\n", gamename);
+	}
+
+	if (verify) {
+		if (gm_verify_delta(gamename) != 0) {
+			fprintf(stderr, "*** ERROR: Error verifying %s%s: %s\n", gamename, GM_DELTA_EXT, strerror(errno));
+			goto error;
+		}
+
+		printf("%s%s restores the original archive.\n", gamename, GM_DELTA_EXT);
+	}
+	else {
+		// restores the archive from the delta written when it was patched
+		if (gm_unpatch_archive(gamename) != 0) {
+			fprintf(stderr, "*** ERROR: Error restoring archive: %s\n", strerror(errno));
+			goto error;
+		}
+
+		printf("Successfully restored the original archive.\n");
+	}
+
+	goto end;
+
+error:
+	status = 1;
+
+end:
+	if (pathbuf) {
+		free(pathbuf);
+		pathbuf = NULL;
+	}
+
+#ifdef GM_WINDOWS
+	printf("Press ENTER to continue...");
+	getchar();
+#endif
+
+	return status;
+}
@@ -11,16 +11,33 @@
 
 int main(int argc, char *argv[]) {
 	int status = 0;
-	const char *indir = ".";
 	const char *gamename = NULL;
 	char *pathbuf = NULL;
+	const char **dirs = NULL;
+	struct gm_patch **layers = NULL;
+	size_t dir_count = 0;
+	int flags = 0;
+	int argind = 1;
 
-	if (argc > 3) {
-		fprintf(stderr, "*** usage: %s [archive] [dir]\n", argv[0]);
+	if (argind < argc && strcmp(argv[argind], "--append") == 0) {
+		flags |= GM_PATCH_APPEND;
+		++ argind;
+	}
+
+	// plans are cached together with the index while working on a mod
+	if (gm_default_index_flags() & GM_INDEX_CACHE) {
+		flags |= GM_PATCH_PLAN_CACHE;
+	}
+
+	// later directories override patches of earlier ones
+	dirs   = calloc(argc, sizeof(const char*));
+	layers = calloc(argc, sizeof(struct gm_patch*));
+	if (!dirs || !layers) {
+		perror("*** ERROR");
 		goto error;
 	}
 
-	for (int i = 1; i < argc; ++ i) {
+	for (int i = argind; i < argc; ++ i) {
 		char *arg = argv[i];
 		struct stat info;
 
@@ -29,11 +46,19 @@ int main(int argc, char *argv[]) {
 			goto error;
 		}
 		else if (S_ISDIR(info.st_mode)) {
-			indir = arg;
+			dirs[dir_count ++] = arg;
 		}
-		else {
+		else if (gamename == NULL) {
 			gamename = arg;
 		}
+		else {
+			fprintf(stderr, "*** usage: %s [--append] [archive] [dir...]\n", argv[0]);
+			goto error;
+		}
+	}
+
+	if (dir_count == 0) {
+		dirs[dir_count ++] = ".";
 	}
 
 	if (gamename == NULL) {
@@ -46,8 +71,16 @@ int main(int argc, char *argv[]) {
 		printf("Found archive: %s\n", gamename);
 	}
 
-	// patch the archive
-	if (gm_patch_archive_from_dir(gamename, indir) != 0) {
+	for (size_t i = 0; i < dir_count; ++ i) {
+		layers[i] = gm_read_patch_dir(dirs[i]);
+		if (!layers[i]) {
+			fprintf(stderr, "*** ERROR: Error reading patches from %s: %s\n", dirs[i], strerror(errno));
+			goto error;
+		}
+	}
+
+	// patch the archive with all directories in one go
+	if (gm_patch_archive_layers(gamename, (const struct gm_patch *const*)layers, dir_count, flags) != 0) {
 		fprintf(stderr, "*** ERROR: Error patching archive: %s\n", strerror(errno));
 		goto error;
 	}
@@ -60,6 +93,19 @@ error:
 	status = 1;
 
 end:
+	if (layers) {
+		for (size_t i = 0; i < dir_count; ++ i) {
+			if (layers[i]) {
+				gm_free_patch_dir(layers[i]);
+			}
+		}
+		free(layers);
+		layers = NULL;
+	}
+
+	free(dirs);
+	dirs = NULL;
+
 	if (pathbuf) {
 		free(pathbuf);
 		pathbuf = NULL;
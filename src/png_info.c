@@ -1,7 +1,9 @@
 #include "png_info.h"
 
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <sys/types.h>
 
 #if defined(__linux__) || defined(__CYGWIN__)
 
@@ -139,24 +141,74 @@ struct png_ihdr_chunk {
 };
 #pragma pack(pop)
 
-int parse_png_info(FILE *file, struct png_info *info) {
+// Chunk headers are read through this, either straight from memory or from
+// large aligned blocks of a file, so walking all chunks doesn't need a seek
+// per chunk.
+#define PNG_READ_BLOCK_SIZE (256 * 1024)
+
+struct png_reader {
+	FILE          *file;
+	off_t          start;  // file offset of the PNG signature
+	const uint8_t *data;
+	size_t         size;   // number of valid bytes in data
+	size_t         offset; // offset of data relative to start
+	uint8_t       *buffer;
+};
+
+static const uint8_t *png_reader_get(struct png_reader *reader, size_t offset, size_t size) {
+	if (offset >= reader->offset && offset - reader->offset <= reader->size &&
+	    size <= reader->size - (offset - reader->offset)) {
+		return reader->data + (offset - reader->offset);
+	}
+
+	if (!reader->file) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// align blocks to the file, unless the requested range would cross a block boundary
+	size_t block_offset = offset - (size_t)((reader->start + (off_t)offset) % PNG_READ_BLOCK_SIZE);
+	if (offset - block_offset > PNG_READ_BLOCK_SIZE - size) {
+		block_offset = offset;
+	}
+
+	if (fseeko(reader->file, reader->start + (off_t)block_offset, SEEK_SET) != 0) {
+		return NULL;
+	}
+
+	const size_t count = fread(reader->buffer, 1, PNG_READ_BLOCK_SIZE, reader->file);
+	if (count < PNG_READ_BLOCK_SIZE && ferror(reader->file)) {
+		return NULL;
+	}
+
+	reader->data   = reader->buffer;
+	reader->size   = count;
+	reader->offset = block_offset;
+
+	if (offset - block_offset > count || size > count - (offset - block_offset)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return reader->data + (offset - block_offset);
+}
+
+static int png_parse(struct png_reader *reader, struct png_info *info) {
 	size_t filesize = 0;
-	char signature[PNG_SIGNATURE_SIZE];
 
-	if (fread(signature, PNG_SIGNATURE_SIZE, 1, file) != 1) {
+	const uint8_t *data = png_reader_get(reader, 0, PNG_SIGNATURE_SIZE + PNG_IHDR_SIZE);
+	if (!data) {
 		return -1;
 	}
 
-	if (memcmp(signature, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) != 0) {
+	if (memcmp(data, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) != 0) {
 		errno = EINVAL;
 		return -1;
 	}
 
 	struct png_ihdr_chunk ihdr;
 
-	if (fread(&ihdr, PNG_IHDR_SIZE, 1, file) != 1) {
-		return -1;
-	}
+	memcpy(&ihdr, data + PNG_SIGNATURE_SIZE, PNG_IHDR_SIZE);
 
 	ihdr.size   = be32toh(ihdr.size);
 	ihdr.width  = be32toh(ihdr.width);
@@ -174,19 +226,19 @@ int parse_png_info(FILE *file, struct png_info *info) {
 	}
 
 	filesize = PNG_SIGNATURE_SIZE + PNG_IHDR_SIZE;
-	
+
 	if (ihdr.width > INT32_MAX || ihdr.height > INT32_MAX) {
 		errno = EINVAL;
 		return -1;
 	}
-	
+
 	if (ihdr.bitdepth != 1 && ihdr.bitdepth != 2 &&
 		ihdr.bitdepth != 4 && ihdr.bitdepth != 8 &&
 		ihdr.bitdepth != 16) {
 		errno = EINVAL;
 		return -1;
 	}
-	
+
 	if (ihdr.colortype != 0 && ihdr.colortype != 2 &&
 		ihdr.colortype != 3 && ihdr.colortype != 4 &&
 		ihdr.colortype != 6) {
@@ -198,7 +250,7 @@ int parse_png_info(FILE *file, struct png_info *info) {
 		errno = EINVAL;
 		return -1;
 	}
-	
+
 	if (ihdr.interlace != 0 && ihdr.interlace != 1) {
 		errno = EINVAL;
 		return -1;
@@ -207,10 +259,13 @@ int parse_png_info(FILE *file, struct png_info *info) {
 	for (;;) {
 		struct png_chunk_header chunk_header;
 
-		if (fread(&chunk_header, PNG_CHUNK_HEADER_SIZE, 1, file) != 1) {
+		data = png_reader_get(reader, filesize, PNG_CHUNK_HEADER_SIZE);
+		if (!data) {
 			return -1;
 		}
 
+		memcpy(&chunk_header, data, PNG_CHUNK_HEADER_SIZE);
+
 		chunk_header.size = be32toh(chunk_header.size);
 
 		if (!IS_PNG_CHUNK_MAGIC(chunk_header.magic)) {
@@ -226,16 +281,17 @@ int parse_png_info(FILE *file, struct png_info *info) {
 		}
 		filesize += chunk_header.size + 12;
 
-		if (fseeko(file, chunk_header.size + 4, SEEK_CUR) != 0) {
-			return -1;
-		}
-
 		if (memcmp(chunk_header.magic, "IEND", 4) == 0) {
-			errno = EINVAL;
 			break;
 		}
 	}
 
+	// the whole PNG has to be there, including the CRC of IEND
+	if (!reader->file && filesize > reader->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	if (info) {
 		info->filesize    = filesize;
 		info->width       = ihdr.width;
@@ -249,3 +305,48 @@ int parse_png_info(FILE *file, struct png_info *info) {
 
 	return 0;
 }
+
+int parse_png_info(FILE *file, struct png_info *info) {
+	struct png_info file_info;
+	struct png_reader reader;
+	int status = 0;
+
+	memset(&reader, 0, sizeof(reader));
+
+	reader.file  = file;
+	reader.start = ftello(file);
+	if (reader.start < 0) {
+		return -1;
+	}
+
+	reader.buffer = malloc(PNG_READ_BLOCK_SIZE);
+	if (!reader.buffer) {
+		return -1;
+	}
+
+	status = png_parse(&reader, &file_info);
+
+	// leave the file position right after the PNG
+	if (status == 0 && fseeko(file, reader.start + (off_t)file_info.filesize, SEEK_SET) != 0) {
+		status = -1;
+	}
+
+	if (status == 0 && info) {
+		*info = file_info;
+	}
+
+	free(reader.buffer);
+
+	return status;
+}
+
+int parse_png_info_mem(const uint8_t *data, size_t size, struct png_info *info) {
+	struct png_reader reader;
+
+	memset(&reader, 0, sizeof(reader));
+
+	reader.data = data;
+	reader.size = size;
+
+	return png_parse(&reader, info);
+}
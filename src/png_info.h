@@ -21,6 +21,7 @@ struct png_info {
 };
 
 int parse_png_info(FILE *file, struct png_info *info);
+int parse_png_info_mem(const uint8_t *data, size_t size, struct png_info *info);
 
 #ifdef __cplusplus
 }